@@ -0,0 +1,676 @@
+/*
+ * bench_shell - Benchmarks for the shell.
+ *
+ * Usage: bench_shell [-n commands] [-m megabytes] [-l kilobytes]
+ *
+ * Measures:
+ * - commands/sec for a trivial external program, for every spawn backend,
+ *   and under timeout.
+ * - commands/sec for builtins (cd, true, echo and test, and echo redirected
+ *   to a file), and for a pipeline of two programs with redirections.
+ * - commands/sec for a small here-document and a here-string, and MB/s of a
+ *   large here-document.
+ * - commands/sec for a command substitution of a builtin, of a file and of
+ *   a program.
+ * - iterations/sec of loops over 100 * n words: with true as body, and with
+ *   an if in the body; lines/sec of a while read loop; iterations/sec of a
+ *   counted loop of 100 * n, with ((...)) and with [ ] and $((...)).
+ * - sessions/sec of a one-line script, run by a new shell each time, and by
+ *   a shell server (shell -s) through shell_client.
+ * - MB/s through pipelines of 1, 2, 4 and 8 stages of cat (in-shell and
+ *   /bin/cat), the latter with default and 1 MiB pipes.
+ * - history: entries/sec appended, time to open a history of 100 * n
+ *   entries, and time of a prefix / substring search through all of it.
+ * - MB/s of the parser (lex and parse_cmd) on long synthetic lines: plain,
+ *   with quotes, and with a variable in every word.
+ * - ms to expand a pattern matching all, and a tenth, of a directory of
+ *   10 * n files.
+ * - ms to build the completion trie for a PATH of n executables, and us
+ *   per command completion from it.
+ * - ms to paste a line as long into the line editor (on a pseudo-terminal)
+ *   and run it, and the bytes written back per byte pasted.
+ *
+ * Results are printed on stdout, one per line, as
+ *	<metric>\t<value>\t<unit>
+ * so that runs on different commits can be compared with diff / join.
+ * The shell's own output is discarded.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/* Name of file (in current directory) containing shell. */
+#define SHELL "./shell"
+/* Name of file (in current directory) containing the server client. */
+#define CLIENT "./shell_client"
+/* Error prefix */
+#define PREF "bench"
+
+/* Parser entry points, linked in from the shell. */
+struct lex_tok;
+struct lex_tok *lex(char *line);
+char **parse_cmd(struct lex_tok **tp, char ***assignsp, struct lex_tok ***redirsp);
+void arena_reset();
+
+/* Shell variables, linked in from the shell. */
+void var_put(const char *name, size_t len, const char *val, int flags);
+void var_unset(const char *name);
+
+/* History store, linked in from the shell. */
+void hist_open(char *path);
+void hist_add(const char *line);
+long hist_find_prefix(const char *prefix, size_t plen, long from);
+long hist_find_sub(const char *sub, size_t slen, long from);
+extern size_t idx_cnt;
+
+/* Completion, linked in from the shell. */
+size_t cmp_command(const char *prefix, size_t plen, char *ext, size_t *elenp);
+
+/* Parameters. */
+int ncmds = 10000;
+int nmegs = 256;
+int nkilos = 256;
+
+/* Scratch directory for scripts and data. */
+char tmpdir[] = "/tmp/benchXXXXXX";
+
+/*
+ * Handle error in system call.
+ * Print error and exit.
+ */
+void bench_err(int x) {
+	if (x < 0) {
+		perror(PREF);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Current time in seconds.
+ */
+double now() {
+	struct timespec ts;
+	bench_err(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void report(const char *metric, double value, const char *unit) {
+	printf("%s\t%.2f\t%s\n", metric, value, unit);
+	fflush(stdout);
+}
+
+/*
+ * Return a path in the scratch directory.
+ */
+#define BUFSIZE 256
+char *tmp_path(const char *name) {
+	static char buf[BUFSIZE];
+	snprintf(buf, BUFSIZE, "%s/%s", tmpdir, name);
+	return buf;
+}
+#undef BUFSIZE
+
+/*
+ * Write a script of n copies of line.
+ */
+void write_script(const char *path, const char *line, int n) {
+	FILE *f = fopen(path, "w");
+	if (!f) bench_err(-1);
+	while (n--) fprintf(f, "%s\n", line);
+	bench_err(fclose(f));
+}
+
+/*
+ * Run the shell on a script, with the environment variable var set to val
+ * (unless var is NULL), and return the time taken in seconds.
+ */
+double run_shell(const char *script, const char *var, const char *val) {
+	double start = now();
+	pid_t pid = fork();
+	bench_err(pid);
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+		bench_err(fd);
+		bench_err(dup2(fd, STDOUT_FILENO));
+		if (var) setenv(var, val, 1);
+		execl(SHELL, SHELL, script, (char *)NULL);
+		perror(SHELL);
+		_exit(EXIT_FAILURE);
+	}
+	int status;
+	bench_err(waitpid(pid, &status, 0));
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, PREF": %s failed\n", script);
+		exit(EXIT_FAILURE);
+	}
+	return now() - start;
+}
+
+/*
+ * Commands/sec for a trivial external program, for every backend and under
+ * timeout, and for a pipeline of two with redirections.
+ */
+char *backends[] = {
+	"posix_spawn",
+	"vfork",
+	"clone",
+	"fork",
+	NULL
+};
+
+#define BUFSIZE 64
+void bench_spawn() {
+	char buf[BUFSIZE];
+	char **b;
+	char *script = tmp_path("spawn.sh");
+	write_script(script, "/bin/true", ncmds);
+	for (b = backends; *b; ++b) {
+		snprintf(buf, BUFSIZE, "spawn_true_%s", *b);
+		report(buf, ncmds / run_shell(script, "SHELL_SPAWN", *b), "cmds/s");
+	}
+	write_script(script, "timeout 60 /bin/true", ncmds);
+	report("spawn_timeout", ncmds / run_shell(script, NULL, NULL), "cmds/s");
+	write_script(script, "/bin/true < /dev/null 2>&1 | /bin/true > /dev/null 2>&1", ncmds);
+	report("spawn_redirect", ncmds / run_shell(script, NULL, NULL), "cmds/s");
+}
+
+/*
+ * Commands/sec for a small here-document (fed through a pipe) and a
+ * here-string, and MB/s of a large here-document (fed through a memfd).
+ */
+#define LINE "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcde\n"
+void bench_doc() {
+	char *script = tmp_path("doc.sh");
+	write_script(script, "cat <<EOF >/dev/null\nsome text\nand more\nEOF", ncmds);
+	report("heredoc_small", ncmds / run_shell(script, NULL, NULL), "cmds/s");
+	write_script(script, "cat <<< word >/dev/null", ncmds);
+	report("herestring", ncmds / run_shell(script, NULL, NULL), "cmds/s");
+
+	FILE *f = fopen(script, "w");
+	if (!f) bench_err(-1);
+	fprintf(f, "cat <<'EOF' >/dev/null\n");
+	size_t i, n = (size_t)nmegs * 1048576 / (sizeof(LINE) - 1);
+	for (i = 0; i < n; ++i) fputs(LINE, f);
+	fprintf(f, "EOF\n");
+	bench_err(fclose(f));
+	char buf[64];
+	snprintf(buf, sizeof(buf), "heredoc_%dm", nmegs);
+	report(buf, nmegs / run_shell(script, NULL, NULL), "MB/s");
+	unlink(script);
+}
+#undef LINE
+
+/*
+ * Commands/sec for command substitutions: of a builtin and of a file (both
+ * run in the shell), and of a program (in a forked shell).
+ */
+void bench_subst() {
+	char *file = strdup(tmp_path("subst.txt"));
+	FILE *f = fopen(file, "w");
+	if (!f) bench_err(-1);
+	fprintf(f, "some text\n");
+	bench_err(fclose(f));
+	char line[PATH_MAX + 16];
+	char *script = tmp_path("subst.sh");
+	write_script(script, "X=$(echo hello)", ncmds);
+	report("subst_builtin", ncmds / run_shell(script, NULL, NULL), "cmds/s");
+	snprintf(line, sizeof(line), "X=$(<%s)", file);
+	write_script(script, line, ncmds);
+	report("subst_file", ncmds / run_shell(script, NULL, NULL), "cmds/s");
+	write_script(script, "X=$(/bin/true)", ncmds);
+	report("subst_fork", ncmds / run_shell(script, NULL, NULL), "cmds/s");
+	unlink(script);
+	unlink(file);
+	free(file);
+}
+
+/*
+ * Iterations/sec of a for loop over 100 * ncmds words, with true as its
+ * body and with an if in it, and of a while read loop over as many lines,
+ * and of a loop counting to as many in arithmetic: with ((...)) alone, and
+ * with test and $((...)).
+ */
+void bench_loop() {
+	int i, n = 100 * ncmds;
+	char *file = strdup(tmp_path("loop.txt"));
+	char *script = tmp_path("loop.sh");
+	const char *bodies[] = {
+		"do true; done",
+		"do if [ $i = x ]; then echo x; else true; fi; done",
+		NULL
+	};
+	char *names[] = { "loop_for", "loop_for_if" };
+	for (i = 0; bodies[i]; ++i) {
+		FILE *f = fopen(script, "w");
+		if (!f) bench_err(-1);
+		fprintf(f, "for i in");
+		int k;
+		for (k = 0; k < n; ++k) fprintf(f, " %d", k);
+		fprintf(f, "; %s\n", bodies[i]);
+		bench_err(fclose(f));
+		report(names[i], n / run_shell(script, NULL, NULL), "iters/s");
+	}
+	FILE *f = fopen(file, "w");
+	if (!f) bench_err(-1);
+	for (i = 0; i < n; ++i) fprintf(f, "line %d\n", i);
+	bench_err(fclose(f));
+	f = fopen(script, "w");
+	if (!f) bench_err(-1);
+	fprintf(f, "while read l; do true; done < %s\n", file);
+	bench_err(fclose(f));
+	report("loop_read", n / run_shell(script, NULL, NULL), "lines/s");
+	f = fopen(script, "w");
+	if (!f) bench_err(-1);
+	fprintf(f, "i=0; while ((i < %d)); do ((i++)); done\n", n);
+	bench_err(fclose(f));
+	report("loop_arith", n / run_shell(script, NULL, NULL), "iters/s");
+	f = fopen(script, "w");
+	if (!f) bench_err(-1);
+	fprintf(f, "i=0; while [ $i -lt %d ]; do i=$((i + 1)); done\n", n);
+	bench_err(fclose(f));
+	report("loop_expr", n / run_shell(script, NULL, NULL), "iters/s");
+	unlink(script);
+	unlink(file);
+	free(file);
+}
+
+/*
+ * Commands/sec for builtins.
+ */
+void bench_builtin() {
+	char *lines[] = { "cd .", "true", "echo hello", "[ -d . ]", "echo hello > /dev/null", NULL };
+	char *names[] = { "builtin_cd", "builtin_true", "builtin_echo", "builtin_test", "builtin_redirect" };
+	char *script = tmp_path("builtin.sh");
+	int i;
+	for (i = 0; lines[i]; ++i) {
+		write_script(script, lines[i], ncmds);
+		report(names[i], ncmds / run_shell(script, NULL, NULL), "cmds/s");
+	}
+}
+
+/*
+ * Run a program to completion, with stdout discarded.
+ */
+void run_prog(char **argv) {
+	pid_t pid = fork();
+	bench_err(pid);
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+		bench_err(fd);
+		bench_err(dup2(fd, STDOUT_FILENO));
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+	int status;
+	bench_err(waitpid(pid, &status, 0));
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, PREF": %s failed\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Sessions/sec of a one-line script, with and without a shell server.
+ */
+void bench_server() {
+	int i, nsess = ncmds / 10 + 1;
+	char *sock = strdup(tmp_path("sock"));
+	char *shell_argv[] = { SHELL, "-c", "echo hello", NULL };
+	char *client_argv[] = { CLIENT, sock, "-c", "echo hello", NULL };
+	char *exit_argv[] = { CLIENT, sock, "-c", "exit", NULL };
+
+	double start = now();
+	for (i = 0; i < nsess; ++i) run_prog(shell_argv);
+	report("session_shell", nsess / (now() - start), "sessions/s");
+
+	pid_t pid = fork();
+	bench_err(pid);
+	if (pid == 0) {
+		execl(SHELL, SHELL, "-s", sock, (char *)NULL);
+		perror(SHELL);
+		_exit(EXIT_FAILURE);
+	}
+	while (access(sock, F_OK) < 0) usleep(1000);
+	start = now();
+	for (i = 0; i < nsess; ++i) run_prog(client_argv);
+	report("session_server", nsess / (now() - start), "sessions/s");
+	run_prog(exit_argv);
+	bench_err(waitpid(pid, NULL, 0));
+	free(sock);
+}
+
+/*
+ * MB/s through pipelines of cat.
+ */
+#define CHUNK (1024 * 1024)
+void bench_pipe() {
+	char *data = strdup(tmp_path("data"));
+	int fd = open(data, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	bench_err(fd);
+	char *chunk = malloc(CHUNK);
+	memset(chunk, 'x', CHUNK);
+	int i;
+	for (i = 0; i < nmegs; ++i) {
+		bench_err(write(fd, chunk, CHUNK));
+	}
+	bench_err(close(fd));
+	free(chunk);
+
+	// "cat" is run by the shell itself, "/bin/cat" as a child
+	// (the second time with 1 MiB pipes)
+	char *cats[] = { "cat", "/bin/cat", "/bin/cat", NULL };
+	char *names[] = { "cat", "bincat", "bincat_1m" };
+	char *sizes[] = { NULL, NULL, "1m" };
+	int c, stages;
+	for (c = 0; cats[c]; ++c) {
+		for (stages = 1; stages <= 8; stages *= 2) {
+			char *line = malloc(strlen(data) + 32 + 12 * stages);
+			char *p = line + sprintf(line, "%s < %s", cats[c], data);
+			for (i = 1; i < stages; ++i) p += sprintf(p, " | %s", cats[c]);
+			sprintf(p, " > /dev/null");
+
+			char *script = tmp_path("pipe.sh");
+			write_script(script, line, 1);
+			char buf[BUFSIZE];
+			snprintf(buf, BUFSIZE, "pipe_%s_%d", names[c], stages);
+			report(buf, nmegs / run_shell(script, sizes[c] ? "SHELL_PIPESIZE" : NULL, sizes[c]), "MB/s");
+			free(line);
+		}
+	}
+	bench_err(unlink(data));
+	free(data);
+}
+#undef CHUNK
+
+/*
+ * History store with 100 * ncmds entries.
+ * The store is filled by a child, so that the parent opens it afresh.
+ */
+void bench_history() {
+	int i, nents = 100 * ncmds;
+	char *path = strdup(tmp_path("history"));
+	char buf[BUFSIZE];
+
+	double start = now();
+	pid_t pid = fork();
+	bench_err(pid);
+	if (pid == 0) {
+		hist_open(path);
+		for (i = 0; i < nents; ++i) {
+			snprintf(buf, BUFSIZE, "command %d --with some arguments", i);
+			hist_add(buf);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+	bench_err(waitpid(pid, NULL, 0));
+	report("hist_add", nents / (now() - start), "entries/s");
+
+	start = now();
+	hist_open(path);
+	if (idx_cnt != (size_t)nents) {
+		fprintf(stderr, PREF": history has %zu entries\n", idx_cnt);
+		exit(EXIT_FAILURE);
+	}
+	snprintf(buf, BUFSIZE, "hist_open_%d", nents);
+	report(buf, (now() - start) * 1e3, "ms");
+
+	// neither is found, so the whole history is searched
+	start = now();
+	hist_find_prefix("command 1 --without", 19, idx_cnt);
+	report("hist_prefix", (now() - start) * 1e3, "ms");
+	start = now();
+	hist_find_sub("nowhere", 7, idx_cnt);
+	report("hist_substring", (now() - start) * 1e3, "ms");
+
+	bench_err(unlink(path));
+	snprintf(buf, BUFSIZE, "%s.idx", path);
+	bench_err(unlink(buf));
+	free(path);
+}
+
+/*
+ * ms to expand a pattern in a directory of 10 * ncmds files, each time on a
+ * new line (so listing the directory again): all the files, and a tenth of
+ * them.
+ */
+void bench_glob() {
+	int i, nfiles = 10 * ncmds;
+	char *dir = strdup(tmp_path("glob"));
+	char buf[BUFSIZE];
+	bench_err(mkdir(dir, 0777));
+	for (i = 0; i < nfiles; ++i) {
+		snprintf(buf, BUFSIZE, "%s/f%07d.c", dir, i);
+		int fd = open(buf, O_WRONLY | O_CREAT, 0666);
+		bench_err(fd);
+		close(fd);
+	}
+	char *patterns[] = { "*", "*7.c", NULL };
+	char *names[] = { "glob_all", "glob_tenth" };
+	for (i = 0; patterns[i]; ++i) {
+		char line[BUFSIZE];
+		int iters = 0;
+		double start = now(), elapsed;
+		do {
+			char **assigns;
+			struct lex_tok **redirs;
+			snprintf(line, BUFSIZE, "echo %s/%s", dir, patterns[i]);
+			struct lex_tok *t = lex(line);
+			if (!t) exit(EXIT_FAILURE);
+			char **argv = parse_cmd(&t, &assigns, &redirs);
+			if (!argv[1] || !argv[2]) exit(EXIT_FAILURE);
+			arena_reset();
+			++iters;
+		} while ((elapsed = now() - start) < 1);
+		snprintf(buf, BUFSIZE, "%s_%d", names[i], nfiles);
+		report(buf, elapsed / iters * 1e3, "ms");
+	}
+
+	for (i = 0; i < nfiles; ++i) {
+		snprintf(buf, BUFSIZE, "%s/f%07d.c", dir, i);
+		bench_err(unlink(buf));
+	}
+	bench_err(rmdir(dir));
+	free(dir);
+}
+
+/*
+ * Completion of command names from a PATH of ncmds executables.
+ */
+void bench_complete() {
+	int i;
+	char *dir = strdup(tmp_path("bin"));
+	char buf[BUFSIZE];
+	bench_err(mkdir(dir, 0777));
+	for (i = 0; i < ncmds; ++i) {
+		snprintf(buf, BUFSIZE, "%s/cmd%06d", dir, i);
+		int fd = open(buf, O_WRONLY | O_CREAT, 0777);
+		bench_err(fd);
+		close(fd);
+	}
+	var_put("PATH", 4, dir, 0);
+
+	char ext[NAME_MAX + 2];
+	size_t elen;
+	double start = now();
+	cmp_command("cmd", 3, ext, &elen);
+	snprintf(buf, BUFSIZE, "complete_build_%d", ncmds);
+	report(buf, (now() - start) * 1e3, "ms");
+
+	// the PATH directories are checked every time
+	int iters = 0;
+	double elapsed;
+	start = now();
+	do {
+		cmp_command("cmd00", 5, ext, &elen);
+		++iters;
+	} while ((elapsed = now() - start) < 1);
+	snprintf(buf, BUFSIZE, "complete_%d", ncmds);
+	report(buf, elapsed / iters * 1e6, "us");
+
+	var_unset("PATH");
+	for (i = 0; i < ncmds; ++i) {
+		snprintf(buf, BUFSIZE, "%s/cmd%06d", dir, i);
+		bench_err(unlink(buf));
+	}
+	bench_err(rmdir(dir));
+	free(dir);
+}
+
+/*
+ * MB/s of the parser on a long line of 8 byte words (such as "word12  ")
+ * with redirections.
+ */
+void bench_parse(const char *name, const char *word) {
+	size_t len = nkilos * 1024;
+	char *line = malloc(len + 1);
+	char *copy = malloc(len + 1);
+	size_t i;
+	for (i = 0; i + 8 < len; i += 8) memcpy(line + i, word, 8);
+	memcpy(line + i - 16, "< in > out      ", 16);
+	line[i] = '\0';
+	len = i;
+
+	int iters = 0;
+	double start = now(), elapsed;
+	do {
+		char **assigns;
+		struct lex_tok **redirs;
+		memcpy(copy, line, len + 1);
+		struct lex_tok *t = lex(copy);
+		if (!t) exit(EXIT_FAILURE);
+		parse_cmd(&t, &assigns, &redirs);
+		arena_reset();
+		++iters;
+	} while ((elapsed = now() - start) < 1);
+	char buf[BUFSIZE];
+	snprintf(buf, BUFSIZE, "%s_%dk", name, nkilos);
+	report(buf, iters * (len / 1048576.0) / elapsed, "MB/s");
+	free(line);
+	free(copy);
+}
+
+/*
+ * Paste a line of nkilos kilobytes into an interactive shell on a
+ * pseudo-terminal, and exit.
+ */
+#define READSIZE 4096
+void bench_edit() {
+	int m = posix_openpt(O_RDWR | O_NOCTTY);
+	bench_err(m);
+	bench_err(grantpt(m));
+	bench_err(unlockpt(m));
+	char *slave = ptsname(m);
+	if (!slave) bench_err(-1);
+	struct winsize ws = { 24, 80, 0, 0 };
+	bench_err(ioctl(m, TIOCSWINSZ, &ws));
+
+	pid_t pid = fork();
+	bench_err(pid);
+	if (pid == 0) {
+		setsid();
+		int fd = open(slave, O_RDWR); // becomes the controlling terminal
+		bench_err(fd);
+		bench_err(dup2(fd, STDIN_FILENO));
+		bench_err(dup2(fd, STDOUT_FILENO));
+		bench_err(dup2(fd, STDERR_FILENO));
+		close(fd);
+		close(m);
+		setenv("HISTFILE", tmp_path("edit_history"), 1);
+		setenv("TERM", "xterm", 1);
+		execl(SHELL, SHELL, (char *)NULL);
+		perror(SHELL);
+		_exit(EXIT_FAILURE);
+	}
+
+	size_t plen = nkilos * 1024;
+	char *input = malloc(plen + 16);
+	memcpy(input, "true ", 5);
+	memset(input + 5, 'x', plen - 5);
+	strcpy(input + plen, "\rexit\r");
+	size_t ilen = strlen(input), off = 0, nout = 0;
+	bench_err(fcntl(m, F_SETFL, O_NONBLOCK));
+
+	// paste once the prompt is up, so that it goes to the editor
+	char buf[READSIZE];
+	int ready = 0;
+	double start = 0;
+	while (1) {
+		struct pollfd pfd = { m, POLLIN | (ready && off < ilen ? POLLOUT : 0), 0 };
+		bench_err(poll(&pfd, 1, -1));
+		if (pfd.revents & POLLOUT) {
+			ssize_t n = write(m, input + off, ilen - off);
+			if (n > 0) off += n;
+		}
+		if (pfd.revents & (POLLIN | POLLHUP)) {
+			ssize_t n = read(m, buf, READSIZE - 1);
+			if (n <= 0) break; // the shell has exited
+			buf[n] = '\0';
+			if (ready) nout += n;
+			else if (strstr(buf, "shell>")) {
+				ready = 1;
+				start = now();
+			}
+		}
+	}
+	double elapsed = now() - start;
+	bench_err(waitpid(pid, NULL, 0));
+	close(m);
+
+	snprintf(buf, READSIZE, "edit_paste_%dk", nkilos);
+	report(buf, elapsed * 1e3, "ms");
+	snprintf(buf, READSIZE, "edit_paste_%dk_out", nkilos);
+	report(buf, (double)nout / plen, "bytes/byte");
+	free(input);
+	unlink(tmp_path("edit_history"));
+	unlink(tmp_path("edit_history.idx"));
+}
+#undef READSIZE
+#undef BUFSIZE
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:m:l:")) != -1) {
+		switch (opt) {
+		case 'n': ncmds = atoi(optarg); break;
+		case 'm': nmegs = atoi(optarg); break;
+		case 'l': nkilos = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: bench_shell [-n commands] [-m megabytes] [-l kilobytes]\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!mkdtemp(tmpdir)) bench_err(-1);
+
+	bench_parse("parse", "word12  ");
+	bench_parse("parse_quoted", "'a b'\\  ");
+	var_put("V", 1, "xyz", 0);
+	bench_parse("parse_expand", "a${V}b  ");
+	var_unset("V");
+	bench_history();
+	bench_glob();
+	bench_complete();
+	bench_edit();
+	bench_builtin();
+	bench_doc();
+	bench_subst();
+	bench_loop();
+	bench_spawn();
+	bench_server();
+	bench_pipe();
+
+	unlink(tmp_path("spawn.sh"));
+	unlink(tmp_path("builtin.sh"));
+	unlink(tmp_path("pipe.sh"));
+	bench_err(rmdir(tmpdir));
+}
@@ -1,10 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/wait.h>
 
 /* Name of file (in current directory) containing shell. */ 
 #define SHELL "shell"
-int main() {
+/*
+ * Arguments (such as -c command, or a script file) are passed on to the shell.
+ */
+int main(int argc, char **argv) {
 	printf("run_shell: running shell\n");
 	pid_t pid = fork();
 	if (pid < 0) {
@@ -14,7 +18,8 @@ int main() {
 	}
 	if (pid == 0) {
 		// child process
-		execlp("./"SHELL, "./"SHELL, (char *)NULL);
+		argv[0] = "./"SHELL;
+		execv(argv[0], argv);
 		// returns only if error
 		perror(SHELL);
 		exit(EXIT_FAILURE);
@@ -22,6 +27,8 @@ int main() {
 		int status;
 		// wait for child to terminate
 		while (wait(&status) > 0) ;
+		printf("run_shell: shell exited\n");
+		// pass on the exit status of the shell
+		exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
 	}
-	printf("run_shell: shell exited\n");
 }
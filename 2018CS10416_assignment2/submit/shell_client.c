@@ -0,0 +1,149 @@
+/*
+ * shell_client - Run a script in a shell server (started with shell -s).
+ *
+ * Usage: shell_client socket -c command
+ *        shell_client socket file
+ *
+ * The script runs in the server with the stdin, stdout and stderr of this
+ * process, and its exit status is passed on; this replaces run_shell where
+ * starting a new shell for each script costs too much.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Error prefix */
+#define PREF "shell_client"
+/* Number of descriptors passed: stdin, stdout and stderr. */
+#define NFDS 3
+
+/*
+ * Handle error in system call.
+ * Print error and exit.
+ */
+void sys_err(int x) {
+	if (x < 0) {
+		perror(PREF);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Read all of file into memory, setting *lenp to its length.
+ */
+#define BLKSIZE (64 * 1024)
+char *read_file(char *name, size_t *lenp) {
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, PREF": %s: %s\n", name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	size_t cap = BLKSIZE, len = 0;
+	char *buf = NULL;
+	ssize_t n;
+	do {
+		if (cap - len < BLKSIZE) cap *= 2;
+		buf = realloc(buf, cap);
+		if (!buf) sys_err(-1);
+		n = read(fd, buf + len, cap - len);
+		sys_err(n);
+		len += n;
+	} while (n > 0);
+	close(fd);
+	*lenp = len;
+	return buf;
+}
+#undef BLKSIZE
+
+void write_all(int fd, const char *buf, size_t n) {
+	while (n) {
+		ssize_t w = write(fd, buf, n);
+		if (w < 0 && errno == EINTR) continue;
+		sys_err(w);
+		buf += w;
+		n -= w;
+	}
+}
+
+/*
+ * Send the length of the script with our stdin, stdout and stderr.
+ */
+void send_header(int sock, uint32_t len) {
+	union {
+		char buf[CMSG_SPACE(NFDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	int fds[NFDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	struct iovec iov = { &len, sizeof(len) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+	ssize_t n;
+	while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) ;
+	sys_err(n);
+	// the descriptors went with the first byte; the rest is plain data
+	write_all(sock, (char *)&len + n, sizeof(len) - n);
+}
+
+int main(int argc, char **argv) {
+	char *script;
+	size_t len;
+	if (argc == 4 && strcmp(argv[2], "-c") == 0) {
+		script = argv[3];
+		len = strlen(script);
+	} else if (argc == 3) {
+		script = read_file(argv[2], &len);
+	} else {
+		fprintf(stderr, "usage: shell_client socket (-c command | file)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, PREF": %s: socket path too long\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, argv[1]);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sys_err(sock);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, PREF": %s: %s\n", argv[1], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	send_header(sock, len);
+	write_all(sock, script, len);
+
+	// pass on the exit status of the script
+	int32_t status;
+	size_t got = 0;
+	while (got < sizeof(status)) {
+		ssize_t n = read(sock, (char *)&status + got, sizeof(status) - got);
+		if (n < 0 && errno == EINTR) continue;
+		sys_err(n);
+		if (n == 0) {
+			fprintf(stderr, PREF": server closed the connection\n");
+			exit(EXIT_FAILURE);
+		}
+		got += n;
+	}
+	exit(status & 0xff);
+}
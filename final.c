@@ -4,15 +4,41 @@
  * entry - 2018CS10416
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <termios.h>
+#include <dirent.h>
+#include <limits.h>
 #include <fcntl.h>
 
+extern char **environ;
+
 /* Error prefix */
 #define PREF "shell"
 
@@ -31,17 +57,20 @@ void sys_err(int x) {
  * Handle error in program execution.
  * Print error prefixed by name of program and exit.
  */
-#define BUFSIZE 500
 void prog_err(int x, char *name) {
 	if (x < 0) {
-		char *buf = malloc(BUFSIZE * sizeof(char));
-		strcpy(buf, PREF": ");
-		strncat(buf, name, BUFSIZE);
-		perror(buf);
+		fprintf(stderr, PREF": %s: %s\n", name, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 }
-#undef BUFSIZE
+
+/*
+ * Handle error (errno value 'err') in program execution.
+ * Print error prefixed by name of program, but do not exit.
+ */
+void prog_warn(int err, char *name) {
+	fprintf(stderr, PREF": %s: %s\n", name, strerror(err));
+}
 
 /*
  * Handle self-detected error.
@@ -53,291 +82,9051 @@ void self_err(char *msg) {
 }
 
 /*
- * Builtin function implementations.
+ * Arena allocator for a command line.
+ * Everything allocated while a line is parsed and executed comes from here,
+ * and is released at once by arena_reset when the line has run.
+ * The first block is kept across lines; larger blocks are added on demand
+ * and freed on reset, so a long-lived shell does not grow without bound.
+ * The largest of them (up to KEEPSIZE) is kept as a spare, so that a run of
+ * long lines does not map and fault in fresh memory for every line.
  */
+struct arena_blk {
+	struct arena_blk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
 
-void builtin_cd(char **argv) {
-	printf("Internal command: cd\n");
-	char *dir = argv[1] ? argv[1] : getenv("HOME"); // cd to ~ by default
-	if (chdir(dir)) perror(PREF);
+#define BLKSIZE (64 * 1024)
+#define KEEPSIZE (4 * 1024 * 1024)
+#define ALIGN 16
+struct arena_blk *arena; // block being allocated from, first in the list
+struct arena_blk *arena_first; // block kept across lines
+struct arena_blk *arena_spare; // unused large block kept across lines
+void *arena_last; // most recent allocation, which can be grown in place
+
+struct arena_blk *arena_blk_new(size_t size) {
+	struct arena_blk *b = malloc(sizeof(struct arena_blk) + size);
+	if (!b) sys_err(-1);
+	b->size = size;
+	b->used = 0;
+	b->next = NULL;
+	return b;
 }
 
-void builtin_pwd(char **argv) {
-	printf("Internal command: pwd\n");
-	printf("%s\n", getcwd(NULL, 0));
+void *arena_alloc(size_t n) {
+	n = (n + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+	if (!arena) arena = arena_first = arena_blk_new(BLKSIZE);
+	if (arena->size - arena->used < n) {
+		struct arena_blk *b = arena_spare;
+		if (b && b->size >= n) {
+			arena_spare = NULL;
+			b->used = 0;
+		} else {
+			b = arena_blk_new(n > BLKSIZE ? n : BLKSIZE);
+		}
+		b->next = arena;
+		arena = b;
+	}
+	arena_last = arena->data + arena->used;
+	arena->used += n;
+	return arena_last;
 }
 
-void builtin_mkdir(char **argv) {
-	printf("Internal command: mkdir\n");
-	if (argv[1]) {
-		if (mkdir(argv[1], 0777)) perror(PREF);
-	} else {
-		printf("usage: mkdir directory\n");
+/*
+ * Resize an allocation of old bytes to n bytes (n >= old).
+ * The most recent allocation is grown in place if there is room.
+ */
+void *arena_grow(void *p, size_t old, size_t n) {
+	if (p && p == arena_last) {
+		size_t off = (char *)p - arena->data;
+		size_t need = (n + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+		if (arena->size - off >= need) {
+			arena->used = off + need;
+			return p;
+		}
 	}
+	void *q = arena_alloc(n);
+	if (p) memcpy(q, p, old);
+	return q;
 }
 
-void builtin_rmdir(char **argv) {
-	printf("Internal command: rmdir\n");
-	if (argv[1]) {
-		if (rmdir(argv[1])) perror(PREF);
+char *arena_strdup(const char *s) {
+	size_t len = strlen(s) + 1;
+	return memcpy(arena_alloc(len), s, len);
+}
+
+/*
+ * Release the block being allocated from (not the first), keeping it as
+ * the spare if it is the largest one worth keeping.
+ */
+void arena_pop() {
+	struct arena_blk *b = arena;
+	arena = b->next;
+	if (b->size <= KEEPSIZE && (!arena_spare || b->size > arena_spare->size)) {
+		free(arena_spare);
+		arena_spare = b;
 	} else {
-		printf("usage: rmdir directory");
+		free(b);
 	}
 }
 
-void builtin_exit(char **argv) {
-	printf("Internal command: exit\n");
-	exit(EXIT_SUCCESS);
+/*
+ * Release everything allocated since the last reset.
+ */
+void arena_reset() {
+	while (arena && arena != arena_first) arena_pop();
+	if (arena) arena->used = 0;
+	arena_last = NULL;
 }
 
-char *builtin_strs[] = {
-	"cd",
-	"pwd",
-	"mkdir",
-	"rmdir",
-	"exit",
-	NULL
+/*
+ * Position in the arena, to go back to when what was allocated since is no
+ * longer needed (such as while streaming a long input a line at a time, or
+ * between the iterations of a loop).
+ */
+struct arena_mark {
+	struct arena_blk *blk;
+	size_t used;
 };
 
-void (*builtin_fns[])(char **argv) = {
-	builtin_cd,
-	builtin_pwd,
-	builtin_mkdir,
-	builtin_rmdir,
-	builtin_exit
-};
+struct arena_mark arena_tell() {
+	if (!arena) arena = arena_first = arena_blk_new(BLKSIZE);
+	struct arena_mark m = { arena, arena->used };
+	return m;
+}
 
 /*
- * If cmd is a builtin, return index in the builtin_strs array.
- * Else return -1.
+ * Release what was allocated since m, with the blocks added since.
+ * Marks are released in the reverse order of their taking; a mark whose
+ * block is gone (after a reset) is ignored.
  */
-int find_builtin(const char *cmd) {
-	int i;
-	char *bstr;
-	int flag = 0;
-	for (i = 0; (bstr = builtin_strs[i]); ++i) {
-		if (strcmp(bstr, cmd) == 0) {
-			flag = 1;
+void arena_rewind(struct arena_mark m) {
+	struct arena_blk *b;
+	for (b = arena; b && b != m.blk; b = b->next) ;
+	if (!b) return;
+	while (arena != m.blk) arena_pop();
+	arena->used = m.used;
+	arena_last = NULL;
+}
+#undef BLKSIZE
+#undef KEEPSIZE
+#undef ALIGN
+
+/* Exit status of the last command executed. */
+int last_status;
+
+/* Process id of the last background job started. */
+pid_t bg_pid;
+
+/*
+ * Buffered output of builtins.
+ * Output is collected here and written to stdout with write(2) when the
+ * buffer fills or the builtin returns (see builtin_run), rather than with
+ * one stdio call per piece.
+ * While out_capturing is set, it goes to out_cap instead (for a command
+ * substitution, see subst_run).
+ */
+#define OUTSIZE (8 * 1024)
+char out_buf[OUTSIZE];
+size_t out_len;
+int out_err; // a write has failed; further output is dropped
+int out_fd = STDOUT_FILENO; // where output goes (see plan_std)
+int out_capturing;
+char *out_cap; // captured output, kept from one capture to the next
+size_t out_caplen;
+size_t out_capsize;
+
+/*
+ * Make room for n more bytes (and a '\0') in out_cap.
+ */
+void out_reserve(size_t n) {
+	if (out_caplen + n < out_capsize) return;
+	while (out_caplen + n >= out_capsize) out_capsize = out_capsize ? 2 * out_capsize : OUTSIZE;
+	if (!(out_cap = realloc(out_cap, out_capsize))) sys_err(-1);
+}
+
+void out_raw(const char *s, size_t n) {
+	if (out_capturing) {
+		out_reserve(n);
+		memcpy(out_cap + out_caplen, s, n);
+		out_caplen += n;
+		return;
+	}
+	while (n && !out_err) {
+		ssize_t w = write(out_fd, s, n);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			perror(PREF);
+			out_err = 1;
 			break;
 		}
+		s += w;
+		n -= w;
+	}
+}
+
+void out_flush() {
+	out_raw(out_buf, out_len);
+	out_len = 0;
+}
+
+void out_write(const char *s, size_t n) {
+	if (n > OUTSIZE - out_len) {
+		out_flush();
+		if (n >= OUTSIZE) {
+			out_raw(s, n);
+			return;
+		}
 	}
-	if (flag) return i;
-	else return -1;
+	memcpy(out_buf + out_len, s, n);
+	out_len += n;
+}
+
+void out_putc(char c) {
+	if (out_len == OUTSIZE) out_flush();
+	out_buf[out_len++] = c;
+}
+
+void out_str(const char *s) {
+	out_write(s, strlen(s));
 }
 
 /*
- * Print the promt.
+ * Formatted output, straight into the buffer when it fits.
  */
-#define PROMPT "\033[32mshell>\033[0m "
-void print_prompt() {
-	sys_err(printf("%s", PROMPT));
+void out_printf(const char *fmt, ...) {
+	va_list ap, ap2;
+	va_start(ap, fmt);
+	va_copy(ap2, ap);
+	int n = vsnprintf(out_buf + out_len, OUTSIZE - out_len, fmt, ap);
+	va_end(ap);
+	if (n >= 0 && (size_t)n < OUTSIZE - out_len) {
+		out_len += n;
+	} else if (n >= 0) {
+		char *buf = arena_alloc(n + 1);
+		vsnprintf(buf, n + 1, fmt, ap2);
+		out_write(buf, n);
+	}
+	va_end(ap2);
 }
+#undef OUTSIZE
 
 /*
- * Read a single line command.
+ * FNV-1a hash of the first len bytes of s, with its offset basis mixed with
+ * seed (0 for plain FNV-1a).
  */
-char *read_cmd() {
-	char *line = NULL;
-	size_t linecap = 0;
-	int len = getline(&line, &linecap, stdin);
-	sys_err(len);
-	line[len-1] = '\0'; // remove '\n' from the end
-	return line;
+size_t fnv1a(const char *s, size_t len, size_t seed) {
+	size_t h = 14695981039346656037UL ^ seed;
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+/*
+ * Shell variables.
+ * Kept in an open-addressing hash table (linear probing, at most half full)
+ * of "name=value" strings, filled from the environment at startup.
+ * The environment of spawned programs is an array of pointers to the
+ * strings of the exported variables. It is cached, rebuilt only after an
+ * exported variable has changed, and installed as environ, which the spawn
+ * backends pass on.
+ * A variable used in arithmetic also keeps its value as an integer (see
+ * var_num), and one assigned by arithmetic is formatted only when its
+ * string is read.
+ */
+struct var {
+	char *str; // "name=value", or NULL for an empty slot
+	size_t size; // bytes allocated for str
+	size_t nlen; // length of the name
+	size_t hash;
+	int flags;
+	long long num; // value, if VAR_NUM
+};
+
+enum {
+	VAR_EXPORT = 1,
+	VAR_NOVAL = 2, // exported before being set: has no value yet
+	VAR_NUM = 4, // num holds the value
+	VAR_LAZY = 8 // str is out of date: it is formatted from num when read
+};
+
+#define VAR_INIT 64
+struct var *var_tab;
+size_t var_cap;
+size_t var_cnt;
+char **var_envp; // cached environment
+int var_dirty = 1; // var_envp is out of date
+char **var_old; // strings replaced since var_envp was built, which it may point to
+size_t var_nold;
+size_t var_oldcap;
+
+size_t var_hash(const char *name, size_t len) {
+	return fnv1a(name, len, 0);
 }
 
 /*
- * Check if delimiter.
+ * Length of the variable name at the start of s (letters, digits and '_',
+ * not starting with a digit), or 0.
  */
-#define DELIM " \t<>"
-int is_delim(char c) {
-	char *d = DELIM;
-	for ( ; *d; ++d) {
-		if (c == *d) return 1;
+size_t var_name_len(const char *s) {
+	size_t n = 0;
+	if (!isalpha((unsigned char)*s) && *s != '_') return 0;
+	while (isalnum((unsigned char)s[n]) || s[n] == '_') ++n;
+	return n;
+}
+
+/*
+ * Slot of the variable name (of length len), or the empty slot where it
+ * would go.
+ */
+struct var *var_slot(const char *name, size_t len, size_t h) {
+	if (!var_tab) {
+		var_cap = VAR_INIT;
+		if (!(var_tab = calloc(var_cap, sizeof(struct var)))) sys_err(-1);
 	}
-	return 0;
+	size_t i = h & (var_cap - 1);
+	while (var_tab[i].str) {
+		struct var *v = &var_tab[i];
+		if (v->hash == h && v->nlen == len && memcmp(v->str, name, len) == 0) break;
+		i = (i + 1) & (var_cap - 1);
+	}
+	return &var_tab[i];
+}
+
+void var_grow() {
+	struct var *old = var_tab;
+	size_t i, old_cap = var_cap;
+	var_cap *= 2;
+	if (!(var_tab = calloc(var_cap, sizeof(struct var)))) sys_err(-1);
+	for (i = 0; i < old_cap; ++i) {
+		if (old[i].str) *var_slot(old[i].str, old[i].nlen, old[i].hash) = old[i];
+	}
+	free(old);
 }
-#undef DELIM
 
 /*
- * Put name of input and output file in the location pointed to
- * in 'infile' and 'outfile' respectively.
- * Remove redirection part from string.
- * If input or output file is not specified, put empty string.
- * All redirections must occur at the end of the string.
+ * Value of the variable name (of length len), or NULL if it is not set.
  */
-#define IN_CHAR '<'
-#define OUT_CHAR '>'
-// Buffer size for storing infile and outfile
-// Should be sufficient on most file systems
-#define BUFSIZE 256
-#define ERR_MSG "bad redirection"
-void get_io(char *cmd, char **infilep, char **outfilep) {
-	char *instr = *infilep = malloc(BUFSIZE * sizeof(char));
-	char *outstr = *outfilep = malloc(BUFSIZE * sizeof(char));
+char *var_getn(const char *name, size_t len) {
+	struct var *v = var_slot(name, len, var_hash(name, len));
+	if (!v->str || (v->flags & VAR_NOVAL)) return NULL;
+	if (v->flags & VAR_LAZY) {
+		snprintf(v->str + len + 1, v->size - len - 1, "%lld", v->num);
+		v->flags &= ~VAR_LAZY;
+	}
+	return v->str + len + 1;
+}
 
-	for ( ; *cmd; ++cmd) {
-		if (*cmd == IN_CHAR || *cmd == OUT_CHAR) {
-			char c = *cmd;
-			*cmd = '\0';
+char *var_get(const char *name) {
+	return var_getn(name, strlen(name));
+}
 
-			for (++cmd; *cmd && is_delim(*cmd); ++cmd) ;
-			if (!(*cmd)) self_err(ERR_MSG);
+int var_flags(const char *name, size_t len) {
+	struct var *v = var_slot(name, len, var_hash(name, len));
+	return v->str ? v->flags : 0;
+}
 
-			for ( ; *cmd && !is_delim(*cmd); ++cmd) {
-				if (c == IN_CHAR) *instr++ = *cmd;
-				else *outstr++ = *cmd;
-			}
-			--cmd; // revert the extra character read
+/*
+ * Free the string of v, or keep it until the environment is rebuilt if it
+ * may be in it.
+ */
+void var_free(struct var *v) {
+	if (!(v->flags & VAR_EXPORT)) {
+		free(v->str);
+		return;
+	}
+	var_dirty = 1;
+	if (var_nold == var_oldcap) {
+		var_oldcap = var_oldcap ? 2 * var_oldcap : 64;
+		if (!(var_old = realloc(var_old, var_oldcap * sizeof(char *)))) sys_err(-1);
+	}
+	var_old[var_nold++] = v->str;
+}
+
+/*
+ * Set the variable name (of length len) to val (NULL for none), with
+ * exactly the given flags, and room in its string for a value of at least
+ * room bytes. Return it.
+ */
+struct var *var_set(const char *name, size_t len, const char *val, int flags, size_t room) {
+	size_t h = var_hash(name, len);
+	struct var *v = var_slot(name, len, h);
+	if (!v->str) {
+		if (2 * (var_cnt + 1) > var_cap) {
+			var_grow();
+			v = var_slot(name, len, h);
 		}
+		++var_cnt;
+	}
+	if (!val) {
+		val = "";
+		flags |= VAR_NOVAL;
 	}
+	size_t vlen = strlen(val), size = len + (vlen > room ? vlen : room) + 2;
+	char *str = malloc(size);
+	if (!str) sys_err(-1);
+	memcpy(str, name, len);
+	str[len] = '=';
+	memcpy(str + len + 1, val, vlen + 1);
+	if (v->str) var_free(v);
+	if (flags & VAR_EXPORT) var_dirty = 1;
+	v->str = str;
+	v->size = size;
+	v->nlen = len;
+	v->hash = h;
+	v->flags = flags & ~(VAR_NUM | VAR_LAZY);
+	return v;
+}
 
-	*instr = *outstr = '\0'; // termination
+void var_put(const char *name, size_t len, const char *val, int flags) {
+	var_set(name, len, val, flags, 0);
 }
-#undef BUFSIZE
 
 /*
- * Dynamically resized buffer for tokenization.
+ * Assign a "name=value" word, keeping the flags of the variable and adding
+ * 'flags'.
  */
-#define BUFSIZE 64
-size_t bufsize;
-char **tokens;
-int ind;
+void var_assign(const char *word, int flags) {
+	size_t len = strchr(word, '=') - word;
+	var_put(word, len, word + len + 1, (var_flags(word, len) & ~VAR_NOVAL) | flags);
+}
 
-void buf_init() {
-	bufsize = BUFSIZE;
-	free(tokens);
-	tokens = malloc(bufsize * sizeof(char*));
-	if (!tokens) sys_err(-1);
-	ind = 0;
+void var_unset(const char *name) {
+	size_t len = strlen(name);
+	struct var *v = var_slot(name, len, var_hash(name, len));
+	if (!v->str) return;
+	var_free(v);
+	v->str = NULL;
+	--var_cnt;
+	// move back the entries after it which belong at or before the hole
+	size_t hole = v - var_tab, i = hole;
+	while (1) {
+		i = (i + 1) & (var_cap - 1);
+		if (!var_tab[i].str) break;
+		size_t home = var_tab[i].hash & (var_cap - 1);
+		if (((i - home) & (var_cap - 1)) >= ((i - hole) & (var_cap - 1))) {
+			var_tab[hole] = var_tab[i];
+			var_tab[i].str = NULL;
+			hole = i;
+		}
+	}
 }
 
-void buf_add(char *token) {
-	if (ind >= bufsize) {
-		bufsize *= 2;
-		tokens = realloc(tokens, bufsize * sizeof(char*));
-		if (!tokens) sys_err(-1);
+/*
+ * Environment for spawned programs, rebuilt if an exported variable has
+ * changed since the last call.
+ */
+char **var_environ() {
+	if (!var_dirty) return var_envp;
+	size_t i, n = 0;
+	if (!(var_envp = realloc(var_envp, (var_cnt + 1) * sizeof(char *)))) sys_err(-1);
+	for (i = 0; i < var_cap; ++i) {
+		if (var_tab[i].str && (var_tab[i].flags & (VAR_EXPORT | VAR_NOVAL)) == VAR_EXPORT) {
+			var_envp[n++] = var_tab[i].str;
+		}
 	}
-	tokens[ind++] = token;
+	var_envp[n] = NULL;
+	environ = var_envp;
+	var_dirty = 0;
+	while (var_nold) free(var_old[--var_nold]);
+	return var_envp;
 }
 
-#undef BUFSIZE
+/*
+ * Import the environment.
+ */
+void var_init() {
+	char **e;
+	for (e = environ; *e; ++e) {
+		size_t len = var_name_len(*e);
+		if (len && (*e)[len] == '=') var_put(*e, len, *e + len + 1, VAR_EXPORT);
+	}
+	var_environ();
+}
+#undef VAR_INIT
 
 /*
- * Parse command into argv.
+ * Saved state of variables assigned for the duration of one command.
  */
-#define DELIM " \t"
-char **parse_cmd(char *cmd) {
-	buf_init();
-	char *token;
-	while ((token = strsep(&cmd, DELIM)) != NULL) {
-		if (*token) { // check for empty tokens
-			buf_add(token);
-		}
+struct var_save {
+	char *name;
+	char *val; // NULL if it was not set
+	int flags;
+};
+
+/*
+ * Assign the "name=value" words in assigns, exported, and return what they
+ * replaced (terminated by a NULL name) for var_restore.
+ */
+struct var_save *var_push(char **assigns) {
+	size_t n = 0, i;
+	while (assigns[n]) ++n;
+	struct var_save *s = arena_alloc((n + 1) * sizeof(struct var_save));
+	for (i = 0; i < n; ++i) {
+		size_t len = strchr(assigns[i], '=') - assigns[i];
+		char *val = var_getn(assigns[i], len);
+		s[i].name = arena_alloc(len + 1);
+		memcpy(s[i].name, assigns[i], len);
+		s[i].name[len] = '\0';
+		s[i].val = val ? arena_strdup(val) : NULL;
+		s[i].flags = var_flags(assigns[i], len);
+		var_assign(assigns[i], VAR_EXPORT);
+	}
+	s[n].name = NULL;
+	return s;
+}
+
+void var_restore(struct var_save *s) {
+	size_t n = 0;
+	while (s[n].name) ++n;
+	while (n--) {
+		if (s[n].val || (s[n].flags & VAR_NOVAL)) var_put(s[n].name, strlen(s[n].name), s[n].val, s[n].flags);
+		else var_unset(s[n].name);
+	}
+}
+
+/*
+ * Arithmetic.
+ * $((expression)), ((expression)) and let evaluate expressions of the C
+ * integer operators on 64-bit integers, as in POSIX: parentheses, the
+ * unary + - ! ~, ++ and -- on variables, the binary operators from ** (as
+ * in bash) and * / % down to && ||, ?:, the assignments = *= /= %= += -= <<= >>= &= ^= |=,
+ * and ','. Overflow wraps.
+ * Each level of precedence is parsed by a loop (precedence climbing, see
+ * arith_binary), evaluating as it goes. Operands left unevaluated by && ||
+ * and ?: are parsed with noeval set, so that their assignments and errors
+ * do not happen.
+ * Variables are read and assigned as integers (see var_num, var_put_num),
+ * so that a counter does not go through its string on every step.
+ */
+#define NUMSIZE 21 // characters of the longest integer, with its sign
+#define MAX_DEPTH 32 // variables holding expressions, within one another
+
+struct arith {
+	const char *p; // next character
+	const char *end;
+	const char *expr; // whole expression, for errors
+	const char *err; // first error, or NULL
+	int depth;
+};
+
+/*
+ * Parse the integer s (decimal, octal after 0, or hexadecimal after 0x,
+ * with an optional sign and blanks around) into *np. An empty string is 0.
+ * Return 0 if s is not an integer.
+ */
+int arith_num(const char *s, long long *np) {
+	char *end;
+	while (*s == ' ' || *s == '\t' || *s == '\n') ++s;
+	if (!*s) {
+		*np = 0;
+		return 1;
+	}
+	if (!isdigit((unsigned char)*s) && !((*s == '-' || *s == '+') && isdigit((unsigned char)s[1]))) return 0;
+	*np = (long long)strtoull(s, &end, 0);
+	while (*end == ' ' || *end == '\t' || *end == '\n') ++end;
+	return !*end;
+}
+
+/*
+ * Value of the variable name (of length len) as an integer, in *np: 0 if
+ * it is not set. The integer is kept with the variable, so it is parsed
+ * only once.
+ * Return 0 if its value is not an integer (it may be an expression).
+ */
+int var_num(const char *name, size_t len, long long *np) {
+	struct var *v = var_slot(name, len, var_hash(name, len));
+	if (!v->str || (v->flags & VAR_NOVAL)) {
+		*np = 0;
+		return 1;
 	}
-	buf_add(NULL);
-	return tokens;
+	if (v->flags & VAR_NUM) {
+		*np = v->num;
+		return 1;
+	}
+	if (!arith_num(v->str + len + 1, np)) return 0;
+	v->num = *np;
+	v->flags |= VAR_NUM;
+	return 1;
 }
 
-/* File descriptors to duplicated stdin and stdout. */
-int dup_in;
-int dup_out;
+/*
+ * Set the variable name (of length len) to the integer n, keeping its
+ * flags. Its string is reused, and only formatted when read (see var_getn),
+ * unless the variable is exported.
+ */
+void var_put_num(const char *name, size_t len, long long n) {
+	struct var *v = var_slot(name, len, var_hash(name, len));
+	if (!v->str || (v->flags & (VAR_EXPORT | VAR_NOVAL)) || v->size < len + NUMSIZE + 2) {
+		char buf[NUMSIZE + 1];
+		snprintf(buf, sizeof(buf), "%lld", n);
+		v = var_set(name, len, buf, v->str ? v->flags & ~VAR_NOVAL : 0, NUMSIZE);
+	} else {
+		v->flags |= VAR_LAZY;
+	}
+	v->num = n;
+	v->flags |= VAR_NUM;
+}
 
-void dup_io() {
-	dup_in = dup(STDIN_FILENO);
-	sys_err(dup_in);
-	dup_out = dup(STDIN_FILENO);
-	sys_err(dup_out);
+/*
+ * Report an error at the current character (unless one was reported
+ * already), and return 0.
+ */
+long long arith_error(struct arith *a, const char *msg) {
+	if (!a->err) {
+		a->err = msg;
+		fprintf(stderr, PREF": %.*s: %s (error token is \"%.*s\")\n", (int)(a->end - a->expr), a->expr,
+				msg, (int)(a->end - a->p), a->p);
+	}
+	return 0;
 }
 
-void restore_io() {
-	sys_err(dup2(dup_in, STDIN_FILENO));
-	sys_err(dup2(dup_out, STDOUT_FILENO));
+void arith_blank(struct arith *a) {
+	while (a->p < a->end && (*a->p == ' ' || *a->p == '\t' || *a->p == '\n')) ++a->p;
 }
 
 /*
- * Execute an entire command.
- * Includes piping, redirection, handling builtin commands, and forking.
- *
- * Notes / Salient features:
- * - presence or absence of spaces, tabs, etc. around |, <, > are supported.
- * - any number of pipes are supported.
- * - any combination of piping and redirection is supported.
- * - piped parts are executed concurrently as in bash.
- * - proper release of resources has been ensured.
+ * Skip the character c if it comes next.
  */
-#define PIPE_DELIM "|"
-/* used to prepend "./" to argv[0] */
-#define BUFSIZE 300
-void exec_cmd(char *cmd) {
+int arith_skip(struct arith *a, char c) {
+	arith_blank(a);
+	if (a->p == a->end || *a->p != c) return 0;
+	++a->p;
+	return 1;
+}
 
-	char *prog; // individual program to be executed at a time
-	int pfd[2]; // pipe file descriptors
-	pfd[0] = STDIN_FILENO;
+/*
+ * Whether ++ or -- comes next.
+ */
+int arith_incr(struct arith *a) {
+	arith_blank(a);
+	return a->end - a->p >= 2 && (*a->p == '+' || *a->p == '-') && a->p[1] == *a->p;
+}
 
-	// loop through every piped part
-	while ((prog = strsep(&cmd, PIPE_DELIM)) != NULL) {
-		// piping
-		int in = pfd[0];
-		int out;
-		if (cmd) {
-			pipe(pfd);
-			out = pfd[1];
-		} else {
-			out = STDOUT_FILENO;
+/*
+ * Length of the variable name at the current character, or 0.
+ */
+size_t arith_name(struct arith *a) {
+	const char *p = a->p;
+	if (p == a->end || (!isalpha((unsigned char)*p) && *p != '_')) return 0;
+	while (p < a->end && (isalnum((unsigned char)*p) || *p == '_')) ++p;
+	return p - a->p;
+}
+
+int arith_eval(const char *s, const char *end, long long *np, int depth);
+
+/*
+ * Value of the variable name (of length len): an integer, or an expression
+ * which is evaluated.
+ */
+long long arith_var(struct arith *a, const char *name, size_t len) {
+	long long n;
+	if (var_num(name, len, &n)) return n;
+	if (a->depth >= MAX_DEPTH) return arith_error(a, "expression recursion level exceeded");
+	const char *val = var_getn(name, len);
+	if (!arith_eval(val, val + strlen(val), &n, a->depth + 1)) a->err = "";
+	return n;
+}
+
+/*
+ * Binary operators, with their precedence (higher binds tighter); those
+ * which are the start of an assignment operator are left out.
+ */
+struct arith_op {
+	const char *op;
+	int len;
+	int prec;
+};
+
+struct arith_op arith_ops[] = {
+	{ "||", 2, 1 }, { "&&", 2, 2 }, { "|", 1, 3 }, { "^", 1, 4 }, { "&", 1, 5 },
+	{ "==", 2, 6 }, { "!=", 2, 6 }, { "<=", 2, 7 }, { ">=", 2, 7 }, { "<<", 2, 8 }, { ">>", 2, 8 },
+	{ "<", 1, 7 }, { ">", 1, 7 }, { "+", 1, 9 }, { "-", 1, 9 },
+	{ "**", 2, 11 }, { "*", 1, 10 }, { "/", 1, 10 }, { "%", 1, 10 },
+	{ NULL, 0, 0 }
+};
+
+/*
+ * The binary operator at the current character, or NULL.
+ */
+struct arith_op *arith_binop(struct arith *a) {
+	struct arith_op *o;
+	arith_blank(a);
+	size_t n = a->end - a->p;
+	if (!n) return NULL;
+	for (o = arith_ops; o->op; ++o) {
+		if (o->op[0] != *a->p || (o->len == 2 && (n < 2 || o->op[1] != a->p[1]))) continue;
+		// an assignment (such as +=)
+		if ((size_t)o->len < n && a->p[o->len] == '=' && o->prec >= 3 && o->prec != 6 && o->prec != 7) return NULL;
+		return o;
+	}
+	return NULL;
+}
+
+/*
+ * Length of the assignment operator at the current character, or 0. The
+ * binary operator it applies (none for =) goes to bin.
+ */
+int arith_assign_op(struct arith *a, char *bin) {
+	const char *p = a->p;
+	size_t n = a->end - p;
+	bin[0] = bin[1] = bin[2] = '\0';
+	if (n >= 1 && p[0] == '=') return n >= 2 && p[1] == '=' ? 0 : 1;
+	if (n >= 2 && p[1] == '=' && strchr("*/%+-&^|", p[0])) {
+		bin[0] = p[0];
+		return 2;
+	}
+	if (n >= 3 && (p[0] == '<' || p[0] == '>') && p[1] == p[0] && p[2] == '=') {
+		bin[0] = bin[1] = p[0];
+		return 3;
+	}
+	return 0;
+}
+
+/*
+ * Apply the binary operator op (not && ||) to l and r.
+ */
+long long arith_apply(struct arith *a, const char *op, long long l, long long r, int noeval) {
+	unsigned long long ul = l, ur = r;
+	switch (op[0]) {
+	case '|': return l | r;
+	case '^': return l ^ r;
+	case '&': return l & r;
+	case '=': return l == r;
+	case '!': return l != r;
+	case '+': return (long long)(ul + ur);
+	case '-': return (long long)(ul - ur);
+	case '*':
+		if (op[1] != '*') return (long long)(ul * ur);
+		if (r < 0) return noeval ? 0 : arith_error(a, "exponent less than 0");
+		for (ur = 1; r; r >>= 1, ul *= ul) {
+			if (r & 1) ur *= ul;
 		}
+		return (long long)ur;
+	case '<':
+		if (op[1] == '<') return (long long)(ul << (r & 63));
+		return op[1] == '=' ? l <= r : l < r;
+	case '>':
+		if (op[1] == '>') return l >> (r & 63);
+		return op[1] == '=' ? l >= r : l > r;
+	}
+	// / %
+	if (r == 0) return noeval ? 0 : arith_error(a, "division by 0");
+	if (r == -1) return op[0] == '/' ? (long long)(0 - ul) : 0; // no trap on the smallest integer
+	return op[0] == '/' ? l / r : l % r;
+}
+
+long long arith_assign(struct arith *a, int noeval);
+long long arith_comma(struct arith *a, int noeval);
 
-		// redirection
-		char *infile, *outfile;
-		get_io(prog, &infile, &outfile);
-		if (*infile) { // if infile is non-empty
-			in = open(infile, O_RDONLY);
-			sys_err(in);
+/*
+ * Operand: a number, a variable (with ++ or -- after it), a unary
+ * operator and its operand, or an expression in parentheses.
+ */
+long long arith_unary(struct arith *a, int noeval) {
+	long long n;
+	size_t len;
+	if (a->err) return 0;
+	arith_blank(a);
+	if (a->p == a->end) return arith_error(a, "operand expected");
+	const char *p = a->p;
+	if ((*p == '+' || *p == '-') && p + 1 < a->end && p[1] == *p) {
+		// ++name, --name
+		a->p += 2;
+		arith_blank(a);
+		if (!(len = arith_name(a))) return arith_error(a, "variable expected");
+		const char *name = a->p;
+		a->p += len;
+		n = arith_var(a, name, len) + (*p == '+' ? 1 : -1);
+		if (!noeval && !a->err) var_put_num(name, len, n);
+		return n;
+	}
+	if (strchr("+-!~", *p)) {
+		++a->p;
+		n = arith_unary(a, noeval);
+		switch (*p) {
+		case '-': return (long long)(0 - (unsigned long long)n);
+		case '!': return !n;
+		case '~': return ~n;
 		}
-		if (*outfile) { // if outfile is non-empty
-			out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-			sys_err(out);
+		return n;
+	}
+	if (*p == '(') {
+		++a->p;
+		n = arith_comma(a, noeval);
+		if (!a->err && !arith_skip(a, ')')) return arith_error(a, "missing ')'");
+		return n;
+	}
+	if (isdigit((unsigned char)*p)) {
+		char *end;
+		n = (long long)strtoull(p, &end, 0);
+		a->p = end;
+		if (arith_name(a) || (a->p < a->end && isdigit((unsigned char)*a->p))) {
+			a->p = p;
+			return arith_error(a, "invalid number");
 		}
+		return n;
+	}
+	if (!(len = arith_name(a))) return arith_error(a, "syntax error: operand expected");
+	a->p += len;
+	n = arith_var(a, p, len);
+	if (arith_incr(a)) {
+		// name++, name--: the value before
+		if (!noeval && !a->err) var_put_num(p, len, n + (*a->p == '+' ? 1 : -1));
+		a->p += 2;
+	}
+	return n;
+}
 
-		dup2(in, STDIN_FILENO);
-		dup2(out, STDOUT_FILENO);
-
-		// execution
-		char **argv = parse_cmd(prog);
-		int bi = find_builtin(argv[0]);
-		if (bi >= 0) {
-			(*builtin_fns[bi])(argv);
+/*
+ * Operands joined by binary operators of precedence at least prec.
+ */
+long long arith_binary(struct arith *a, int prec, int noeval) {
+	long long l = arith_unary(a, noeval);
+	struct arith_op *o;
+	while (!a->err && (o = arith_binop(a)) && o->prec >= prec) {
+		a->p += o->len;
+		if (o->prec <= 2) {
+			// && ||: the right operand only counts if the left does not decide
+			int decided = o->prec == 1 ? l != 0 : l == 0;
+			long long r = arith_binary(a, o->prec + 1, noeval || decided);
+			l = decided ? o->prec == 1 : r != 0;
 		} else {
-			pid_t pid = fork();
-			sys_err(pid);
-			if (pid == 0) {
-				int err = execvp(argv[0], argv);
-				if (err < 0) {
-					// try prepending with "./" to search in current path
-					char *tmp = argv[0];
-					char *buf = malloc(BUFSIZE * sizeof(char));
-					strcpy(buf, "./");
-					argv[0] = strncat(buf, argv[0], BUFSIZE);
-					err = execvp(argv[0], argv);
-					prog_err(err, tmp);
-					free(buf);
-				}
-			}
+			// ** groups to the right
+			long long r = arith_binary(a, o->prec + (o->prec != 11), noeval);
+			l = arith_apply(a, o->op, l, r, noeval);
 		}
+	}
+	return l;
+}
+
+/*
+ * condition ? expression : expression
+ */
+long long arith_cond(struct arith *a, int noeval) {
+	long long c = arith_binary(a, 1, noeval);
+	if (a->err || !arith_skip(a, '?')) return c;
+	long long t = arith_comma(a, noeval || !c);
+	if (!a->err && !arith_skip(a, ':')) return arith_error(a, "expected ':'");
+	long long e = arith_assign(a, noeval || c);
+	return c ? t : e;
+}
 
-		if (in != STDIN_FILENO) sys_err(close(in));
-		if (out != STDOUT_FILENO) sys_err(close(out));
-		restore_io(); // revert stdin and stdout
+/*
+ * name op= expression, or a conditional expression.
+ */
+long long arith_assign(struct arith *a, int noeval) {
+	char bin[3];
+	int olen;
+	if (a->err) return 0;
+	arith_blank(a);
+	size_t len = arith_name(a);
+	if (len) {
+		const char *name = a->p;
+		a->p += len;
+		arith_blank(a);
+		if ((olen = arith_assign_op(a, bin))) {
+			a->p += olen;
+			long long r = arith_assign(a, noeval);
+			if (bin[0]) r = arith_apply(a, bin, arith_var(a, name, len), r, noeval);
+			if (!noeval && !a->err) var_put_num(name, len, r);
+			return r;
+		}
+		a->p = name;
 	}
-	int status;
-	while (wait(&status) > 0) ; // wait for all child processes to terminate
+	return arith_cond(a, noeval);
 }
-#undef BUFSIZE
 
-int main() {
-	dup_io();
-	// shell loop
-	while (1) {
-		print_prompt();
-		exec_cmd(read_cmd());
+/*
+ * Expressions separated by ',': the value of the last.
+ */
+long long arith_comma(struct arith *a, int noeval) {
+	long long n = arith_assign(a, noeval);
+	while (!a->err && arith_skip(a, ',')) n = arith_assign(a, noeval);
+	return n;
+}
+
+/*
+ * Evaluate the expression from s to end (its expansions done already) into
+ * *np. depth counts the variables being evaluated as expressions.
+ * Return 0, after printing an error, if it is malformed.
+ */
+int arith_eval(const char *s, const char *end, long long *np, int depth) {
+	struct arith a = { s, end, s, NULL, depth };
+	*np = arith_comma(&a, 0);
+	arith_blank(&a);
+	if (!a.err && a.p != a.end) arith_error(&a, "syntax error in expression");
+	return !a.err;
+}
+
+/*
+ * End of the expression of $((expression)) or ((expression)) starting at
+ * p: the first of the closing "))", or NULL if the parentheses do not close
+ * that way.
+ */
+char *arith_end(char *p) {
+	int depth = 0;
+	for (; *p; ++p) {
+		if (*p == '(') {
+			++depth;
+		} else if (*p == ')' && !depth--) {
+			return p[1] == ')' ? p : NULL;
+		}
+	}
+	return NULL;
+}
+
+char *lex_string(char *p, char *end, int doc);
+
+/*
+ * Evaluate the expression from s to end as typed: its parameters and
+ * command substitutions are expanded, and quotes removed, first.
+ * Return 0, after printing an error, if it is malformed.
+ */
+int arith_expand(char *s, char *end, long long *np) {
+	char *p;
+	for (p = s; p < end && *p != '$' && *p != '`' && *p != '\'' && *p != '"' && *p != '\\'; ++p) ;
+	if (p < end) {
+		// not as it is
+		if (!(s = lex_string(s, end, 0))) return 0;
+		end = s + strlen(s);
+	}
+	return arith_eval(s, end, np, 0);
+}
+
+/*
+ * let expression...: evaluate each expression. The status is 0 if the last
+ * is not 0.
+ */
+int builtin_let(char **argv) {
+	long long n = 0;
+	if (!argv[1]) {
+		fprintf(stderr, PREF": let: expression expected\n");
+		return EXIT_FAILURE;
+	}
+	for (++argv; *argv; ++argv) {
+		if (!arith_eval(*argv, *argv + strlen(*argv), &n, 0)) return EXIT_FAILURE;
+	}
+	return n ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#undef MAX_DEPTH
+#undef NUMSIZE
+
+/*
+ * Builtin function implementations.
+ * Each returns the exit status of the command.
+ */
+
+void hash_drop_rel();
+
+int builtin_cd(char **argv) {
+	char *dir = argv[1] ? argv[1] : var_get("HOME"); // cd to ~ by default
+	if (!dir) {
+		fprintf(stderr, PREF": cd: HOME not set\n");
+		return EXIT_FAILURE;
+	}
+	if (chdir(dir)) {
+		perror(PREF);
+		return EXIT_FAILURE;
+	}
+	hash_drop_rel();
+	return EXIT_SUCCESS;
+}
+
+#define BUFSIZE 256
+int builtin_pwd(char **argv) {
+	size_t size = BUFSIZE;
+	char *buf = arena_alloc(size);
+	while (!getcwd(buf, size)) {
+		if (errno != ERANGE) {
+			perror(PREF);
+			return EXIT_FAILURE;
+		}
+		buf = arena_grow(buf, size, size * 2);
+		size *= 2;
+	}
+	out_str(buf);
+	out_putc('\n');
+	return EXIT_SUCCESS;
+}
+#undef BUFSIZE
+
+int builtin_mkdir(char **argv) {
+	if (argv[1]) {
+		if (mkdir(argv[1], 0777)) {
+			perror(PREF);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	} else {
+		out_str("usage: mkdir directory\n");
+		return EXIT_FAILURE;
+	}
+}
+
+int builtin_rmdir(char **argv) {
+	if (argv[1]) {
+		if (rmdir(argv[1])) {
+			perror(PREF);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	} else {
+		out_str("usage: rmdir directory\n");
+		return EXIT_FAILURE;
+	}
+}
+
+/*
+ * exit [n]: exit with status n, or that of the last command.
+ */
+int builtin_exit(char **argv) {
+	exit(argv[1] ? atoi(argv[1]) : last_status);
+}
+
+/*
+ * Utilities built in so that scripts do not spawn a process for each call.
+ * They follow POSIX (and coreutils where POSIX leaves a choice), and write
+ * through the buffered output above.
+ */
+
+int builtin_true(char **argv) {
+	return EXIT_SUCCESS;
+}
+
+int builtin_false(char **argv) {
+	return EXIT_FAILURE;
+}
+
+/*
+ * Decode the escape sequence following a backslash at *sp into *cp, and
+ * advance *sp past it.
+ * Octal escapes are \0nnn, or \nnn in a printf format ('fmt' set).
+ * An unknown sequence stands for itself (the backslash is decoded alone).
+ * Return 0 for \c, which ends the output.
+ */
+int esc_decode(const char **sp, char *cp, int fmt) {
+	const char *s = *sp;
+	int c = *s++, n = 0;
+	switch (c) {
+	case 'a': c = '\a'; break;
+	case 'b': c = '\b'; break;
+	case 'c': *sp = s; return 0;
+	case 'e': c = '\033'; break;
+	case 'f': c = '\f'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 't': c = '\t'; break;
+	case 'v': c = '\v'; break;
+	case '\\': break;
+	case 'x':
+		if (!isxdigit((unsigned char)*s)) goto literal;
+		for (c = 0; n < 2 && isxdigit((unsigned char)*s); ++n, ++s) {
+			c = c * 16 + (isdigit((unsigned char)*s) ? *s - '0' : tolower((unsigned char)*s) - 'a' + 10);
+		}
+		break;
+	default:
+		if (fmt && c == '"') break;
+		if (c == '0' && !fmt) {
+			c = 0;
+		} else if (fmt && c >= '0' && c <= '7') {
+			c -= '0';
+			n = 1;
+		} else {
+			goto literal;
+		}
+		for ( ; n < 3 && *s >= '0' && *s <= '7'; ++n) c = c * 8 + *s++ - '0';
+		break;
+	literal:
+		c = '\\';
+		s = *sp;
+	}
+	*cp = c;
+	*sp = s;
+	return 1;
+}
+
+/*
+ * Output s with escape sequences decoded.
+ * Return 0 if it had \c.
+ */
+int out_escapes(const char *s) {
+	while (*s) {
+		const char *bs = strchrnul(s, '\\');
+		out_write(s, bs - s);
+		if (!*bs) break;
+		char c;
+		s = bs + 1;
+		if (!esc_decode(&s, &c, 0)) return 0;
+		out_putc(c);
+	}
+	return 1;
+}
+
+/*
+ * echo [-neE] [arg...]: write the arguments, separated by spaces.
+ * -n: no trailing newline.
+ * -e / -E: decode escape sequences (see esc_decode) / do not (default).
+ */
+int builtin_echo(char **argv) {
+	int nl = 1, esc = 0;
+	++argv;
+	for ( ; *argv && (*argv)[0] == '-' && (*argv)[1]; ++argv) {
+		char *o = *argv + 1;
+		if (o[strspn(o, "neE")]) break; // not an option: echo it
+		for ( ; *o; ++o) {
+			if (*o == 'n') nl = 0;
+			else esc = *o == 'e';
+		}
+	}
+	for ( ; *argv; ++argv) {
+		if (!esc) {
+			out_str(*argv);
+		} else if (!out_escapes(*argv)) {
+			return EXIT_SUCCESS;
+		}
+		if (argv[1]) out_putc(' ');
+	}
+	if (nl) out_putc('\n');
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Numeric argument of printf: a C constant, or the character after a
+ * leading quote. Set *statusp on error.
+ */
+intmax_t printf_int(const char *s, int *statusp) {
+	if (*s == '\'' || *s == '"') return (unsigned char)s[1];
+	char *end;
+	errno = 0;
+	intmax_t v = strtoimax(s, &end, 0);
+	if (*s && (*end || errno)) {
+		fprintf(stderr, PREF": printf: %s: invalid number\n", s);
+		*statusp = EXIT_FAILURE;
+	}
+	return v;
+}
+
+double printf_float(const char *s, int *statusp) {
+	if (*s == '\'' || *s == '"') return (unsigned char)s[1];
+	char *end;
+	errno = 0;
+	double v = strtod(s, &end);
+	if (*s && (*end || errno)) {
+		fprintf(stderr, PREF": printf: %s: invalid number\n", s);
+		*statusp = EXIT_FAILURE;
+	}
+	return v;
+}
+
+/*
+ * Output the format once, taking arguments from *argsp.
+ * Return 0 if the output has ended (by \c or an error).
+ */
+#define SPECSIZE 32
+int printf_once(const char *fmt, char ***argsp, int *statusp) {
+	char **args = *argsp;
+	while (*fmt) {
+		size_t run = strcspn(fmt, "%\\");
+		out_write(fmt, run);
+		fmt += run;
+		if (!*fmt) break;
+		if (*fmt == '\\') {
+			char c;
+			++fmt;
+			if (!esc_decode(&fmt, &c, 1)) return 0;
+			out_putc(c);
+			continue;
+		}
+		if (fmt[1] == '%') {
+			out_putc('%');
+			fmt += 2;
+			continue;
+		}
+
+		// conversion specification, rebuilt for snprintf
+		char spec[SPECSIZE];
+		const char *start = fmt++;
+		int stars[2], nstars = 0;
+		fmt += strspn(fmt, "-+ #0");
+		if (*fmt == '*') {
+			stars[nstars++] = printf_int(*args ? *args++ : "", statusp);
+			++fmt;
+		} else {
+			fmt += strspn(fmt, "0123456789");
+		}
+		if (*fmt == '.') {
+			++fmt;
+			if (*fmt == '*') {
+				stars[nstars++] = printf_int(*args ? *args++ : "", statusp);
+				++fmt;
+			} else {
+				fmt += strspn(fmt, "0123456789");
+			}
+		}
+		size_t flen = fmt - start;
+		fmt += strspn(fmt, "hlLqjzt"); // sizes are always the largest
+		char conv = *fmt++;
+		if (!conv || flen + 3 >= SPECSIZE || !strchr("diouxXeEfFgGaAcsb", conv)) {
+			fprintf(stderr, PREF": printf: %.*s: invalid conversion\n", (int)(fmt - start), start);
+			*statusp = EXIT_FAILURE;
+			return 0;
+		}
+		memcpy(spec, start, flen);
+		char *arg = *args ? *args++ : NULL;
+		char *sp = spec + flen;
+		if (strchr("diouxX", conv)) {
+			*sp++ = 'j';
+			*sp++ = conv;
+			*sp = '\0';
+			intmax_t v = printf_int(arg ? arg : "", statusp);
+			if (nstars == 2) out_printf(spec, stars[0], stars[1], v);
+			else if (nstars == 1) out_printf(spec, stars[0], v);
+			else out_printf(spec, v);
+			continue;
+		}
+		if (strchr("eEfFgGaA", conv)) {
+			*sp++ = conv;
+			*sp = '\0';
+			double v = printf_float(arg ? arg : "", statusp);
+			if (nstars == 2) out_printf(spec, stars[0], stars[1], v);
+			else if (nstars == 1) out_printf(spec, stars[0], v);
+			else out_printf(spec, v);
+			continue;
+		}
+		int stop = 0;
+		if (!arg) {
+			arg = "";
+		} else if (conv == 'c') {
+			arg = arena_strdup(arg);
+			if (*arg) arg[1] = '\0';
+		} else if (conv == 'b') {
+			// decode into a copy; the result is never longer
+			const char *s = arg;
+			char *d = arg = arena_alloc(strlen(s) + 1);
+			while (*s) {
+				if (*s != '\\') {
+					*d++ = *s++;
+				} else if (++s, !esc_decode(&s, d++, 0)) {
+					--d;
+					stop = 1;
+					break;
+				}
+			}
+			*d = '\0';
+		}
+		*sp++ = 's';
+		*sp = '\0';
+		if (nstars == 2) out_printf(spec, stars[0], stars[1], arg);
+		else if (nstars == 1) out_printf(spec, stars[0], arg);
+		else out_printf(spec, arg);
+		if (stop) return 0;
+	}
+	*argsp = args;
+	return 1;
+}
+#undef SPECSIZE
+
+/*
+ * printf format [arg...]: as printf(1).
+ * The format is reused as long as it uses up some of the arguments.
+ */
+int builtin_printf(char **argv) {
+	if (!argv[1]) {
+		fprintf(stderr, PREF": printf: usage: printf format [arg...]\n");
+		return EXIT_FAILURE;
+	}
+	char **args = argv + 2;
+	int status = EXIT_SUCCESS;
+	while (1) {
+		char **start = args;
+		if (!printf_once(argv[1], &args, &status)) break;
+		if (!*args || args == start) break;
+	}
+	return status;
+}
+
+/*
+ * test expression / [ expression ]: evaluate a condition, as test(1).
+ * Up to four arguments are read as POSIX specifies (so that "test -n !"
+ * works); longer expressions are parsed with -o, -a, ! and parentheses,
+ * -a binding tighter than -o.
+ * The status is 0 if true, 1 if false and 2 on error.
+ */
+char **test_argv;
+int test_argc;
+int test_pos;
+int test_err;
+
+void test_error(const char *msg, const char *arg) {
+	if (!test_err) {
+		if (arg) fprintf(stderr, PREF": test: %s: %s\n", arg, msg);
+		else fprintf(stderr, PREF": test: %s\n", msg);
+	}
+	test_err = 1;
+}
+
+intmax_t test_int(const char *s) {
+	char *end;
+	errno = 0;
+	intmax_t v = strtoimax(s, &end, 10);
+	while (*end == ' ' || *end == '\t') ++end;
+	if (end == s || *end || errno) test_error("integer expression expected", s);
+	return v;
+}
+
+int test_isunary(const char *op) {
+	return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghknprstuwxzGLOS", op[1]);
+}
+
+/*
+ * Return 1 if op is a binary operator, setting *rp to the value of a op b.
+ */
+int test_binary(const char *a, const char *op, const char *b, int *rp) {
+	struct stat sa, sb;
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) *rp = strcmp(a, b) == 0;
+	else if (strcmp(op, "!=") == 0) *rp = strcmp(a, b) != 0;
+	else if (strcmp(op, "<") == 0) *rp = strcmp(a, b) < 0;
+	else if (strcmp(op, ">") == 0) *rp = strcmp(a, b) > 0;
+	else if (strcmp(op, "-eq") == 0) *rp = test_int(a) == test_int(b);
+	else if (strcmp(op, "-ne") == 0) *rp = test_int(a) != test_int(b);
+	else if (strcmp(op, "-lt") == 0) *rp = test_int(a) < test_int(b);
+	else if (strcmp(op, "-le") == 0) *rp = test_int(a) <= test_int(b);
+	else if (strcmp(op, "-gt") == 0) *rp = test_int(a) > test_int(b);
+	else if (strcmp(op, "-ge") == 0) *rp = test_int(a) >= test_int(b);
+	else if (strcmp(op, "-ef") == 0) {
+		*rp = stat(a, &sa) == 0 && stat(b, &sb) == 0
+			&& sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+	} else if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0) {
+		int ea = stat(a, &sa) == 0, eb = stat(b, &sb) == 0;
+		if (op[1] == 'o') { // a -ot b is b -nt a
+			struct stat t = sa;
+			int e = ea;
+			sa = sb, ea = eb;
+			sb = t, eb = e;
+		}
+		if (ea && eb) {
+			*rp = sa.st_mtim.tv_sec > sb.st_mtim.tv_sec
+				|| (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec
+					&& sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec);
+		} else {
+			*rp = ea;
+		}
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+int test_unary(const char *op, const char *a) {
+	struct stat st;
+	switch (op[1]) {
+	case 'n': return *a != '\0';
+	case 'z': return *a == '\0';
+	case 't': return isatty(test_int(a));
+	case 'r': return eaccess(a, R_OK) == 0;
+	case 'w': return eaccess(a, W_OK) == 0;
+	case 'x': return eaccess(a, X_OK) == 0;
+	case 'h':
+	case 'L': return lstat(a, &st) == 0 && S_ISLNK(st.st_mode);
+	}
+	if (stat(a, &st) < 0) return 0;
+	switch (op[1]) {
+	case 'b': return S_ISBLK(st.st_mode);
+	case 'c': return S_ISCHR(st.st_mode);
+	case 'd': return S_ISDIR(st.st_mode);
+	case 'e': return 1;
+	case 'f': return S_ISREG(st.st_mode);
+	case 'g': return (st.st_mode & S_ISGID) != 0;
+	case 'k': return (st.st_mode & S_ISVTX) != 0;
+	case 'p': return S_ISFIFO(st.st_mode);
+	case 's': return st.st_size > 0;
+	case 'u': return (st.st_mode & S_ISUID) != 0;
+	case 'G': return st.st_gid == getegid();
+	case 'O': return st.st_uid == geteuid();
+	case 'S': return S_ISSOCK(st.st_mode);
+	}
+	return 0;
+}
+
+int test_or();
+
+int test_primary() {
+	if (test_pos >= test_argc) {
+		test_error("argument expected", NULL);
+		return 0;
+	}
+	char **a = test_argv + test_pos;
+	int r, left = test_argc - test_pos;
+	if (strcmp(a[0], "!") == 0) {
+		++test_pos;
+		return !test_primary();
+	}
+	if (left >= 3 && test_binary(a[0], a[1], a[2], &r)) {
+		test_pos += 3;
+		return r;
+	}
+	if (strcmp(a[0], "(") == 0) {
+		++test_pos;
+		r = test_or();
+		if (test_pos >= test_argc || strcmp(test_argv[test_pos], ")") != 0) {
+			test_error("')' expected", NULL);
+		}
+		++test_pos;
+		return r;
+	}
+	if (left >= 2 && test_isunary(a[0])) {
+		test_pos += 2;
+		return test_unary(a[0], a[1]);
+	}
+	++test_pos;
+	return *a[0] != '\0';
+}
+
+int test_and() {
+	int r = test_primary();
+	while (test_pos < test_argc && strcmp(test_argv[test_pos], "-a") == 0) {
+		++test_pos;
+		r = test_primary() && r;
+	}
+	return r;
+}
+
+int test_or() {
+	int r = test_and();
+	while (test_pos < test_argc && strcmp(test_argv[test_pos], "-o") == 0) {
+		++test_pos;
+		r = test_and() || r;
+	}
+	return r;
+}
+
+/*
+ * Evaluate n arguments by the POSIX rules for up to four arguments.
+ */
+int test_args(char **a, int n) {
+	int r;
+	switch (n) {
+	case 0:
+		return 0;
+	case 1:
+		return *a[0] != '\0';
+	case 2:
+		if (strcmp(a[0], "!") == 0) return !test_args(a + 1, 1);
+		if (test_isunary(a[0])) return test_unary(a[0], a[1]);
+		test_error("unary operator expected", a[0]);
+		return 0;
+	case 3:
+		if (test_binary(a[0], a[1], a[2], &r)) return r;
+		if (strcmp(a[0], "!") == 0) return !test_args(a + 1, 2);
+		if (strcmp(a[0], "(") == 0 && strcmp(a[2], ")") == 0) return test_args(a + 1, 1);
+		break;
+	case 4:
+		if (strcmp(a[0], "!") == 0) return !test_args(a + 1, 3);
+		if (strcmp(a[0], "(") == 0 && strcmp(a[3], ")") == 0) return test_args(a + 1, 2);
+		break;
+	}
+	test_argv = a;
+	test_argc = n;
+	test_pos = 0;
+	r = test_or();
+	if (test_pos < test_argc) test_error("unexpected argument", test_argv[test_pos]);
+	return r;
+}
+
+int builtin_test(char **argv) {
+	int n;
+	for (n = 0; argv[n + 1]; ++n) ;
+	if (strcmp(argv[0], "[") == 0) {
+		if (!n || strcmp(argv[n], "]") != 0) {
+			fprintf(stderr, PREF": [: missing ']'\n");
+			return 2;
+		}
+		--n;
+	}
+	test_err = 0;
+	int r = test_args(argv + 1, n);
+	return test_err ? 2 : !r;
+}
+
+/*
+ * basename string [suffix]: string without its directory part (and suffix).
+ */
+int builtin_basename(char **argv) {
+	if (argv[1] && strcmp(argv[1], "--") == 0) ++argv;
+	if (!argv[1] || (argv[2] && argv[3])) {
+		fprintf(stderr, PREF": basename: usage: basename string [suffix]\n");
+		return EXIT_FAILURE;
+	}
+	char *s = argv[1];
+	size_t len = strlen(s);
+	while (len > 1 && s[len - 1] == '/') --len;
+	if (len == 1 && s[0] == '/') {
+		out_str("/\n");
+		return EXIT_SUCCESS;
+	}
+	char *base = memrchr(s, '/', len);
+	base = base ? base + 1 : s;
+	len -= base - s;
+	if (argv[2]) {
+		size_t slen = strlen(argv[2]);
+		if (slen < len && memcmp(base + len - slen, argv[2], slen) == 0) len -= slen;
+	}
+	out_write(base, len);
+	out_putc('\n');
+	return EXIT_SUCCESS;
+}
+
+/*
+ * dirname string...: the directory part of each string.
+ */
+int builtin_dirname(char **argv) {
+	if (argv[1] && strcmp(argv[1], "--") == 0) ++argv;
+	if (!argv[1]) {
+		fprintf(stderr, PREF": dirname: usage: dirname string...\n");
+		return EXIT_FAILURE;
+	}
+	for (++argv; *argv; ++argv) {
+		char *s = *argv;
+		size_t len = strlen(s);
+		while (len > 1 && s[len - 1] == '/') --len; // trailing slashes
+		while (len > 0 && s[len - 1] != '/') --len; // last component
+		if (len == 0) {
+			out_str(".\n");
+			continue;
+		}
+		while (len > 1 && s[len - 1] == '/') --len; // slashes before it
+		out_write(s, len);
+		out_putc('\n');
+	}
+	return EXIT_SUCCESS;
+}
+
+int var_strcmp(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * export [name[=value]...]: mark variables as exported, assigning them if a
+ * value is given. Without arguments, list the exported variables in a form
+ * which can be read back.
+ */
+int builtin_export(char **argv) {
+	int status = EXIT_SUCCESS;
+	if (!argv[1]) {
+		size_t i, n = 0;
+		char **v = arena_alloc((var_cnt + 1) * sizeof(char *));
+		for (i = 0; i < var_cap; ++i) {
+			if (var_tab[i].str && (var_tab[i].flags & VAR_EXPORT)) v[n++] = var_tab[i].str;
+		}
+		qsort(v, n, sizeof(char *), var_strcmp);
+		for (i = 0; i < n; ++i) {
+			char *s = strchr(v[i], '=');
+			out_str("export ");
+			out_write(v[i], s - v[i]);
+			if (var_flags(v[i], s - v[i]) & VAR_NOVAL) {
+				out_putc('\n');
+				continue;
+			}
+			out_str("=\"");
+			for (++s; *s; ++s) {
+				if (strchr("\\\"$`", *s)) out_putc('\\');
+				out_putc(*s);
+			}
+			out_str("\"\n");
+		}
+		return status;
+	}
+	for (++argv; *argv; ++argv) {
+		size_t len = var_name_len(*argv);
+		if (!len || ((*argv)[len] && (*argv)[len] != '=')) {
+			fprintf(stderr, PREF": export: '%s': not a valid identifier\n", *argv);
+			status = EXIT_FAILURE;
+		} else if ((*argv)[len]) {
+			var_assign(*argv, VAR_EXPORT);
+		} else {
+			int flags = var_flags(*argv, len);
+			if (!(flags & VAR_EXPORT)) var_put(*argv, len, var_getn(*argv, len), flags | VAR_EXPORT);
+		}
+	}
+	return status;
+}
+
+int builtin_unset(char **argv) {
+	int status = EXIT_SUCCESS;
+	for (++argv; *argv; ++argv) {
+		size_t len = var_name_len(*argv);
+		if (!len || (*argv)[len]) {
+			fprintf(stderr, PREF": unset: '%s': not a valid identifier\n", *argv);
+			status = EXIT_FAILURE;
+		} else {
+			var_unset(*argv);
+		}
+	}
+	return status;
+}
+
+/*
+ * read [-r] [name...]: read a line of stdin into the variables (REPLY if
+ * none), split at blanks, the last one taking the rest of the line.
+ * Without -r, a backslash is removed, and keeps the character after it (a
+ * newline goes on to the next line).
+ * A pipe is read a byte at a time, so that no more than the line is taken
+ * from it; a regular file is read in blocks, and set back to the end of the
+ * line.
+ */
+#define READSIZE 4096
+#define BLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\n')
+int builtin_read(char **argv) {
+	int raw = 0, esc = 0, nl = 0;
+	struct stat st;
+	char buf[READSIZE];
+	char *line = NULL;
+	size_t len = 0, cap = 0, i;
+	if (argv[1] && strcmp(argv[1], "-r") == 0) {
+		raw = 1;
+		++argv;
+	}
+	char *reply[] = { "REPLY", NULL }, **names = argv[1] ? argv + 1 : reply, **name;
+	for (name = names; *name; ++name) {
+		size_t n = var_name_len(*name);
+		if (!n || (*name)[n]) {
+			fprintf(stderr, PREF": read: '%s': not a valid identifier\n", *name);
+			return EXIT_FAILURE;
+		}
+	}
+	size_t size = fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) ? READSIZE : 1;
+	while (!nl) {
+		ssize_t n = read(STDIN_FILENO, buf, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			prog_warn(errno, "read");
+			return EXIT_FAILURE;
+		}
+		if (n == 0) break;
+		if (len + n + 1 > cap) {
+			line = arena_grow(line, cap, 2 * (len + n + 1));
+			cap = 2 * (len + n + 1);
+		}
+		for (i = 0; i < (size_t)n && !nl; ++i) {
+			if (esc) {
+				esc = 0;
+				if (buf[i] != '\n') line[len++] = buf[i];
+			} else if (!raw && buf[i] == '\\') {
+				esc = 1;
+			} else if (buf[i] == '\n') {
+				nl = 1;
+			} else {
+				line[len++] = buf[i];
+			}
+		}
+		if (nl && i < (size_t)n) lseek(STDIN_FILENO, (off_t)i - n, SEEK_CUR);
+	}
+	if (!line) line = arena_alloc(1);
+	line[len] = '\0';
+	char *p = line;
+	for (name = names; *name; ++name) {
+		while (BLANK(*p)) ++p;
+		char *end = p;
+		if (name[1]) {
+			while (*end && !BLANK(*end)) ++end;
+		} else {
+			end = line + len;
+			while (end > p && BLANK(end[-1])) --end;
+		}
+		char c = *end;
+		*end = '\0';
+		size_t n = strlen(*name);
+		var_put(*name, n, p, var_flags(*name, n) & ~VAR_NOVAL);
+		*end = c;
+		p = end;
+	}
+	return nl ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#undef BLANK
+#undef READSIZE
+
+int builtin_spawn(char **argv);
+int builtin_hash(char **argv);
+int builtin_jobs(char **argv);
+int builtin_fg(char **argv);
+int builtin_bg(char **argv);
+int builtin_wait(char **argv);
+int builtin_timeout(char **argv);
+int builtin_parallel(char **argv);
+int builtin_pipesize(char **argv);
+int builtin_history(char **argv);
+
+int builtin_help(char **argv);
+
+/*
+ * Table of builtins: adding a builtin is adding a row here.
+ * Flags:
+ * - BI_PARENT: changes the state of the shell, so always runs in the shell.
+ * - BI_PIPE: writes little output, so may run in the shell even when piped
+ *   into another part.
+ * - BI_OUT: writes only through out_* and changes nothing in the shell, so
+ *   may run in the shell for a command substitution (see subst_run).
+ * - BI_PREFIX: sets up the piped part, which runs the rest of its words as
+ *   a program (see exec_toks). Its function returns where they start in
+ *   argv, or 0 after an error (status 125, as with timeout(1) or env(1)).
+ * Other builtins piped into another part run in a forked child (see
+ * spawn_builtin), so that they cannot block on a pipe whose reader has not
+ * started yet.
+ */
+enum {
+	BI_PARENT = 1,
+	BI_PIPE = 2,
+	BI_OUT = 4,
+	BI_PREFIX = 8
+};
+
+struct builtin {
+	char *name;
+	int (*fn)(char **argv);
+	int flags;
+	char *help;
+};
+
+struct builtin builtins[] = {
+	{ "cd", builtin_cd, BI_PARENT | BI_PIPE,
+		"cd [dir]: change the current directory (default $HOME)" },
+	{ "pwd", builtin_pwd, BI_PIPE | BI_OUT,
+		"pwd: print the current directory" },
+	{ "mkdir", builtin_mkdir, BI_PIPE | BI_OUT,
+		"mkdir dir: create a directory" },
+	{ "rmdir", builtin_rmdir, BI_PIPE | BI_OUT,
+		"rmdir dir: remove an empty directory" },
+	{ "exit", builtin_exit, BI_PARENT | BI_PIPE,
+		"exit [n]: exit with status n (default that of the last command)" },
+	{ "spawn", builtin_spawn, BI_PARENT | BI_PIPE,
+		"spawn [posix_spawn | vfork | clone | fork]: show or set the spawn backend" },
+	{ "hash", builtin_hash, BI_PARENT,
+		"hash [-r | name...]: show, forget or remember command paths" },
+	{ "jobs", builtin_jobs, BI_PARENT,
+		"jobs: list jobs" },
+	{ "fg", builtin_fg, BI_PARENT | BI_PIPE,
+		"fg [job]: continue a job in the foreground" },
+	{ "bg", builtin_bg, BI_PARENT | BI_PIPE,
+		"bg [job]: continue a stopped job in the background" },
+	{ "wait", builtin_wait, BI_PARENT | BI_PIPE,
+		"wait [job...]: wait for jobs to finish" },
+	{ "timeout", builtin_timeout, BI_PREFIX,
+		"timeout [-s signal] [-k grace] duration command [arg...]: run command with a time limit" },
+	{ "parallel", builtin_parallel, 0,
+		"parallel [-j workers] [-k] [-x] command [arg...] [::: input...]: run command once per input" },
+	{ "pipesize", builtin_pipesize, BI_PARENT | BI_PIPE,
+		"pipesize [default | auto | bytes[k|m]]: show or set the capacity of pipes" },
+	{ "true", builtin_true, BI_PIPE | BI_OUT,
+		"true: do nothing, successfully" },
+	{ "false", builtin_false, BI_PIPE | BI_OUT,
+		"false: do nothing, unsuccessfully" },
+	{ "echo", builtin_echo, BI_OUT,
+		"echo [-neE] [arg...]: write arguments" },
+	{ "printf", builtin_printf, BI_OUT,
+		"printf format [arg...]: write formatted arguments" },
+	{ "test", builtin_test, BI_PIPE | BI_OUT,
+		"test expression: evaluate a condition" },
+	{ "[", builtin_test, BI_PIPE | BI_OUT,
+		"[ expression ]: evaluate a condition" },
+	{ "basename", builtin_basename, BI_PIPE | BI_OUT,
+		"basename string [suffix]: strip directory and suffix from string" },
+	{ "dirname", builtin_dirname, BI_PIPE | BI_OUT,
+		"dirname string...: strip last component from strings" },
+	{ "export", builtin_export, 0,
+		"export [name[=value]...]: export variables to programs, or list them" },
+	{ "unset", builtin_unset, BI_PIPE,
+		"unset name...: remove variables" },
+	{ "let", builtin_let, BI_PARENT | BI_PIPE,
+		"let expression...: evaluate arithmetic expressions" },
+	{ "read", builtin_read, BI_PARENT | BI_PIPE,
+		"read [-r] [name...]: read a line into variables (default REPLY)" },
+	{ ":", builtin_true, BI_PIPE | BI_OUT,
+		": do nothing, successfully" },
+	{ "history", builtin_history, 0,
+		"history [n | -p prefix | -s string | -r]: list, search or reindex the history" },
+	{ "help", builtin_help, BI_PIPE | BI_OUT,
+		"help [name...]: describe builtins (jobs are %n, %+ or a pid)" },
+	{ NULL }
+};
+
+/*
+ * Perfect hash of the builtin names.
+ * builtin_init picks a seed for which every name hashes to its own slot of
+ * btab, so that find_builtin takes one hash and one strcmp whatever the
+ * number of builtins.
+ */
+#define BTAB_BITS 7
+#define MAX_SEED (1 << 20)
+struct builtin *btab[1 << BTAB_BITS];
+size_t btab_seed;
+
+/*
+ * Slot of a name under seed.
+ */
+size_t btab_hash(const char *s, size_t seed) {
+	return fnv1a(s, strlen(s), seed) & ((1 << BTAB_BITS) - 1);
+}
+
+void builtin_init() {
+	for (btab_seed = 0; btab_seed < MAX_SEED; ++btab_seed) {
+		struct builtin *b;
+		memset(btab, 0, sizeof(btab));
+		for (b = builtins; b->name; ++b) {
+			struct builtin **slot = &btab[btab_hash(b->name, btab_seed)];
+			if (*slot) break;
+			*slot = b;
+		}
+		if (!b->name) return;
+	}
+	self_err("no perfect hash for the builtins");
+}
+#undef MAX_SEED
+
+/*
+ * If cmd is a builtin, return its row in the table.
+ * Else return NULL.
+ */
+struct builtin *find_builtin(const char *cmd) {
+	struct builtin *b = btab[btab_hash(cmd, btab_seed)];
+	return b && strcmp(b->name, cmd) == 0 ? b : NULL;
+}
+
+/*
+ * Call builtin b, and flush its output.
+ */
+int builtin_run(struct builtin *b, char **argv) {
+	out_err = 0;
+	int status = (*b->fn)(argv);
+	out_flush();
+	fflush(stdout);
+	return out_err && !status ? EXIT_FAILURE : status;
+}
+#undef BTAB_BITS
+
+/*
+ * help: list the builtins.
+ * help name...: describe the given builtins.
+ */
+int builtin_help(char **argv) {
+	struct builtin *b;
+	int status = EXIT_SUCCESS;
+	if (!argv[1]) {
+		for (b = builtins; b->name; ++b) {
+			out_str(b->help);
+			out_putc('\n');
+		}
+		return status;
+	}
+	for (++argv; *argv; ++argv) {
+		if ((b = find_builtin(*argv))) {
+			out_str(b->help);
+			out_putc('\n');
+		} else {
+			fprintf(stderr, PREF": help: no builtin %s\n", *argv);
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
+
+/*
+ * Print the promt.
+ */
+#define PROMPT "\033[32mshell>\033[0m "
+#define PROMPT2 "> " // for the lines of a here-document
+void print_prompt() {
+	sys_err(printf("%s", PROMPT));
+}
+
+/*
+ * Read a single line command.
+ * The line is valid until the next call.
+ * Return NULL at end of input.
+ */
+char *read_cmd() {
+	static char *line = NULL; // reused from line to line
+	static size_t linecap = 0;
+	errno = 0;
+	ssize_t len = getline(&line, &linecap, stdin);
+	if (len < 0) {
+		if (errno) sys_err(-1);
+		return NULL;
+	}
+	if (len > 0 && line[len-1] == '\n') line[len-1] = '\0'; // remove '\n' from the end
+	return line;
+}
+
+/*
+ * Persistent history.
+ * Command lines are appended to a history file ($HISTFILE, default
+ * ~/.shell_history) shared by all shells, with an index file beside it
+ * (same name with ".idx").
+ * - history file: a header, then records of a 4 byte length, the line and
+ *   a '\n' (so the file can still be read with grep).
+ * - index file: one fixed-size entry per record, with the offset of the
+ *   record and the first bytes of the line (the key), so that prefix search
+ *   does not touch the records it rules out.
+ * Both files are only appended to, with O_APPEND and one write per record,
+ * so that concurrent shells do not mix their records.
+ * Both are mapped read-only and nothing is parsed on startup, so that
+ * opening a history of millions of entries takes constant time; the maps
+ * are extended when the files grow.
+ * Entries are numbered by their position in the index, from 0.
+ */
+#define HIST_ENV "HISTFILE"
+#define HIST_NAME ".shell_history"
+#define IDX_SUFFIX ".idx"
+#define HIST_MAGIC "#shhist\n"
+#define HIST_KEYLEN 8
+
+struct hist_ent {
+	uint64_t off; // of the record in the history file
+	char key[HIST_KEYLEN]; // first bytes of the line, '\0'-padded
+};
+
+int hist_fd = -1; // -1 if there is no history
+int idx_fd = -1;
+char *hist_map;
+size_t hist_size; // mapped
+struct hist_ent *idx_map;
+size_t idx_cnt; // mapped entries
+char *hist_path;
+
+/*
+ * Map the part of fd which has been written so far.
+ * Return 0 on failure.
+ */
+int hist_map_fd(int fd, char **mapp, size_t *sizep, size_t unit) {
+	struct stat st;
+	if (fstat(fd, &st) < 0) return 0;
+	size_t size = st.st_size - st.st_size % unit; // whole entries only
+	if (size == *sizep) return 1;
+	if (*sizep) munmap(*mapp, *sizep);
+	*sizep = 0;
+	if (size) {
+		char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) return 0;
+		*mapp = map;
+		*sizep = size;
+	}
+	return 1;
+}
+
+/*
+ * Catch up with what has been appended (by any shell) since the last call.
+ */
+void hist_sync() {
+	if (hist_fd < 0) return;
+	size_t isize = idx_cnt * sizeof(struct hist_ent);
+	if (!hist_map_fd(hist_fd, &hist_map, &hist_size, 1)
+			|| !hist_map_fd(idx_fd, (char **)&idx_map, &isize, sizeof(struct hist_ent))) {
+		prog_warn(errno, hist_path);
+	}
+	idx_cnt = isize / sizeof(struct hist_ent);
+}
+
+/*
+ * Open the history file at path, and its index, creating them if needed.
+ * On failure, print a warning and go without history.
+ */
+void hist_open(char *path) {
+	size_t plen = strlen(path);
+	char *ipath = malloc(plen + sizeof(IDX_SUFFIX));
+	if (!ipath || !(hist_path = strdup(path))) sys_err(-1);
+	memcpy(ipath, path, plen);
+	strcpy(ipath + plen, IDX_SUFFIX);
+
+	// whoever creates the file writes the header
+	int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd >= 0) {
+		if (write(fd, HIST_MAGIC, strlen(HIST_MAGIC)) < 0) prog_warn(errno, path);
+	} else if (errno == EEXIST) {
+		fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		prog_warn(errno, path);
+		free(ipath);
+		return;
+	}
+	idx_fd = open(ipath, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (idx_fd < 0) {
+		prog_warn(errno, ipath);
+		close(fd);
+		free(ipath);
+		return;
+	}
+	free(ipath);
+	hist_fd = fd;
+	hist_sync();
+	if (hist_size >= strlen(HIST_MAGIC) && memcmp(hist_map, HIST_MAGIC, strlen(HIST_MAGIC)) != 0) {
+		fprintf(stderr, PREF": %s: not a history file\n", path);
+		close(hist_fd);
+		close(idx_fd);
+		hist_fd = idx_fd = -1;
+	}
+}
+
+/*
+ * Open the history file named by HISTFILE, or ~/.shell_history.
+ */
+void hist_init() {
+	char *path = var_get(HIST_ENV);
+	if (path && !*path) return; // HISTFILE= disables history
+	if (!path) {
+		char *home = var_get("HOME");
+		if (!home) return;
+		path = arena_alloc(strlen(home) + sizeof(HIST_NAME) + 1);
+		sprintf(path, "%s/"HIST_NAME, home);
+	}
+	hist_open(path);
+}
+
+/*
+ * Line of entry i (not '\0'-terminated), with its length in *lenp.
+ * Return NULL if the entry is not (yet) in the mapped history.
+ */
+const char *hist_get(size_t i, size_t *lenp) {
+	if (i >= idx_cnt) return NULL;
+	uint64_t off = idx_map[i].off;
+	uint32_t len;
+	if (off + sizeof(len) > hist_size) return NULL;
+	memcpy(&len, hist_map + off, sizeof(len));
+	if (off + sizeof(len) + len > hist_size) return NULL;
+	*lenp = len;
+	return hist_map + off + sizeof(len);
+}
+
+/*
+ * Append a line to the history, unless it repeats the last one added by
+ * this shell.
+ */
+void hist_add(const char *line) {
+	static char *last = NULL;
+	if (hist_fd < 0) return;
+	if (last && strcmp(last, line) == 0) return;
+	free(last);
+	if (!(last = strdup(line))) sys_err(-1);
+	size_t len = strlen(line);
+
+	// the record goes in one write, so it is never split by another shell
+	uint32_t len32 = len;
+	char *rec = arena_alloc(sizeof(len32) + len + 1);
+	memcpy(rec, &len32, sizeof(len32));
+	memcpy(rec + sizeof(len32), line, len);
+	rec[sizeof(len32) + len] = '\n';
+	ssize_t n = write(hist_fd, rec, sizeof(len32) + len + 1);
+	off_t end = lseek(hist_fd, 0, SEEK_CUR); // just past our record
+	if (n != (ssize_t)(sizeof(len32) + len + 1) || end < 0) {
+		prog_warn(n < 0 || end < 0 ? errno : EIO, hist_path);
+		return;
+	}
+	struct hist_ent e;
+	memset(&e, 0, sizeof(e));
+	e.off = end - n;
+	memcpy(e.key, line, len < HIST_KEYLEN ? len : HIST_KEYLEN);
+	if (write(idx_fd, &e, sizeof(e)) != sizeof(e)) prog_warn(errno, hist_path);
+}
+
+/*
+ * Newest entry before entry 'from' whose line starts with prefix.
+ * Return its number, or -1.
+ */
+long hist_find_prefix(const char *prefix, size_t plen, long from) {
+	hist_sync();
+	size_t klen = plen < HIST_KEYLEN ? plen : HIST_KEYLEN;
+	long i = from > (long)idx_cnt ? (long)idx_cnt : from;
+	while (--i >= 0) {
+		if (memcmp(idx_map[i].key, prefix, klen) != 0) continue;
+		if (plen <= HIST_KEYLEN) return i;
+		size_t len;
+		const char *line = hist_get(i, &len);
+		if (line && len >= plen && memcmp(line, prefix, plen) == 0) return i;
+	}
+	return -1;
+}
+
+/*
+ * Newest entry before entry 'from' whose line contains sub.
+ * Return its number, or -1.
+ */
+long hist_find_sub(const char *sub, size_t slen, long from) {
+	hist_sync();
+	long i = from > (long)idx_cnt ? (long)idx_cnt : from;
+	while (--i >= 0) {
+		size_t len;
+		const char *line = hist_get(i, &len);
+		if (line && memmem(line, len, sub, slen)) return i;
+	}
+	return -1;
+}
+
+void hist_print(long i) {
+	size_t len;
+	const char *line = hist_get(i, &len);
+	if (!line) return;
+	out_printf("%5ld  ", i + 1);
+	out_write(line, len);
+	out_putc('\n');
+}
+
+/*
+ * Rebuild the index from the records, e.g. after a crash between writing
+ * a record and its index entry.
+ * The new index replaces the old one by rename; entries appended meanwhile
+ * by other shells, to the old one, are lost from the index.
+ */
+int hist_rebuild() {
+	size_t plen = strlen(hist_path);
+	char *ipath = arena_alloc(plen + sizeof(IDX_SUFFIX));
+	char *tpath = arena_alloc(plen + sizeof(IDX_SUFFIX) + 4);
+	sprintf(ipath, "%s"IDX_SUFFIX, hist_path);
+	sprintf(tpath, "%s.tmp", ipath);
+	int fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		prog_warn(errno, tpath);
+		return EXIT_FAILURE;
+	}
+	FILE *f = fdopen(fd, "w");
+	if (!f) sys_err(-1);
+	hist_sync();
+	size_t off = strlen(HIST_MAGIC);
+	uint32_t len;
+	while (off + sizeof(len) <= hist_size) {
+		memcpy(&len, hist_map + off, sizeof(len));
+		size_t end = off + sizeof(len) + len;
+		if (end >= hist_size || hist_map[end] != '\n') break; // torn record
+		struct hist_ent e;
+		memset(&e, 0, sizeof(e));
+		e.off = off;
+		memcpy(e.key, hist_map + off + sizeof(len), len < HIST_KEYLEN ? len : HIST_KEYLEN);
+		fwrite(&e, sizeof(e), 1, f);
+		off = end + 1;
+	}
+	if (fclose(f) != 0 || rename(tpath, ipath) < 0) {
+		prog_warn(errno, ipath);
+		unlink(tpath);
+		return EXIT_FAILURE;
+	}
+	int nfd = open(ipath, O_RDWR | O_APPEND | O_CLOEXEC);
+	if (nfd < 0) {
+		prog_warn(errno, ipath);
+		return EXIT_FAILURE;
+	}
+	sys_err(dup3(nfd, idx_fd, O_CLOEXEC));
+	close(nfd);
+	if (idx_cnt) munmap(idx_map, idx_cnt * sizeof(struct hist_ent));
+	idx_cnt = 0;
+	hist_sync();
+	return EXIT_SUCCESS;
+}
+
+/*
+ * history [n]: list the last n entries (default all).
+ * history -p prefix: list the entries starting with prefix, newest first.
+ * history -s string: list the entries containing string, newest first.
+ * history -r: rebuild the index.
+ */
+int builtin_history(char **argv) {
+	if (hist_fd < 0) {
+		fprintf(stderr, PREF": history: no history file\n");
+		return EXIT_FAILURE;
+	}
+	hist_sync();
+	if (argv[1] && strcmp(argv[1], "-r") == 0) return hist_rebuild();
+	if (argv[1] && argv[2] && (strcmp(argv[1], "-p") == 0 || strcmp(argv[1], "-s") == 0)) {
+		size_t len = strlen(argv[2]);
+		long i = idx_cnt;
+		while (1) {
+			if (argv[1][1] == 'p') i = hist_find_prefix(argv[2], len, i);
+			else i = hist_find_sub(argv[2], len, i);
+			if (i < 0) break;
+			hist_print(i);
+		}
+		return EXIT_SUCCESS;
+	}
+	long n = idx_cnt;
+	if (argv[1]) {
+		char *end;
+		n = strtol(argv[1], &end, 10);
+		if (*end || n < 0 || argv[2]) {
+			fprintf(stderr, PREF": history: usage: history [n | -p prefix | -s string | -r]\n");
+			return EXIT_FAILURE;
+		}
+		if (n > (long)idx_cnt) n = idx_cnt;
+	}
+	long i;
+	for (i = idx_cnt - n; i < (long)idx_cnt; ++i) hist_print(i);
+	return EXIT_SUCCESS;
+}
+#undef HIST_ENV
+#undef HIST_NAME
+#undef IDX_SUFFIX
+#undef HIST_MAGIC
+
+/*
+ * Lexer.
+ * A command line is turned into a stream of tokens in a single pass:
+ * words, the operators | & ; ;; && || ( ) and redirections (< > >> <> <&
+ * >& << <<- <<<). A single digit right before a redirection is the
+ * descriptor it applies to, as in 2>&1. A '#' starting a word starts a
+ * comment, to the end of the line. ((expression)) where an operator may
+ * start is a single token, kept as typed (see vm_arith).
+ * Quoting is as in sh: '...' is literal, "..." is literal except that a
+ * backslash escapes one of \ " $ `, and outside quotes a backslash escapes
+ * any character. Quotes are removed from words in place, so a word is a
+ * pointer into the line itself.
+ * Parameters ($name, ${name}, ${name:-word}, $?, $$ and $!), arithmetic
+ * ($((expression)), see arith_eval) and command substitutions ($(command)
+ * and `command`, see subst_run) are expanded outside single quotes. A word with an expansion is moved to the arena, and
+ * unquoted values are split into words at blanks (except in assignments);
+ * an unquoted expansion to nothing leaves no word.
+ * The offsets of the unquoted *, ? and [ of a word are kept for pathname
+ * expansion (see glob_expand).
+ * When lex_defer is set (while parsing, see parse_unit), a word with an
+ * expansion is instead kept as typed, and marked dyn: it is expanded each
+ * time its command runs (see tmpl_expand), so that a loop sees new values.
+ * Runs of plain characters are skipped with a lookup in a character class
+ * table, so that the cost is linear in the length of the line.
+ */
+enum {
+	TOK_WORD,
+	TOK_PIPE, // |
+	TOK_IN, // <
+	TOK_OUT, // >
+	TOK_BG, // &
+	TOK_DOC, // <<
+	TOK_DOCTAB, // <<-
+	TOK_STR, // <<<
+	TOK_APPEND, // >>
+	TOK_RDWR, // <>
+	TOK_DUPIN, // <&
+	TOK_DUPOUT, // >&
+	TOK_SEMI, // ;
+	TOK_DSEMI, // ;;
+	TOK_AND, // &&
+	TOK_OR, // ||
+	TOK_LPAREN, // (
+	TOK_RPAREN, // )
+	TOK_NL, // end of a line followed by another (see parse_fill)
+	TOK_BLOCK, // compound command run as a piped part (see vm_block)
+	TOK_ARITH, // ((expression)), as typed
+	TOK_END
+};
+
+struct lex_tok {
+	char *str; // word, with quotes removed (as typed if dyn); next line of TOK_NL
+	unsigned int pos; // offset of the token in the line
+	unsigned char type;
+	unsigned char quoted; // word had quotes, backslashes or expansions, so is never a keyword
+	unsigned char assign; // word is name=value, with an unquoted name and '='
+	unsigned char dyn; // word has expansions, done when its command runs
+	unsigned int glob; // number of unquoted *, ? and [ in the word
+	unsigned int gidx; // index of their offsets in lex_globs
+	int fd; // here-document or here-string: its body, once read (see doc_read)
+	int io; // redirection: the descriptor it applies to, or -1 for the default
+	int pc; // TOK_BLOCK: start of the code of the compound command
+};
+
+/* Character classes: plain characters are 0, so end a run. */
+#define CC_BLANK 1 // separates words
+#define CC_OP 2 // operator, also separates words
+#define CC_QUOTE 4 // special outside double quotes
+#define CC_DQUOTE 8 // special inside double quotes
+#define CC_END 16
+#define CC_GLOB 32 // pattern character
+const unsigned char lex_class[256] = {
+	['\0'] = CC_END | CC_DQUOTE,
+	[' '] = CC_BLANK,
+	['\t'] = CC_BLANK,
+	['\n'] = CC_BLANK,
+	['|'] = CC_OP,
+	['<'] = CC_OP,
+	['>'] = CC_OP,
+	['&'] = CC_OP,
+	[';'] = CC_OP,
+	['('] = CC_OP,
+	[')'] = CC_OP,
+	['\''] = CC_QUOTE,
+	['"'] = CC_QUOTE | CC_DQUOTE,
+	['\\'] = CC_QUOTE | CC_DQUOTE,
+	['$'] = CC_QUOTE | CC_DQUOTE,
+	['`'] = CC_QUOTE | CC_DQUOTE,
+	['*'] = CC_GLOB,
+	['?'] = CC_GLOB,
+	['['] = CC_GLOB
+};
+
+/* Operator tokens, indexed by type. */
+char *tok_strs[] = {
+	"word",
+	"|",
+	"<",
+	">",
+	"&",
+	"<<",
+	"<<-",
+	"<<<",
+	">>",
+	"<>",
+	"<&",
+	">&",
+	";",
+	";;",
+	"&&",
+	"||",
+	"(",
+	")",
+	"newline",
+	"block",
+	"((",
+	"newline"
+};
+
+/*
+ * Dynamically resized array of tokens, allocated from the arena.
+ */
+#define LEX_INIT 64
+struct lex_tok *lex_toks;
+size_t lex_cap;
+size_t lex_cnt;
+unsigned int *lex_globs; // offsets of pattern characters in words
+size_t lex_gcap;
+size_t lex_gcnt;
+
+struct lex_tok *lex_add(int type, size_t pos) {
+	if (lex_cnt >= lex_cap) {
+		lex_toks = arena_grow(lex_toks, lex_cap * sizeof(struct lex_tok),
+				2 * lex_cap * sizeof(struct lex_tok));
+		lex_cap *= 2;
+	}
+	struct lex_tok *t = &lex_toks[lex_cnt++];
+	t->type = type;
+	t->quoted = 0;
+	t->assign = 0;
+	t->dyn = 0;
+	t->glob = 0;
+	t->gidx = lex_gcnt;
+	t->fd = -1;
+	t->io = -1;
+	t->str = NULL;
+	t->pos = pos;
+	return t;
+}
+
+/*
+ * Note a pattern character at offset off of the word t.
+ */
+void lex_glob(struct lex_tok *t, size_t off) {
+	if (lex_gcnt >= lex_gcap) {
+		size_t cap = lex_gcap ? 2 * lex_gcap : LEX_INIT;
+		lex_globs = arena_grow(lex_globs, lex_gcap * sizeof(unsigned int), cap * sizeof(unsigned int));
+		lex_gcap = cap;
+	}
+	lex_globs[lex_gcnt++] = off;
+	++t->glob;
+}
+
+/*
+ * Type of the operator starting with c, followed by next; its length is
+ * put in *lenp.
+ */
+int lex_op(char c, const char *next, int *lenp) {
+	*lenp = 1;
+	switch (c) {
+	case '(': return TOK_LPAREN;
+	case ')': return TOK_RPAREN;
+	case '|':
+	case '&':
+	case ';':
+		if (next[0] == c) {
+			*lenp = 2;
+			return c == '|' ? TOK_OR : c == '&' ? TOK_AND : TOK_DSEMI;
+		}
+		return c == '|' ? TOK_PIPE : c == '&' ? TOK_BG : TOK_SEMI;
+	case '>':
+		*lenp = 2;
+		if (next[0] == '>') return TOK_APPEND;
+		if (next[0] == '&') return TOK_DUPOUT;
+		*lenp = 1;
+		return TOK_OUT;
+	}
+	*lenp = 2;
+	if (next[0] == '>') return TOK_RDWR;
+	if (next[0] == '&') return TOK_DUPIN;
+	*lenp = 1;
+	if (next[0] != '<') return TOK_IN;
+	*lenp = 3;
+	if (next[1] == '<') return TOK_STR;
+	if (next[1] == '-') return TOK_DOCTAB;
+	*lenp = 2;
+	return TOK_DOC;
+}
+
+int lex_isredir(int type) {
+	return type != TOK_WORD && type != TOK_PIPE && type != TOK_BG && type < TOK_SEMI;
+}
+
+void lex_error(struct lex_tok *t) {
+	fprintf(stderr, PREF": syntax error near unexpected token '%s'\n",
+			t->type == TOK_WORD ? t->str : tok_strs[t->type]);
+}
+
+/*
+ * Check that the token added last may follow the one before it: a
+ * redirection needs a file name. The rest of the grammar is left to the
+ * parser (see parse_unit).
+ * On error, print a message and return 0.
+ */
+int lex_check() {
+	struct lex_tok *t = &lex_toks[lex_cnt - 1];
+	if (lex_cnt > 1 && lex_isredir(t[-1].type) && t->type != TOK_WORD) {
+		lex_error(t);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * End of the command of $(command) starting at p: the ')' matching the
+ * '(' before p, outside quotes, or NULL if there is none.
+ */
+char *lex_paren_end(char *p) {
+	int depth = 0;
+	for (; *p; ++p) {
+		if (*p == '\\' && p[1]) {
+			++p;
+		} else if (*p == '\'' || *p == '`') {
+			if (!(p = strchr(p + 1, *p))) return NULL;
+		} else if (*p == '"') {
+			while (*++p != '"') {
+				if (!*p) return NULL;
+				if (*p == '\\' && p[1]) ++p;
+			}
+		} else if (*p == '(') {
+			++depth;
+		} else if (*p == ')' && !depth--) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * End of the word of ${name:-word} starting at p: the first '}' which is
+ * not quoted or in a nested ${...}, or NULL if there is none.
+ */
+char *lex_brace_end(char *p) {
+	int depth = 0, dq = 0;
+	for (; *p; ++p) {
+		if (*p == '\\' && p[1]) {
+			++p;
+		} else if (*p == '\'' && !dq) {
+			if (!(p = strchr(p + 1, '\''))) return NULL;
+		} else if (*p == '"') {
+			dq = !dq;
+		} else if (*p == '`' || (*p == '$' && p[1] == '(')) {
+			if (!(p = *p == '`' ? strchr(p + 1, '`') : lex_paren_end(p + 2))) return NULL;
+		} else if (*p == '$' && p[1] == '{') {
+			++depth;
+			++p;
+		} else if (*p == '}' && !dq && !depth--) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * End of the command of `command` starting at p: the next '`' not escaped
+ * by a backslash, or NULL if there is none.
+ */
+char *lex_bquote_end(char *p) {
+	for (; *p != '`'; ++p) {
+		if (!*p) return NULL;
+		if (*p == '\\' && p[1]) ++p;
+	}
+	return p;
+}
+
+/*
+ * Whether the '$' or '`' at p starts an expansion.
+ */
+int lex_isexp(const char *p) {
+	if (*p == '`') return 1;
+	return p[1] && (strchr("({?$!", p[1]) || var_name_len(p + 1));
+}
+
+/*
+ * End of the word starting at p, in a line as typed: the first blank or
+ * operator outside quotes and substitutions.
+ * Return NULL, after printing an error, if a quote or substitution is not
+ * closed.
+ */
+char *lex_word_end(char *p) {
+	int dq = 0;
+	while (1) {
+		while (!lex_class[(unsigned char)*p] || lex_class[(unsigned char)*p] == CC_GLOB) ++p;
+		if (!*p) {
+			if (!dq) return p;
+			fprintf(stderr, PREF": syntax error: unterminated quote\n");
+			return NULL;
+		} else if (*p == '\\') {
+			p += p[1] ? 2 : 1;
+		} else if (*p == '"') {
+			dq = !dq;
+			++p;
+		} else if (dq && !(lex_class[(unsigned char)*p] & CC_DQUOTE)) {
+			++p;
+		} else if (*p == '\'') {
+			if (!(p = strchr(p + 1, '\''))) {
+				fprintf(stderr, PREF": syntax error: unterminated quote\n");
+				return NULL;
+			}
+			++p;
+		} else if (*p == '`' || (*p == '$' && p[1] == '(')) {
+			if (!(p = *p == '`' ? lex_bquote_end(p + 1) : lex_paren_end(p + 2))) {
+				fprintf(stderr, PREF": syntax error: unterminated command substitution\n");
+				return NULL;
+			}
+			++p;
+		} else if (*p == '$' && p[1] == '{') {
+			if (!(p = lex_brace_end(p + 2))) {
+				fprintf(stderr, PREF": syntax error: bad substitution\n");
+				return NULL;
+			}
+			++p;
+		} else if (*p == '$') {
+			++p;
+		} else {
+			return p; // blank or operator
+		}
+	}
+}
+
+char *lex_string(char *p, char *end, int doc);
+char *subst_run(char *command);
+
+/*
+ * Expand the parameter or command substitution at *pp (a '$' or '`'), and
+ * move *pp past it.
+ * Set *valp to its value, or to NULL if the '$' stands for itself.
+ * Return 0, after printing an error, if it is malformed.
+ */
+int lex_param(char **pp, char **valp) {
+	char *p = *pp + 1, *end;
+	*valp = NULL;
+	if (*p == '(' && p[1] == '(' && (end = arith_end(p + 2))) {
+		// $((expression))
+		long long n;
+		if (!arith_expand(p + 2, end, &n)) return 0;
+		*valp = arena_alloc(24);
+		sprintf(*valp, "%lld", n);
+		*pp = end + 2;
+		return 1;
+	}
+	if (**pp == '`' || *p == '(') {
+		char *end = **pp == '`' ? lex_bquote_end(p) : lex_paren_end(++p);
+		if (!end) {
+			fprintf(stderr, PREF": syntax error: unterminated command substitution\n");
+			return 0;
+		}
+		char *cmd = arena_alloc(end - p + 1), *q = cmd;
+		while (p < end) {
+			// between '`'s, a backslash escapes one of ` \ $
+			if (**pp == '`' && *p == '\\' && strchr("`\\$", p[1])) ++p;
+			*q++ = *p++;
+		}
+		*q = '\0';
+		*valp = subst_run(cmd);
+		*pp = end + 1;
+		return 1;
+	}
+	if (*p == '?' || *p == '$' || *p == '!') {
+		*valp = arena_alloc(24);
+		if (*p == '?') sprintf(*valp, "%d", last_status);
+		else if (*p == '$') sprintf(*valp, "%d", (int)getpid());
+		else if (bg_pid > 0) sprintf(*valp, "%d", (int)bg_pid);
+		else **valp = '\0';
+		*pp = p + 1;
+		return 1;
+	}
+	size_t len = var_name_len(p);
+	if (len) {
+		*valp = var_getn(p, len);
+		if (!*valp) *valp = "";
+		*pp = p + len;
+		return 1;
+	}
+	if (*p != '{') {
+		*pp = p;
+		return 1;
+	}
+	len = var_name_len(++p);
+	char *q = p + len;
+	char *val = len ? var_getn(p, len) : NULL;
+	if (len && *q == '}') {
+		*valp = val ? val : "";
+		*pp = q + 1;
+		return 1;
+	}
+	int colon = *q == ':';
+	if (len && q[colon] == '-' && (end = lex_brace_end(q + colon + 1))) {
+		if (!val || (colon && !*val)) val = lex_string(q + colon + 1, end, 0);
+		if (!val) return 0;
+		*valp = val;
+		*pp = end + 1;
+		return 1;
+	}
+	fprintf(stderr, PREF": syntax error: bad substitution\n");
+	return 0;
+}
+
+/*
+ * Expand the text from p to end (exclusive) into a string in the arena,
+ * which is never split: the word of ${name:-word}, unquoted, or if doc is
+ * set a line of a here-document, where quotes are not special and a
+ * backslash only escapes one of \ $ `.
+ * Return NULL, after printing an error, if it is malformed.
+ */
+char *lex_string(char *p, char *end, int doc) {
+	size_t cap = end - p + 1, len = 0;
+	char *s = arena_alloc(cap);
+	int dq = doc;
+	while (p < end) {
+		const char *v = p;
+		size_t n = 1;
+		if (*p == '\\' && p + 1 < end && (!dq || strchr(doc ? "\\$`" : "\\\"$`", p[1]))) {
+			v = ++p;
+			++p;
+		} else if (*p == '\'' && !dq) {
+			char *q = memchr(p + 1, '\'', end - p - 1);
+			v = p + 1;
+			n = q - v;
+			p = q + 1;
+		} else if (*p == '"' && !doc) {
+			dq = !dq;
+			++p;
+			continue;
+		} else if (*p == '$' || *p == '`') {
+			char *val;
+			if (!lex_param(&p, &val)) return NULL;
+			if (val) {
+				v = val;
+				n = strlen(val);
+			} else {
+				v = "$";
+			}
+		} else {
+			++p;
+		}
+		if (len + n + 1 > cap) {
+			s = arena_grow(s, cap, 2 * (len + n + 1));
+			cap = 2 * (len + n + 1);
+		}
+		memcpy(s + len, v, n);
+		len += n;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+void glob_reset();
+
+int lex_defer; // keep words with expansions as typed
+char *lex_src; // while lex_defer is set, a copy of the line as typed
+
+/*
+ * Start a new array of tokens.
+ */
+void lex_start() {
+	lex_cap = LEX_INIT;
+	lex_toks = arena_alloc(lex_cap * sizeof(struct lex_tok));
+	lex_cnt = 0;
+	lex_globs = NULL;
+	lex_gcap = lex_gcnt = 0;
+	glob_reset();
+}
+
+/*
+ * Keep the word t, whose expansion is deferred, as typed, and return the
+ * end of it in line. Return NULL, after printing an error, if it is
+ * malformed.
+ */
+char *lex_keep(struct lex_tok *t, char *line) {
+	char *src = lex_src + t->pos, *end = lex_word_end(src);
+	if (!end) return NULL;
+	t->str = arena_alloc(end - src + 1);
+	memcpy(t->str, src, end - src);
+	t->str[end - src] = '\0';
+	t->dyn = t->quoted = 1;
+	t->glob = 0;
+	lex_gcnt = t->gidx;
+	return line + (end - lex_src);
+}
+
+/*
+ * Split line into tokens, appended to the array, ending with a TOK_END
+ * token.
+ * The line is modified (words are unquoted and terminated in place).
+ * Return the array, or NULL, after printing an error, if the line is
+ * malformed.
+ */
+struct lex_tok *lex_more(char *line) {
+	char *p = line;
+	char *line_end = NULL; // found on the first expansion
+	// words with expansions are written to a buffer in the arena
+	char *buf_next = NULL;
+	char *buf_lim = NULL;
+	while (1) {
+		while (lex_class[(unsigned char)*p] & CC_BLANK) ++p;
+		if (!*p || *p == '#') {
+			lex_add(TOK_END, p - line);
+			return lex_check() ? lex_toks : NULL;
+		}
+		char *end;
+		if (*p == '(' && p[1] == '(' && (end = arith_end(p + 2))) {
+			// ((expression)), kept as typed (see vm_arith)
+			struct lex_tok *t = lex_add(TOK_ARITH, p - line);
+			t->str = arena_alloc(end - p - 1);
+			memcpy(t->str, p + 2, end - p - 2);
+			t->str[end - p - 2] = '\0';
+			p = end + 2;
+			if (!lex_check()) return NULL;
+			continue;
+		}
+		if (lex_class[(unsigned char)*p] & CC_OP) {
+			int len;
+			lex_add(lex_op(*p, p + 1, &len), p - line);
+			p += len;
+			if (!lex_check()) return NULL;
+			continue;
+		}
+
+		struct lex_tok *t = lex_add(TOK_WORD, p - line);
+		size_t pos = p - line;
+		char *out = t->str = p; // unquoted word is written behind p
+		int expanded = 0, first = 1, io = -1;
+		char c;
+		while (1) {
+			char *run = p;
+			while (!lex_class[(unsigned char)*p]) ++p;
+			if (first) {
+				char *eq = memchr(run, '=', p - run);
+				t->assign = eq && eq > run && var_name_len(run) == (size_t)(eq - run);
+				first = 0;
+			}
+			if (out != run) memmove(out, run, p - run);
+			out += p - run;
+
+			if (*p == '\\') {
+				t->quoted = 1;
+				if (p[1]) ++p; // a trailing backslash stands for itself
+				*out++ = *p++;
+			} else if (*p == '\'') {
+				t->quoted = 1;
+				char *q = strchr(p + 1, '\'');
+				if (!q) {
+					fprintf(stderr, PREF": syntax error: unterminated quote\n");
+					return NULL;
+				}
+				memmove(out, p + 1, q - p - 1);
+				out += q - p - 1;
+				p = q + 1;
+			} else if (*p == '"' || *p == '$' || *p == '`') {
+				int dq = *p == '"';
+				if (dq) {
+					t->quoted = 1;
+					++p;
+				}
+				while (1) {
+					if (dq) {
+						run = p;
+						while (!(lex_class[(unsigned char)*p] & CC_DQUOTE)) ++p;
+						if (out != run) memmove(out, run, p - run);
+						out += p - run;
+						if (!*p) {
+							fprintf(stderr, PREF": syntax error: unterminated quote\n");
+							return NULL;
+						}
+						if (*p == '"') {
+							++p;
+							break;
+						}
+						if (*p == '\\') {
+							if (p[1] && strchr("\\\"$`", p[1])) ++p;
+							*out++ = *p++;
+							continue;
+						}
+					}
+					if (lex_defer && lex_isexp(p)) {
+						if (!(p = lex_keep(t, line))) return NULL;
+						c = *p;
+						goto kept;
+					}
+					char *val;
+					if (!lex_param(&p, &val)) return NULL;
+					if (!val) {
+						*out++ = '$';
+						if (dq) continue;
+						break;
+					}
+					// the word moves to the buffer, with room for the value and
+					// the rest of the line
+					size_t vlen = strlen(val);
+					if (!line_end) line_end = p + strlen(p);
+					size_t used = out - t->str, need = vlen + (line_end - p) + 1;
+					if (!expanded || (size_t)(buf_lim - out) < need) {
+						char *dst = expanded ? t->str : buf_next;
+						if (!dst || (size_t)(buf_lim - dst) < used + need) {
+							dst = arena_alloc(2 * (used + need));
+							buf_lim = dst + 2 * (used + need);
+						}
+						memmove(dst, t->str, used);
+						t->str = dst;
+						out = dst + used;
+					}
+					expanded = 1;
+					if (dq || t->assign) {
+						memcpy(out, val, vlen);
+						out += vlen;
+					} else {
+						for (; *val; ++val) {
+							if (*val != ' ' && *val != '\t' && *val != '\n') {
+								if (lex_class[(unsigned char)*val] & CC_GLOB) lex_glob(t, out - t->str);
+								*out++ = *val;
+							} else if (out > t->str || t->quoted) {
+								// the value continues in a new word
+								*out++ = '\0';
+								t->quoted = 1;
+								if (lex_cnt > 1 && lex_isredir(t[-1].type)) {
+									fprintf(stderr, PREF": ambiguous redirect\n");
+									return NULL;
+								}
+								t = lex_add(TOK_WORD, pos);
+								t->str = out;
+							}
+						}
+					}
+					if (!dq) break;
+				}
+			} else if (lex_class[(unsigned char)*p] & CC_GLOB) {
+				lex_glob(t, out - t->str);
+				*out++ = *p++;
+			} else {
+				break; // blank, operator or end of line
+			}
+		}
+		// terminating the word may overwrite the character at p
+		c = *p;
+		*out = '\0';
+		if (expanded) {
+			buf_next = out + 1;
+			if (out == t->str && !t->quoted) {
+				// nothing was left of the word
+				--lex_cnt;
+				if (lex_cnt && lex_isredir(t[-1].type)) {
+					fprintf(stderr, PREF": ambiguous redirect\n");
+					return NULL;
+				}
+			} else {
+				t->quoted = 1;
+			}
+		}
+	kept:
+		if ((c == '<' || c == '>') && !t->quoted && !t->glob && isdigit((unsigned char)t->str[0]) && !t->str[1]) {
+			// the descriptor of the redirection which follows
+			io = t->str[0] - '0';
+			--lex_cnt;
+		}
+		if (lex_cnt && !lex_check()) return NULL;
+		if (lex_class[(unsigned char)c] & CC_OP) {
+			int len;
+			lex_add(lex_op(c, p + 1, &len), p - line)->io = io;
+			if (!lex_check()) return NULL;
+			p += len;
+		} else if (c) {
+			++p;
+		} else {
+			lex_add(TOK_END, p - line);
+			return lex_check() ? lex_toks : NULL;
+		}
+	}
+}
+
+/*
+ * Split line into a new array of tokens (see lex_more).
+ */
+struct lex_tok *lex(char *line) {
+	lex_start();
+	return lex_more(line);
+}
+#undef LEX_INIT
+#undef CC_BLANK
+#undef CC_OP
+#undef CC_QUOTE
+#undef CC_DQUOTE
+#undef CC_END
+#undef CC_GLOB
+
+/*
+ * Call fn(dfd, name, type) for each entry of the directory open at dfd,
+ * but "." and "..".
+ * Entries are read with getdents64 in large batches, so that a directory
+ * of hundreds of thousands of files takes a few dozen system calls.
+ */
+#define BUFSIZE (256 * 1024)
+void dir_scan(int dfd, void (*fn)(int dfd, const char *name, int type)) {
+	static char buf[BUFSIZE] __attribute__((aligned(8)));
+	ssize_t n;
+	while ((n = getdents64(dfd, buf, BUFSIZE)) > 0) {
+		ssize_t off;
+		for (off = 0; off < n; ) {
+			struct dirent64 *d = (struct dirent64 *)(buf + off);
+			off += d->d_reclen;
+			if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2])))
+				continue;
+			fn(dfd, d->d_name, d->d_type);
+		}
+	}
+}
+#undef BUFSIZE
+
+/*
+ * Pathname expansion.
+ * A word with unquoted *, ? or [...] (see lex) is replaced by the paths it
+ * matches, sorted, or left as it is if there are none. A name starting
+ * with '.' is only matched by a pattern starting with a literal '.'.
+ * Each component of a pattern is compiled once into segments (the parts
+ * between '*'s) of characters and character sets, which are then matched
+ * against every name of the directory without backtracking: the first and
+ * last segments are anchored, and the others are taken at their first
+ * occurrence. Directories are listed at most once per line (the listings
+ * live in the arena), and matches are sorted with a radix sort.
+ */
+struct glob_atom {
+	int c; // character, or -1 for a set
+	uint64_t set[4]; // characters matched by a set
+};
+
+struct glob_seg {
+	struct glob_atom *atoms;
+	size_t len;
+	char *lit; // the characters, if the segment has no set
+};
+
+struct glob_pat {
+	struct glob_seg *segs; // segment i comes after i '*'s
+	size_t nsegs;
+	int dot; // starts with a literal '.'
+};
+
+/*
+ * Listing of a directory.
+ */
+struct glob_dir {
+	char *path; // as given to glob_list ("" for the current directory)
+	char **names;
+	unsigned char *types; // d_type of each name
+	size_t n;
+	size_t cap;
+};
+
+/* Listings made during the current line: open addressing on the path. */
+#define GLOB_DIRS 16
+struct glob_dir **glob_dirs;
+size_t glob_dcap;
+size_t glob_dcnt;
+struct glob_dir *glob_filling;
+
+/*
+ * Forget the listings (at the start of a line, as they were in the arena).
+ */
+void glob_reset() {
+	glob_dirs = NULL;
+	glob_dcap = glob_dcnt = 0;
+}
+
+/*
+ * Character classes in sets, as in [[:alpha:]].
+ */
+struct glob_class {
+	const char *name;
+	int (*fn)(int c);
+};
+
+struct glob_class glob_classes[] = {
+	{ "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+	{ "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+	{ "lower", islower }, { "print", isprint }, { "punct", ispunct },
+	{ "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+	{ NULL, NULL }
+};
+
+/*
+ * If a class [:name:] starts at s[i], add its characters to set (none for
+ * an unknown name) and return the index of its last ']'. Else return 0.
+ */
+size_t glob_class(const char *s, size_t end, size_t i, uint64_t *set) {
+	size_t j;
+	for (j = i + 2; j < end && isalpha((unsigned char)s[j]); ++j) ;
+	if (j + 1 >= end || s[j] != ':' || s[j + 1] != ']') return 0;
+	size_t len = j - i - 2;
+	struct glob_class *k;
+	for (k = glob_classes; k->name; ++k) {
+		if (strlen(k->name) == len && memcmp(k->name, s + i + 2, len) == 0) break;
+	}
+	unsigned c;
+	for (c = 1; k->fn && c < 256; ++c) {
+		if ((*k->fn)(c)) set[c >> 6] |= (uint64_t)1 << (c & 63);
+	}
+	return j + 1;
+}
+
+/*
+ * Parse the set of the '[' at s[i], and move i to its ']'.
+ * Return 0 if it has no ']' (so the '[' is literal).
+ */
+int glob_set(const char *s, size_t end, size_t *ip, uint64_t *set) {
+	size_t i = *ip + 1;
+	int neg = i < end && (s[i] == '!' || s[i] == '^');
+	if (neg) ++i;
+	memset(set, 0, 4 * sizeof(uint64_t));
+	size_t first = i;
+	for (; i < end && (s[i] != ']' || i == first); ++i) {
+		size_t k;
+		if (s[i] == '[' && i + 1 < end && s[i + 1] == ':' && (k = glob_class(s, end, i, set))) {
+			i = k;
+			continue;
+		}
+		unsigned char lo = s[i], hi = lo;
+		if (i + 2 < end && s[i + 1] == '-' && s[i + 2] != ']') {
+			hi = s[i + 2];
+			i += 2;
+		}
+		unsigned c;
+		for (c = lo; c <= hi; ++c) set[c >> 6] |= (uint64_t)1 << (c & 63);
+	}
+	if (i >= end) return 0;
+	if (neg) {
+		int k;
+		for (k = 0; k < 4; ++k) set[k] = ~set[k];
+	}
+	set[0] &= ~(uint64_t)1; // never '\0'
+	*ip = i;
+	return 1;
+}
+
+/*
+ * Compile the component s[0..end) of a pattern, where act[i] is set for an
+ * unquoted *, ? or [. Return 0 if it has nothing to match (it is literal).
+ */
+int glob_compile(const char *s, const char *act, size_t end, struct glob_pat *pat) {
+	struct glob_atom *atoms = arena_alloc((end + 1) * sizeof(struct glob_atom));
+	struct glob_seg *segs = arena_alloc((end + 1) * sizeof(struct glob_seg));
+	size_t i, na = 0, ns = 0;
+	int magic = 0, plain = 1;
+	segs[0].atoms = atoms;
+	for (i = 0; i < end; ++i) {
+		struct glob_atom *a = &atoms[na];
+		if (act[i] && s[i] == '*') {
+			magic = 1;
+			segs[ns].len = &atoms[na] - segs[ns].atoms;
+			segs[ns].lit = plain ? (char *)s : NULL; // fixed below
+			++ns;
+			segs[ns].atoms = &atoms[na];
+			plain = 1;
+			continue;
+		}
+		if (act[i] && s[i] == '?') {
+			memset(a->set, 0xff, sizeof(a->set));
+			a->set[0] &= ~(uint64_t)1;
+			a->c = -1;
+			magic = 1;
+			plain = 0;
+		} else if (act[i] && s[i] == '[' && glob_set(s, end, &i, a->set)) {
+			a->c = -1;
+			magic = 1;
+			plain = 0;
+		} else {
+			a->c = (unsigned char)s[i];
+		}
+		++na;
+	}
+	segs[ns].len = &atoms[na] - segs[ns].atoms;
+	segs[ns].lit = plain ? (char *)s : NULL;
+	++ns;
+	if (!magic) return 0;
+	// literal segments as strings, for memcmp and memmem
+	for (i = 0; i < ns; ++i) {
+		if (!segs[i].lit) continue;
+		char *lit = arena_alloc(segs[i].len + 1);
+		size_t k;
+		for (k = 0; k < segs[i].len; ++k) lit[k] = segs[i].atoms[k].c;
+		segs[i].lit = lit;
+	}
+	pat->segs = segs;
+	pat->nsegs = ns;
+	pat->dot = end && s[0] == '.';
+	return 1;
+}
+
+/*
+ * Whether segment g matches at s.
+ */
+int glob_seg_at(const struct glob_seg *g, const char *s) {
+	if (g->lit) return memcmp(s, g->lit, g->len) == 0;
+	size_t i;
+	for (i = 0; i < g->len; ++i) {
+		unsigned char c = s[i];
+		const struct glob_atom *a = &g->atoms[i];
+		if (a->c >= 0 ? a->c != c : !((a->set[c >> 6] >> (c & 63)) & 1)) return 0;
+	}
+	return 1;
+}
+
+int glob_match(const struct glob_pat *pat, const char *name, size_t len) {
+	if (name[0] == '.' && !pat->dot) return 0;
+	const struct glob_seg *g = pat->segs;
+	if (pat->nsegs == 1) return len == g->len && glob_seg_at(g, name);
+	const struct glob_seg *last = &g[pat->nsegs - 1];
+	if (len < g->len + last->len) return 0;
+	if (!glob_seg_at(g, name) || !glob_seg_at(last, name + len - last->len)) return 0;
+	const char *s = name + g->len, *end = name + len - last->len;
+	for (++g; g < last; ++g) {
+		// the first occurrence leaves the most room for the rest
+		if (g->lit) {
+			const char *f = memmem(s, end - s, g->lit, g->len);
+			if (!f) return 0;
+			s = f + g->len;
+		} else {
+			while (s + g->len <= end && !glob_seg_at(g, s)) ++s;
+			if (s + g->len > end) return 0;
+			s += g->len;
+		}
+	}
+	return 1;
+}
+
+void glob_add_name(int dfd, const char *name, int type) {
+	struct glob_dir *d = glob_filling;
+	(void)dfd;
+	if (d->n == d->cap) {
+		size_t cap = d->cap ? 2 * d->cap : 64;
+		d->names = arena_grow(d->names, d->cap * sizeof(char *), cap * sizeof(char *));
+		d->types = arena_grow(d->types, d->cap, cap);
+		d->cap = cap;
+	}
+	d->names[d->n] = arena_strdup(name);
+	d->types[d->n++] = type;
+}
+
+/*
+ * Listing of the directory path (with a trailing '/', or "" for the
+ * current one), made once per line. Empty if it cannot be read.
+ */
+struct glob_dir *glob_list(const char *path) {
+	if (2 * (glob_dcnt + 1) > glob_dcap) {
+		struct glob_dir **old = glob_dirs;
+		size_t i, old_cap = glob_dcap;
+		glob_dcap = glob_dcap ? 2 * glob_dcap : GLOB_DIRS;
+		glob_dirs = arena_alloc(glob_dcap * sizeof(struct glob_dir *));
+		memset(glob_dirs, 0, glob_dcap * sizeof(struct glob_dir *));
+		for (i = 0; i < old_cap; ++i) {
+			if (!old[i]) continue;
+			size_t j = fnv1a(old[i]->path, strlen(old[i]->path), 0) & (glob_dcap - 1);
+			while (glob_dirs[j]) j = (j + 1) & (glob_dcap - 1);
+			glob_dirs[j] = old[i];
+		}
+	}
+	size_t j = fnv1a(path, strlen(path), 0) & (glob_dcap - 1);
+	for (; glob_dirs[j]; j = (j + 1) & (glob_dcap - 1)) {
+		if (strcmp(glob_dirs[j]->path, path) == 0) return glob_dirs[j];
+	}
+	struct glob_dir *d = glob_dirs[j] = arena_alloc(sizeof(struct glob_dir));
+	++glob_dcnt;
+	d->path = arena_strdup(path);
+	d->names = NULL;
+	d->types = NULL;
+	d->n = d->cap = 0;
+	int dfd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd >= 0) {
+		glob_filling = d;
+		dir_scan(dfd, glob_add_name);
+		close(dfd);
+	}
+	return d;
+}
+#undef GLOB_DIRS
+
+/*
+ * Sort v[0..n) bytewise, all sharing their first depth bytes: MSD radix
+ * sort on the byte at depth, with insertion sort for small ranges.
+ * tmp has room for n pointers.
+ */
+#define SMALL 32
+void glob_sort(char **v, char **tmp, size_t n, size_t depth) {
+	while (n > 1) {
+		if (n < SMALL) {
+			size_t i, j;
+			for (i = 1; i < n; ++i) {
+				char *s = v[i];
+				for (j = i; j > 0 && strcmp(v[j - 1] + depth, s + depth) > 0; --j) v[j] = v[j - 1];
+				v[j] = s;
+			}
+			return;
+		}
+		size_t count[256] = { 0 }, start[256], i;
+		for (i = 0; i < n; ++i) ++count[(unsigned char)v[i][depth]];
+		size_t sum = 0;
+		for (i = 0; i < 256; ++i) {
+			start[i] = sum;
+			sum += count[i];
+		}
+		for (i = 0; i < n; ++i) tmp[start[(unsigned char)v[i][depth]]++] = v[i];
+		memcpy(v, tmp, n * sizeof(char *));
+		// strings ending here (byte 0) are in place; recurse on the others
+		size_t off = count[0];
+		for (i = 1; i < 256; ++i) {
+			if (count[i] > 1) glob_sort(v + off, tmp, count[i], depth + 1);
+			off += count[i];
+		}
+		return;
+	}
+}
+#undef SMALL
+
+/*
+ * Paths matched by word, where act[i] is set for an unquoted *, ? or [,
+ * in a NULL-terminated vector in the arena; their number is put in *np.
+ * Return NULL if the word has nothing to match.
+ */
+char **glob_expand(const char *word, const char *act, size_t *np) {
+	// paths matched so far, each ending in '/' (or "")
+	size_t n = 1, cap = 1;
+	char **paths = arena_alloc(sizeof(char *));
+	const char *s = word;
+	int magic = 0, tail = 0; // tail: literal components after the last pattern
+	paths[0] = "";
+	if (*s == '/') {
+		while (*s == '/') ++s;
+		paths[0] = arena_alloc(s - word + 1);
+		memcpy(paths[0], word, s - word);
+		paths[0][s - word] = '\0';
+	}
+	while (*s) {
+		const char *e = strchrnul(s, '/');
+		const char *next = e;
+		while (*next == '/') ++next;
+		int last = !*next;
+		struct glob_pat pat;
+		size_t i, k, m = 0, mcap = 0;
+		char **out = NULL;
+		if (!glob_compile(s, act + (s - word), e - s, &pat)) {
+			// literal component: append it to every path
+			for (i = 0; i < n; ++i) {
+				size_t plen = strlen(paths[i]);
+				char *p = arena_alloc(plen + (next - s) + 1);
+				memcpy(p, paths[i], plen);
+				memcpy(p + plen, s, next - s);
+				p[plen + (next - s)] = '\0';
+				paths[i] = p;
+			}
+			tail = magic;
+			s = next;
+			continue;
+		}
+		magic = 1;
+		tail = 0;
+		for (i = 0; i < n; ++i) {
+			struct glob_dir *d = glob_list(paths[i]);
+			size_t plen = strlen(paths[i]);
+			for (k = 0; k < d->n; ++k) {
+				char *name = d->names[k];
+				size_t len = strlen(name);
+				if (!glob_match(&pat, name, len)) continue;
+				char *p = arena_alloc(plen + len + (next - e) + 1);
+				memcpy(p, paths[i], plen);
+				memcpy(p + plen, name, len);
+				memcpy(p + plen + len, e, next - e);
+				p[plen + len + (next - e)] = '\0';
+				if (*e == '/') {
+					// only directories (or links to them) lead further
+					struct stat st;
+					int type = d->types[k];
+					if (type != DT_DIR && (type != DT_UNKNOWN && type != DT_LNK)) continue;
+					if (type != DT_DIR && (stat(p, &st) || !S_ISDIR(st.st_mode))) continue;
+				}
+				if (m == mcap) {
+					size_t c = mcap ? 2 * mcap : 16;
+					out = arena_grow(out, mcap * sizeof(char *), c * sizeof(char *));
+					mcap = c;
+				}
+				out[m++] = p;
+			}
+		}
+		paths = out;
+		n = m;
+		cap = mcap;
+		if (!n || last) break;
+		s = next;
+	}
+	if (!magic || !n) return NULL;
+	if (tail) {
+		// the pattern ended with literal components: keep existing paths
+		size_t i, m = 0;
+		struct stat st;
+		for (i = 0; i < n; ++i) {
+			if (lstat(paths[i], &st) == 0) paths[m++] = paths[i];
+		}
+		if (!(n = m)) return NULL;
+	}
+	if (n + 1 > cap) paths = arena_grow(paths, cap * sizeof(char *), (n + 1) * sizeof(char *));
+	glob_sort(paths, arena_alloc(n * sizeof(char *)), n, 0);
+	paths[n] = NULL;
+	*np = n;
+	return paths;
+}
+
+/*
+ * Here-documents and here-strings.
+ * The body of a here-document is the lines after the command, up to one
+ * equal to its delimiter. Unless the delimiter was quoted, parameters in it
+ * are expanded; with <<- leading tabs are removed. A here-string is its
+ * word and a newline.
+ * The body goes to a pipe if it fits in the pipe's buffer, and otherwise
+ * to a memfd_create file, so it never touches the filesystem. It is
+ * streamed a line at a time through a buffer of the size of a pipe, so a
+ * long body is never held whole in memory.
+ */
+
+/*
+ * Source of the lines after the command being run, set by whoever runs it.
+ * Return the next line (without '\n', not '\0'-terminated, valid until the
+ * next call) with its length in *lenp, or NULL at the end of the input.
+ */
+const char *(*doc_line)(size_t *lenp);
+
+#define DOCSIZE (64 * 1024) // default capacity of a pipe
+char doc_buf[DOCSIZE];
+size_t doc_len;
+int doc_memfd = -1; // file the body goes to, once too long for a pipe
+
+void doc_raw(int fd, const char *s, size_t n) {
+	while (n) {
+		ssize_t w = write(fd, s, n);
+		if (w < 0 && errno == EINTR) continue;
+		sys_err(w);
+		s += w;
+		n -= w;
+	}
+}
+
+void doc_write(const char *s, size_t n) {
+	if (doc_len + n > DOCSIZE) {
+		if (doc_memfd < 0) sys_err(doc_memfd = memfd_create("here-document", MFD_CLOEXEC));
+		doc_raw(doc_memfd, doc_buf, doc_len);
+		doc_len = 0;
+		if (n >= DOCSIZE) {
+			doc_raw(doc_memfd, s, n);
+			return;
+		}
+	}
+	memcpy(doc_buf + doc_len, s, n);
+	doc_len += n;
+}
+
+/*
+ * Descriptor to read the body written since the last call from.
+ */
+int doc_finish() {
+	int fd;
+	if (doc_memfd < 0) {
+		int pfd[2];
+		sys_err(pipe2(pfd, O_CLOEXEC));
+		if (fcntl(pfd[1], F_GETPIPE_SZ) >= (long)doc_len) {
+			doc_raw(pfd[1], doc_buf, doc_len);
+			sys_err(close(pfd[1]));
+			doc_len = 0;
+			return pfd[0];
+		}
+		sys_err(close(pfd[0]));
+		sys_err(close(pfd[1]));
+		sys_err(doc_memfd = memfd_create("here-document", MFD_CLOEXEC));
+	}
+	doc_raw(doc_memfd, doc_buf, doc_len);
+	sys_err(lseek(doc_memfd, 0, SEEK_SET));
+	fd = doc_memfd;
+	doc_memfd = -1;
+	doc_len = 0;
+	return fd;
+}
+
+/*
+ * Write the body of the here-document t (followed by its delimiter).
+ * Return 0, after printing an error, if a line of it is malformed (the
+ * body is still read to its end).
+ */
+int doc_body(struct lex_tok *t) {
+	const char *delim = t[1].str;
+	size_t dlen = strlen(delim), len;
+	const char *line;
+	int ok = 1;
+	while (1) {
+		if (!doc_line || !(line = doc_line(&len))) {
+			fprintf(stderr, PREF": warning: here-document delimited by end of input (wanted '%s')\n", delim);
+			return ok;
+		}
+		if (t->type == TOK_DOCTAB) {
+			while (len && *line == '\t') {
+				++line;
+				--len;
+			}
+		}
+		if (len == dlen && memcmp(line, delim, len) == 0) return ok;
+		if (!ok) continue;
+		if (!t[1].quoted && (memchr(line, '$', len) || memchr(line, '\\', len) || memchr(line, '`', len))) {
+			struct arena_mark m = arena_tell();
+			char *s = arena_alloc(len + 1);
+			memcpy(s, line, len);
+			s[len] = '\0';
+			if ((s = lex_string(s, s + len, 1))) doc_write(s, strlen(s));
+			else ok = 0;
+			arena_rewind(m);
+		} else {
+			doc_write(line, len);
+		}
+		doc_write("\n", 1);
+	}
+}
+
+/*
+ * Read the bodies of the here-documents and here-strings among tokens, in
+ * order, into their fd.
+ * Return 0, after printing an error, if one is malformed.
+ */
+int doc_read(struct lex_tok *t) {
+	for (; t->type != TOK_END; ++t) {
+		if (t->type == TOK_STR) {
+			doc_write(t[1].str, strlen(t[1].str));
+			doc_write("\n", 1);
+		} else if (t->type == TOK_DOC || t->type == TOK_DOCTAB) {
+			if (!doc_body(t)) {
+				doc_len = 0;
+				if (doc_memfd >= 0) sys_err(close(doc_memfd));
+				doc_memfd = -1;
+				return 0;
+			}
+		} else {
+			continue;
+		}
+		t->fd = doc_finish();
+	}
+	return 1;
+}
+
+/*
+ * Close the bodies among tokens not taken by parse_cmd.
+ */
+void doc_close(struct lex_tok *t) {
+	for (; t->type != TOK_END; ++t) {
+		if (t->fd >= 0) sys_err(close(t->fd));
+		t->fd = -1;
+	}
+}
+#undef DOCSIZE
+
+/*
+ * Paths matched by the pattern characters of word t (see glob_expand), or
+ * NULL.
+ */
+char **glob_word(struct lex_tok *t, size_t *np) {
+	size_t len = strlen(t->str), i;
+	char *act = arena_alloc(len);
+	memset(act, 0, len);
+	for (i = 0; i < t->glob; ++i) act[lex_globs[t->gidx + i]] = 1;
+	return glob_expand(t->str, act, np);
+}
+
+/*
+ * Parse one piped part, from the tokens at *tp up to the next '|' or the
+ * end, into argv, with pathname expansion of its arguments.
+ * Leading name=value words go to a NULL-terminated array put in *assignsp.
+ * Its redirections (their operator tokens, followed by their word) go to a
+ * NULL-terminated array put in *redirsp, in order (see plan_build).
+ * Redirections may occur anywhere among the words.
+ * *tp is left at the '|' or end token.
+ */
+char **parse_cmd(struct lex_tok **tp, char ***assignsp, struct lex_tok ***redirsp) {
+	struct lex_tok *t;
+	size_t n = 0, nglob = 0, nredirs = 0;
+	for (t = *tp; t->type != TOK_PIPE && t->type != TOK_END; ++t) {
+		if (t->type != TOK_WORD) {
+			++t; // skip file name
+			++nredirs;
+		} else if (++n, t->glob) ++nglob;
+	}
+	// expand patterns first, to know the number of arguments
+	char ***matches = NULL;
+	size_t *counts = NULL, g = 0;
+	if (nglob) {
+		matches = arena_alloc(nglob * sizeof(char **));
+		counts = arena_alloc(nglob * sizeof(size_t));
+		int cmd = 0;
+		for (t = *tp; t->type != TOK_PIPE && t->type != TOK_END; ++t) {
+			if (t->type != TOK_WORD) {
+				++t;
+				continue;
+			}
+			cmd |= !t->assign;
+			if (!t->glob) continue;
+			matches[g] = cmd ? glob_word(t, &counts[g]) : NULL;
+			if (matches[g]) n += counts[g] - 1;
+			++g;
+		}
+		g = 0;
+	}
+	// one array for both: assignments, NULL, arguments, NULL
+	char **a = *assignsp = arena_alloc((n + 2) * sizeof(char*));
+	char **argv = NULL;
+	struct lex_tok **r = *redirsp = arena_alloc((nredirs + 1) * sizeof(struct lex_tok *));
+	for (t = *tp; t->type != TOK_PIPE && t->type != TOK_END; ++t) {
+		if (t->type != TOK_WORD) {
+			*r++ = t++;
+		} else {
+			if (!argv && !t->assign) {
+				*a++ = NULL;
+				argv = a;
+			}
+			if (t->glob && matches[g]) {
+				memcpy(a, matches[g], counts[g] * sizeof(char *));
+				a += counts[g];
+			} else {
+				*a++ = t->str;
+			}
+			if (t->glob) ++g;
+		}
+	}
+	if (!argv) {
+		*a++ = NULL;
+		argv = a;
+	}
+	*a = NULL;
+	*r = NULL;
+	*tp = t;
+	return argv;
+}
+
+/*
+ * Redirections.
+ * The pipe ends and redirections of a piped part are turned into a plan:
+ * a list of operations on the descriptors of the child, done in order once
+ * it has forked (see plan_apply), or as spawn file actions (see
+ * spawn_posix). The shell's own descriptors are left as they are.
+ * Files are opened by the shell while the plan is made, so that a missing
+ * file or a bad descriptor is reported for the command alone, which is then
+ * not run.
+ * A builtin run in the shell writes to the descriptor planned for its
+ * stdout if that is all the plan changes (see plan_std); else the plan is
+ * applied to the shell around it and undone (see plan_push).
+ */
+struct fd_op {
+	int fd; // descriptor of the child
+	int src; // descriptor it becomes a copy of, or -1 to close it
+	int dup; // src is as left by the operations before (n<&m, n>&m), not the shell's
+};
+
+/* Descriptors of the shell are moved from 0-9, which commands may use, when in the way. */
+#define FD_MIN 10
+#define PLAN_SAVED -2 // in plan.saved: the descriptor is saved by an operation before
+struct plan {
+	struct fd_op *ops;
+	size_t n;
+	int *fds; // descriptors opened for the plan (or -1), closed by plan_close
+	size_t nfds;
+	int *saved; // copies kept by plan_push
+	int file_in; // stdin is a file
+};
+
+/*
+ * Descriptor of the shell which fd of the child is a copy of after the
+ * operations ops, or -1 if it is closed.
+ */
+int plan_view(const struct fd_op *ops, size_t n, int fd) {
+	while (n--) {
+		if (ops[n].fd != fd) continue;
+		if (ops[n].src < 0 || !ops[n].dup) return ops[n].src;
+		fd = ops[n].src;
+	}
+	return fd;
+}
+
+/*
+ * Report an error on the stderr of the child as planned so far, since
+ * redirections apply from left to right (not at all if it is closed).
+ */
+void plan_warn(struct plan *p, const char *name, const char *msg) {
+	int fd = plan_view(p->ops, p->n, STDERR_FILENO);
+	if (fd < 0) return;
+	if (name) dprintf(fd, PREF": %s: %s\n", name, msg);
+	else dprintf(fd, PREF": %s\n", msg);
+}
+
+/*
+ * Add an operation making fd a copy of the shell's descriptor src, which
+ * the plan then owns.
+ * Return 0, after printing an error, on failure.
+ */
+int plan_add(struct plan *p, int fd, int src) {
+	size_t i;
+	for (i = 0; i < p->n; ++i) {
+		if (p->ops[i].fd == src) {
+			// an operation before replaces it in the child
+			int moved = fcntl(src, F_DUPFD_CLOEXEC, FD_MIN);
+			sys_err(close(src));
+			if (moved < 0) {
+				plan_warn(p, NULL, strerror(errno));
+				return 0;
+			}
+			src = moved;
+			break;
+		}
+	}
+	p->fds[p->nfds++] = src;
+	p->ops[p->n].fd = fd;
+	p->ops[p->n].src = src;
+	p->ops[p->n++].dup = 0;
+	return 1;
+}
+
+/*
+ * Check that descriptor fd is open in the child, after the operations so
+ * far: if none of them sets it, it is inherited from the shell, unless it
+ * is one of the shell's own (close-on-exec).
+ */
+int plan_open(struct plan *p, int fd) {
+	size_t i = p->n;
+	while (i--) {
+		if (p->ops[i].fd == fd) return p->ops[i].src >= 0;
+	}
+	int flags = fcntl(fd, F_GETFD);
+	return flags >= 0 && !(flags & FD_CLOEXEC);
+}
+
+/*
+ * Plan the pipe ends in / out (if not the shell's stdin / stdout) and the
+ * redirections of a piped part (see parse_cmd). If nullin is set, stdin
+ * defaults to /dev/null (for a background job without job control).
+ * Return 0, after printing an error, if one of them fails; the plan must
+ * still be closed.
+ */
+int plan_build(struct plan *p, struct lex_tok **redirs, int in, int out, int nullin) {
+	size_t n = 0;
+	while (redirs[n]) ++n;
+	p->ops = arena_alloc((n + 2) * sizeof(struct fd_op));
+	p->fds = arena_alloc((n + 2) * sizeof(int));
+	p->n = p->nfds = 0;
+	p->saved = NULL;
+	p->file_in = 0;
+	if (in == STDIN_FILENO && nullin && (in = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+		plan_warn(p, "/dev/null", strerror(errno));
+		return 0;
+	}
+	if (in != STDIN_FILENO && !plan_add(p, STDIN_FILENO, in)) return 0;
+	if (out != STDOUT_FILENO && !plan_add(p, STDOUT_FILENO, out)) return 0;
+
+	for (; *redirs; ++redirs) {
+		struct lex_tok *r = *redirs;
+		char *word = r[1].str;
+		int input = r->type != TOK_OUT && r->type != TOK_APPEND && r->type != TOK_DUPOUT;
+		int fd = r->io >= 0 ? r->io : input ? STDIN_FILENO : STDOUT_FILENO;
+		int flags, src;
+		switch (r->type) {
+		case TOK_IN:
+			flags = O_RDONLY;
+			break;
+		case TOK_OUT:
+			flags = O_WRONLY | O_CREAT | O_TRUNC;
+			break;
+		case TOK_APPEND:
+			flags = O_WRONLY | O_CREAT | O_APPEND;
+			break;
+		case TOK_RDWR:
+			flags = O_RDWR | O_CREAT;
+			break;
+		case TOK_DUPIN:
+		case TOK_DUPOUT:
+			// n<&m or n>&m, or n<&- to close
+			if (word[0] == '-' && !word[1]) {
+				src = -1;
+			} else if (isdigit((unsigned char)word[0]) && !word[1] && plan_open(p, word[0] - '0')) {
+				src = word[0] - '0';
+			} else {
+				plan_warn(p, word, "bad file descriptor");
+				return 0;
+			}
+			p->ops[p->n].fd = fd;
+			p->ops[p->n].src = src;
+			p->ops[p->n++].dup = 1;
+			continue;
+		default:
+			// body of a here-document or here-string, read by doc_read
+			if (!plan_add(p, fd, r->fd)) {
+				r->fd = -1;
+				return 0;
+			}
+			r->fd = -1;
+			continue;
+		}
+		if ((src = open(word, flags | O_CLOEXEC, 0666)) < 0) {
+			plan_warn(p, word, strerror(errno));
+			return 0;
+		}
+		if (!plan_add(p, fd, src)) return 0;
+		if (fd == STDIN_FILENO) p->file_in = r->type == TOK_IN;
+	}
+	return 1;
+}
+
+/*
+ * Apply the operations of a plan in a child, with async-signal-safe calls
+ * only. Return 0, or the errno value of a failure.
+ */
+int plan_apply(const struct fd_op *ops, size_t n) {
+	for (; n--; ++ops) {
+		if (ops->src < 0) {
+			close(ops->fd);
+		} else if (ops->src != ops->fd) {
+			if (dup2(ops->src, ops->fd) < 0) return errno;
+		} else if (fcntl(ops->fd, F_SETFD, 0) < 0) {
+			// left in place: it only has to survive exec
+			return errno;
+		}
+	}
+	return 0;
+}
+
+/*
+ * If the plan only sets stdin and stdout, put the shell's descriptors they
+ * become in *inp and *outp, and return 1.
+ */
+int plan_std(struct plan *p, int *inp, int *outp) {
+	size_t i;
+	for (i = 0; i < p->n; ++i) {
+		if (p->ops[i].fd > STDOUT_FILENO || p->ops[i].src < 0) return 0;
+	}
+	*inp = plan_view(p->ops, p->n, STDIN_FILENO);
+	*outp = plan_view(p->ops, p->n, STDOUT_FILENO);
+	return 1;
+}
+
+/*
+ * Undo plan_push (or as much of it as was done).
+ */
+void plan_pop(struct plan *p) {
+	size_t i = p->n;
+	fflush(stdout);
+	while (i--) {
+		int fd = p->ops[i].fd, saved = p->saved[i];
+		if (saved == PLAN_SAVED) continue;
+		if (saved < 0) {
+			close(fd);
+		} else {
+			sys_err(dup2(saved, fd));
+			sys_err(close(saved));
+		}
+	}
+}
+
+/*
+ * Apply the plan to the shell itself (for a builtin), keeping copies of
+ * the descriptors it replaces for plan_pop.
+ * Return 0, after printing an error and undoing it, on failure.
+ */
+int plan_push(struct plan *p) {
+	size_t i, j;
+	int ok = 1;
+	fflush(stdout);
+	p->saved = arena_alloc(p->n * sizeof(int));
+	for (i = 0; i < p->n && ok; ++i) {
+		struct fd_op *op = &p->ops[i];
+		for (j = 0; j < i && p->ops[j].fd != op->fd; ++j) ;
+		if (j < i) {
+			p->saved[i] = PLAN_SAVED;
+		} else if ((p->saved[i] = fcntl(op->fd, F_DUPFD_CLOEXEC, FD_MIN)) < 0 && errno != EBADF) {
+			break; // -1 is for a descriptor which was closed
+		}
+		if (op->src < 0) close(op->fd);
+		else if (op->src != op->fd) ok = dup2(op->src, op->fd) >= 0;
+	}
+	if (i == p->n && ok) return 1;
+	perror(PREF);
+	p->n = i;
+	plan_pop(p);
+	return 0;
+}
+
+/*
+ * Close the descriptors opened for the plan, once the part has started.
+ */
+void plan_close(struct plan *p) {
+	size_t i;
+	for (i = 0; i < p->nfds; ++i) {
+		if (p->fds[i] >= 0) sys_err(close(p->fds[i]));
+	}
+}
+
+/*
+ * Take descriptor fd out of the plan, which no longer closes it.
+ */
+void plan_take(struct plan *p, int fd) {
+	size_t i;
+	for (i = 0; i < p->nfds; ++i) {
+		if (p->fds[i] == fd) p->fds[i] = -1;
+	}
+}
+#undef FD_MIN
+#undef PLAN_SAVED
+
+/*
+ * Hash table of resolved command paths.
+ * argv[0] is resolved to a path in the shell before spawning, so that PATH is
+ * walked once per command name instead of once per execution.
+ * The table is emptied when PATH changes, and an entry is dropped when
+ * executing its path fails.
+ * Entries found relative to the current directory are dropped on cd.
+ */
+struct hash_ent {
+	char *name;
+	char *path;
+	int hits;
+	int rel; // path is relative to the current directory
+	struct hash_ent *next;
+};
+
+#define HASH_INIT 64
+struct hash_ent **hash_tab;
+size_t hash_cap;
+size_t hash_cnt;
+char *hash_pathenv; // value of PATH when the table was filled
+
+size_t hash_str(const char *s) {
+	return fnv1a(s, strlen(s), 0);
+}
+
+struct hash_ent **hash_slot(const char *name) {
+	struct hash_ent **ep = &hash_tab[hash_str(name) & (hash_cap - 1)];
+	for ( ; *ep; ep = &(*ep)->next) {
+		if (strcmp((*ep)->name, name) == 0) break;
+	}
+	return ep;
+}
+
+void hash_free(struct hash_ent *e) {
+	free(e->name);
+	free(e->path);
+	free(e);
+}
+
+void hash_clear() {
+	size_t i;
+	for (i = 0; i < hash_cap; ++i) {
+		struct hash_ent *e, *next;
+		for (e = hash_tab[i]; e; e = next) {
+			next = e->next;
+			hash_free(e);
+		}
+		hash_tab[i] = NULL;
+	}
+	hash_cnt = 0;
+}
+
+/*
+ * Double the number of buckets once the load factor exceeds 1.
+ */
+void hash_grow() {
+	size_t old_cap = hash_cap;
+	struct hash_ent **old = hash_tab;
+	hash_cap *= 2;
+	hash_tab = calloc(hash_cap, sizeof(struct hash_ent*));
+	if (!hash_tab) sys_err(-1);
+	size_t i;
+	for (i = 0; i < old_cap; ++i) {
+		struct hash_ent *e, *next;
+		for (e = old[i]; e; e = next) {
+			next = e->next;
+			struct hash_ent **ep = &hash_tab[hash_str(e->name) & (hash_cap - 1)];
+			e->next = *ep;
+			*ep = e;
+		}
+	}
+	free(old);
+}
+
+void hash_init() {
+	hash_cap = HASH_INIT;
+	hash_tab = calloc(hash_cap, sizeof(struct hash_ent*));
+	if (!hash_tab) sys_err(-1);
+}
+#undef HASH_INIT
+
+struct hash_ent *hash_add(const char *name, char *path, int rel) {
+	if (hash_cnt >= hash_cap) hash_grow();
+	struct hash_ent *e = malloc(sizeof(struct hash_ent));
+	if (!e || !(e->name = strdup(name))) sys_err(-1);
+	e->path = path;
+	e->hits = 0;
+	e->rel = rel;
+	struct hash_ent **ep = &hash_tab[hash_str(name) & (hash_cap - 1)];
+	e->next = *ep;
+	*ep = e;
+	++hash_cnt;
+	return e;
+}
+
+void hash_del(const char *name) {
+	struct hash_ent **ep = hash_slot(name);
+	struct hash_ent *e = *ep;
+	if (e) {
+		*ep = e->next;
+		hash_free(e);
+		--hash_cnt;
+	}
+}
+
+/*
+ * Drop the entries which depend on the current directory.
+ */
+void hash_drop_rel() {
+	size_t i;
+	for (i = 0; i < hash_cap; ++i) {
+		struct hash_ent **ep = &hash_tab[i];
+		while (*ep) {
+			struct hash_ent *e = *ep;
+			if (e->rel) {
+				*ep = e->next;
+				hash_free(e);
+				--hash_cnt;
+			} else {
+				ep = &e->next;
+			}
+		}
+	}
+}
+
+/*
+ * Empty the table if PATH has changed since it was filled.
+ */
+void hash_check_pathenv() {
+	char *pathenv = var_get("PATH");
+	if (!pathenv) pathenv = "";
+	if (hash_pathenv && strcmp(hash_pathenv, pathenv) == 0) return;
+	hash_clear();
+	free(hash_pathenv);
+	hash_pathenv = strdup(pathenv);
+	if (!hash_pathenv) sys_err(-1);
+}
+
+/*
+ * Search PATH for an executable file called name.
+ * As before, the current directory is tried last.
+ * Return a malloc'ed path (setting *relp if it is relative) or NULL.
+ */
+char *path_search(const char *name, int *relp) {
+	size_t nlen = strlen(name);
+	char *dir = hash_pathenv;
+	char *path = NULL;
+	while (1) {
+		char *end = strchrnul(dir, ':');
+		size_t dlen = end - dir;
+		if (dlen == 0) { // empty entry means current directory
+			dir = ".";
+			dlen = 1;
+		}
+		path = realloc(path, dlen + nlen + 2);
+		if (!path) sys_err(-1);
+		memcpy(path, dir, dlen);
+		path[dlen] = '/';
+		memcpy(path + dlen + 1, name, nlen + 1);
+
+		struct stat st;
+		if (access(path, X_OK) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+			*relp = path[0] != '/';
+			return path;
+		}
+		if (!*end) break;
+		dir = end + 1;
+	}
+	// try prepending "./" to search in current path
+	path = realloc(path, nlen + 3);
+	if (!path) sys_err(-1);
+	strcpy(path, "./");
+	strcat(path, name);
+	if (access(path, X_OK) == 0) {
+		*relp = 1;
+		return path;
+	}
+	free(path);
+	return NULL;
+}
+
+/*
+ * Resolve name to the path to be executed.
+ * Names containing a '/' are used as they are.
+ * Return NULL if no executable is found.
+ */
+char *path_lookup(char *name) {
+	if (strchr(name, '/')) return name;
+	hash_check_pathenv();
+	struct hash_ent *e = *hash_slot(name);
+	if (!e) {
+		int rel;
+		char *path = path_search(name, &rel);
+		if (!path) return NULL;
+		e = hash_add(name, path, rel);
+	}
+	++e->hits;
+	return e->path;
+}
+
+/*
+ * hash: list remembered command paths.
+ * hash -r: forget all remembered paths.
+ * hash name...: remember the paths of the given commands.
+ */
+int builtin_hash(char **argv) {
+	int status = EXIT_SUCCESS;
+	hash_check_pathenv();
+	if (!argv[1]) {
+		size_t i;
+		struct hash_ent *e;
+		if (!hash_cnt) {
+			out_str("hash: hash table empty\n");
+			return status;
+		}
+		out_str("hits\tcommand\n");
+		for (i = 0; i < hash_cap; ++i) {
+			for (e = hash_tab[i]; e; e = e->next) {
+				out_printf("%4d\t%s\n", e->hits, e->path);
+			}
+		}
+	} else if (strcmp(argv[1], "-r") == 0) {
+		hash_clear();
+	} else {
+		char **p;
+		for (p = argv + 1; *p; ++p) {
+			if (strchr(*p, '/')) continue;
+			hash_del(*p);
+			if (path_lookup(*p)) {
+				(*hash_slot(*p))->hits = 0;
+			} else {
+				prog_warn(ENOENT, *p);
+				status = EXIT_FAILURE;
+			}
+		}
+	}
+	return status;
+}
+
+/*
+ * Job control state.
+ * Job control is on in an interactive shell on a terminal: every command
+ * then runs in its own process group, and the one in the foreground owns
+ * the terminal. The shell itself ignores the job control signals, which
+ * are set back to default in its children.
+ */
+int interactive;
+int job_control;
+int tty_fd = STDIN_FILENO;
+pid_t shell_pgid;
+int job_sigs[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, 0 };
+
+/*
+ * Spawn backends.
+ * Each backend starts the program at 'path' (already resolved from PATH, see
+ * path_lookup) with the redirections 'ops' (see struct plan).
+ * The plumbing is done in the child (or by the spawn file actions), so the
+ * shell's own descriptors are never modified.
+ * Under job control, the child also joins process group 'pgid' (0 for a new
+ * group of its own) and, if 'fg' is set, takes the terminal.
+ *
+ * - posix_spawn: glibc's posix_spawn, which uses clone(CLONE_VM|CLONE_VFORK).
+ * - vfork: vfork + execve, sharing the shell's address space until exec.
+ * - clone: clone(CLONE_VM|CLONE_VFORK) on a dedicated stack.
+ * - fork: plain fork + execve (copies page tables, kept as a fallback).
+ *
+ * The backend is picked at startup from the environment variable SHELL_SPAWN,
+ * and can be changed at runtime with the builtin 'spawn'.
+ */
+enum {
+	SPAWN_POSIX,
+	SPAWN_VFORK,
+	SPAWN_CLONE,
+	SPAWN_FORK
+};
+
+char *spawn_strs[] = {
+	"posix_spawn",
+	"vfork",
+	"clone",
+	"fork",
+	NULL
+};
+
+#define SPAWN_ENV "SHELL_SPAWN"
+int spawn_backend = SPAWN_POSIX;
+
+/*
+ * Request passed to a spawned child.
+ * 'err' is set to the errno value of a failed exec.
+ */
+struct spawn_req {
+	char **argv;
+	char *path;
+	const struct fd_op *ops; // redirections (see struct plan)
+	size_t nops;
+	pid_t pgid; // -1 to stay in the shell's process group
+	int fg;
+	volatile int err;
+};
+
+/*
+ * Code run in a vfork / clone / fork child.
+ * Only async-signal-safe calls are made, as the address space may be shared.
+ * Returns only if exec fails, with the errno value of the failure.
+ */
+int spawn_child(struct spawn_req *req) {
+	if (req->pgid >= 0) {
+		if (setpgid(0, req->pgid) < 0) return errno;
+		// SIGTTOU is still ignored here
+		if (req->fg) tcsetpgrp(tty_fd, getpgrp());
+	}
+	if (job_control) {
+		struct sigaction sa;
+		int *sig;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		for (sig = job_sigs; *sig; ++sig) sigaction(*sig, &sa, NULL);
+	}
+	int err = plan_apply(req->ops, req->nops);
+	if (err) return err;
+	execve(req->path, req->argv, environ);
+	return errno;
+}
+
+/*
+ * Entry point of a clone child.
+ */
+int spawn_clone_fn(void *arg) {
+	struct spawn_req *req = arg;
+	req->err = spawn_child(req);
+	_exit(127);
+}
+
+/* Stack of a clone child; the parent is suspended until the child execs. */
+#define STACKSIZE (64 * 1024)
+char spawn_stack[STACKSIZE] __attribute__((aligned(16)));
+
+pid_t spawn_posix(struct spawn_req *req) {
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	pid_t pid = -1;
+	int err = posix_spawn_file_actions_init(&fa);
+	if (err) {
+		req->err = err;
+		return -1;
+	}
+	err = posix_spawnattr_init(&attr);
+	if (err) {
+		posix_spawn_file_actions_destroy(&fa);
+		req->err = err;
+		return -1;
+	}
+
+	short flags = 0;
+	if (req->pgid >= 0) {
+		flags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup(&attr, req->pgid);
+#if __GLIBC_PREREQ(2, 35)
+		if (req->fg) err = posix_spawn_file_actions_addtcsetpgrp_np(&fa, tty_fd);
+#endif
+	}
+	if (job_control) {
+		sigset_t set;
+		int *sig;
+		sigemptyset(&set);
+		for (sig = job_sigs; *sig; ++sig) sigaddset(&set, *sig);
+		flags |= POSIX_SPAWN_SETSIGDEF;
+		posix_spawnattr_setsigdefault(&attr, &set);
+	}
+	posix_spawnattr_setflags(&attr, flags);
+
+	// a dup2 onto the same descriptor clears its close-on-exec flag
+	size_t i;
+	for (i = 0; !err && i < req->nops; ++i) {
+		const struct fd_op *op = &req->ops[i];
+		if (op->src < 0) err = posix_spawn_file_actions_addclose(&fa, op->fd);
+		else err = posix_spawn_file_actions_adddup2(&fa, op->src, op->fd);
+	}
+	if (!err) {
+		err = posix_spawn(&pid, req->path, &fa, &attr, req->argv, environ);
+	}
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	req->err = err;
+	return err ? -1 : pid;
+}
+
+pid_t spawn_vfork(struct spawn_req *req) {
+	pid_t pid = vfork();
+	if (pid == 0) {
+		req->err = spawn_child(req);
+		_exit(127);
+	}
+	if (pid < 0) req->err = errno;
+	return pid;
+}
+
+pid_t spawn_clone(struct spawn_req *req) {
+	pid_t pid = clone(spawn_clone_fn, spawn_stack + STACKSIZE,
+			CLONE_VM | CLONE_VFORK | SIGCHLD, req);
+	if (pid < 0) req->err = errno;
+	return pid;
+}
+
+pid_t spawn_fork(struct spawn_req *req) {
+	// address space is not shared, so the error is reported through a pipe
+	// which a successful exec closes
+	int efd[2];
+	if (pipe2(efd, O_CLOEXEC) < 0) {
+		req->err = errno;
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		int err = spawn_child(req);
+		write(efd[1], &err, sizeof(err));
+		_exit(127);
+	}
+	close(efd[1]);
+	if (pid < 0) {
+		req->err = errno;
+	} else {
+		int err;
+		if (read(efd[0], &err, sizeof(err)) == sizeof(err)) req->err = err;
+	}
+	close(efd[0]);
+	return pid;
+}
+#undef STACKSIZE
+
+pid_t (*spawn_fns[])(struct spawn_req *req) = {
+	spawn_posix,
+	spawn_vfork,
+	spawn_clone,
+	spawn_fork
+};
+
+/*
+ * If name is a spawn backend, return index in the spawn_strs array.
+ * Else return -1.
+ */
+int find_spawn(const char *name) {
+	int i;
+	for (i = 0; spawn_strs[i]; ++i) {
+		if (strcmp(spawn_strs[i], name) == 0) return i;
+	}
+	return -1;
+}
+
+/*
+ * Pick the spawn backend from the environment.
+ */
+void spawn_init() {
+	char *name = var_get(SPAWN_ENV);
+	if (name && *name) {
+		int sb = find_spawn(name);
+		if (sb < 0) fprintf(stderr, PREF": "SPAWN_ENV": unknown backend %s\n", name);
+		else spawn_backend = sb;
+	}
+}
+
+int builtin_spawn(char **argv) {
+	if (argv[1]) {
+		int sb = find_spawn(argv[1]);
+		if (sb < 0) {
+			out_str("usage: spawn [posix_spawn | vfork | clone | fork]\n");
+			return EXIT_FAILURE;
+		}
+		spawn_backend = sb;
+	} else {
+		out_str(spawn_strs[spawn_backend]);
+		out_putc('\n');
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Convert a status reported by wait into an exit status, as in sh.
+ */
+int wait_status(int status) {
+	if (WIFEXITED(status)) return WEXITSTATUS(status);
+	if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+	return status;
+}
+
+/*
+ * Report a program which could not be started on the stderr it would have
+ * had (as in 'prog 2>/dev/null').
+ */
+void spawn_warn(int err, char *name, const struct fd_op *ops, size_t nops) {
+	int fd = plan_view(ops, nops, STDERR_FILENO);
+	if (fd >= 0) dprintf(fd, PREF": %s: %s\n", name, strerror(err));
+}
+
+/*
+ * Start req with the current backend.
+ * On failure, the child (if any) has been reaped, and req->err is set.
+ */
+pid_t spawn_req(struct spawn_req *req) {
+	req->err = 0;
+	pid_t pid = (*spawn_fns[spawn_backend])(req);
+	if (!req->err) {
+		// also from the parent, in case the child has not run yet
+		if (req->pgid >= 0) setpgid(pid, req->pgid ? req->pgid : pid);
+		return pid;
+	}
+	// a child which failed to exec still has to be reaped
+	if (pid > 0) waitpid(pid, NULL, 0);
+	return -1;
+}
+
+/*
+ * Arguments to run the script at path, which has no #! line, with sh
+ * (allocated from the arena).
+ */
+#define SPAWN_SH "/bin/sh"
+char **spawn_sh_argv(char *path, char **argv) {
+	size_t n = 0;
+	while (argv[n]) ++n;
+	char **sargv = arena_alloc((n + 2) * sizeof(char *));
+	sargv[0] = "sh";
+	sargv[1] = path;
+	memcpy(sargv + 2, argv + 1, n * sizeof(char *));
+	return sargv;
+}
+
+/*
+ * Exit status of a command which could not be started, as in sh: 127 if it
+ * was not found, else 126.
+ */
+int spawn_status(int err) {
+	return err == ENOENT ? 127 : 126;
+}
+
+/*
+ * Start argv as a child process with the redirections ops (see struct
+ * plan), in process group pgid (see struct spawn_req). A file which is not
+ * in a format the kernel runs is run as a script by sh, as execvp does.
+ * On failure, print an error and return -1, with errno set to the cause.
+ */
+pid_t spawn_prog(char **argv, const struct fd_op *ops, size_t nops, pid_t pgid, int fg) {
+	struct spawn_req req = { argv, NULL, ops, nops, pgid, fg, 0 };
+	pid_t pid;
+	int retry = 1;
+	var_environ();
+	while (1) {
+		req.path = path_lookup(argv[0]);
+		if (!req.path) {
+			spawn_warn(ENOENT, argv[0], ops, nops);
+			errno = ENOENT;
+			return -1;
+		}
+		req.argv = argv;
+		if ((pid = spawn_req(&req)) >= 0) return pid;
+		if (req.err == ENOEXEC) {
+			req.argv = spawn_sh_argv(req.path, argv);
+			req.path = SPAWN_SH;
+			if ((pid = spawn_req(&req)) >= 0) return pid;
+			break;
+		}
+		if (req.path == argv[0]) break;
+		// the remembered path is stale: forget it, and search PATH again
+		hash_del(argv[0]);
+		if (!retry--) break;
+	}
+	spawn_warn(req.err, argv[0], ops, nops);
+	errno = req.err;
+	return -1;
+}
+#undef SPAWN_SH
+
+/*
+ * Run builtin b in a forked child, set up like a spawned program.
+ * On failure, print an error and return -1.
+ */
+pid_t spawn_builtin(struct builtin *b, char **argv, const struct fd_op *ops, size_t nops, pid_t pgid, int fg) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (pgid >= 0) {
+			setpgid(0, pgid);
+			if (fg) tcsetpgrp(tty_fd, getpgrp());
+		}
+		if (job_control) {
+			struct sigaction sa;
+			int *sig;
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = SIG_DFL;
+			for (sig = job_sigs; *sig; ++sig) sigaction(*sig, &sa, NULL);
+			job_control = 0; // jobs of its own run in its process group
+		}
+		if ((errno = plan_apply(ops, nops))) {
+			perror(PREF);
+			_exit(EXIT_FAILURE);
+		}
+		_exit(builtin_run(b, argv));
+	}
+	if (pid < 0) {
+		prog_warn(errno, argv[0]);
+		return -1;
+	}
+	if (pgid >= 0) setpgid(pid, pgid ? pgid : pid);
+	return pid;
+}
+
+
+/*
+ * Resource accounting of the piped parts of a command.
+ * Every part gets a record, filled in when its child is reaped with wait4
+ * (or around the call, for a builtin run in the shell itself).
+ * The records are printed by the 'time' prefix.
+ */
+enum {
+	STAGE_RUNNING,
+	STAGE_STOPPED,
+	STAGE_DONE
+};
+
+struct stage {
+	char *name;
+	pid_t pid; // -1 if run in the shell, or not started
+	int state;
+	double start; // wall clock, in seconds
+	double end;
+	struct rusage ru;
+	int status;
+	struct cat_job *cat; // in-shell cat running in a thread, if any
+	int pidfd; // watching the child (see Event loop), or -1
+	double deadline; // when to signal the child, or 0 (see builtin_timeout)
+	double grace; // then how long until SIGKILL, or 0 for never
+	int sig; // signal sent at the deadline
+	int expired; // number of signals sent at deadlines
+};
+
+/*
+ * Current time in seconds.
+ */
+double clock_now() {
+	struct timespec ts;
+	sys_err(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double tv_secs(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/*
+ * Difference of resource usage of the shell itself, for builtins.
+ */
+void ru_sub(struct rusage *ru, const struct rusage *before) {
+	timersub(&ru->ru_utime, &before->ru_utime, &ru->ru_utime);
+	timersub(&ru->ru_stime, &before->ru_stime, &ru->ru_stime);
+	ru->ru_nvcsw -= before->ru_nvcsw;
+	ru->ru_nivcsw -= before->ru_nivcsw;
+}
+
+/*
+ * Print records on stderr, one line per piped part, followed by the total
+ * for the pipeline.
+ * maxrss is in KiB; vcsw / ivcsw are voluntary / involuntary context switches.
+ */
+void stages_print(struct stage *stages, int nstages, double start, double end) {
+	int i;
+	double user = 0, sys = 0;
+	fprintf(stderr, "%-6s %9s %9s %9s %9s %7s %7s %6s  %s\n",
+			"stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "status", "command");
+	for (i = 0; i < nstages; ++i) {
+		struct stage *st = &stages[i];
+		user += tv_secs(st->ru.ru_utime);
+		sys += tv_secs(st->ru.ru_stime);
+		fprintf(stderr, "%-6d %9.3f %9.3f %9.3f %9ld %7ld %7ld %6d  %s%s\n",
+				i + 1, st->end - st->start,
+				tv_secs(st->ru.ru_utime), tv_secs(st->ru.ru_stime),
+				st->ru.ru_maxrss, st->ru.ru_nvcsw, st->ru.ru_nivcsw,
+				st->status, st->name, st->pid < 0 ? (st->cat ? " (thread)" : " (shell)") : "");
+	}
+	fprintf(stderr, "%-6s %9.3f %9.3f %9.3f\n", "total", end - start, user, sys);
+}
+
+/*
+ * Self-pipe written to on SIGCHLD, and when an in-shell cat finishes,
+ * so that finished jobs can be noticed without blocking.
+ */
+int sigchld_pipe[2] = { -1, -1 };
+
+void sigchld_handler(int sig) {
+	int err = errno;
+	write(sigchld_pipe[1], "", 1);
+	errno = err;
+}
+
+/*
+ * Empty the self-pipe.
+ * Return 1 if anything was written to it since the last call.
+ */
+#define BUFSIZE 64
+int sigchld_drain() {
+	char buf[BUFSIZE];
+	int any = 0;
+	while (read(sigchld_pipe[0], buf, BUFSIZE) > 0) any = 1;
+	return any;
+}
+#undef BUFSIZE
+
+/*
+ * In-shell cat.
+ * 'cat [file...]' without options runs in a thread of the shell instead of a
+ * child process, concurrently with the other piped parts.
+ * Data is moved by the kernel where it can be: copy_file_range between
+ * regular files, splice when either side is a pipe, and sendfile from a
+ * regular file; otherwise it falls back to read / write.
+ */
+struct cat_job {
+	char **argv; // own copy, as the job may outlive the command line
+	int in; // owned by the thread, closed when done
+	int out; // owned by the thread, closed when done
+	pthread_t tid;
+	volatile int done;
+	int joined;
+	double end;
+	struct rusage ru;
+	int status;
+};
+
+/*
+ * Check if argv can be run by the in-shell cat.
+ */
+int cat_fast(char **argv) {
+	char **p;
+	if (strcmp(argv[0], "cat") != 0) return 0;
+	for (p = argv + 1; *p; ++p) {
+		if ((*p)[0] == '-' && (*p)[1]) return 0; // options are left to cat(1)
+	}
+	return 1;
+}
+
+/*
+ * Errors meaning that a copy method does not apply to these descriptors.
+ */
+int cat_unsupported(int err) {
+	return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF
+		|| err == EOPNOTSUPP;
+}
+
+/*
+ * Copy everything from in to out.
+ * Return 0, or -1 with errno set.
+ */
+#define CHUNK (1 << 20)
+#define BIG_CHUNK (1 << 30)
+int cat_copy(int in, int out) {
+	struct stat ist, ost;
+	ssize_t n;
+	if (fstat(in, &ist) < 0 || fstat(out, &ost) < 0) return -1;
+
+	if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode)) {
+		while ((n = copy_file_range(in, NULL, out, NULL, BIG_CHUNK, 0)) > 0) ;
+		if (n == 0) return 0;
+		if (!cat_unsupported(errno)) return -1;
+	}
+	if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode)) {
+		while ((n = splice(in, NULL, out, NULL, CHUNK,
+				SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) ;
+		if (n == 0) return 0;
+		if (!cat_unsupported(errno)) return -1;
+	}
+	if (S_ISREG(ist.st_mode)) {
+		while ((n = sendfile(out, in, NULL, BIG_CHUNK)) > 0) ;
+		if (n == 0) return 0;
+		if (!cat_unsupported(errno)) return -1;
+	}
+
+	// copy through user space; offsets advanced above are carried over
+	char *buf = malloc(CHUNK);
+	if (!buf) return -1;
+	while ((n = read(in, buf, CHUNK)) > 0) {
+		char *p = buf;
+		while (n > 0) {
+			ssize_t w = write(out, p, n);
+			if (w < 0) {
+				free(buf);
+				return -1;
+			}
+			p += w;
+			n -= w;
+		}
+	}
+	free(buf);
+	return n < 0 ? -1 : 0;
+}
+#undef CHUNK
+#undef BIG_CHUNK
+
+void *cat_thread(void *arg) {
+	struct cat_job *job = arg;
+	char **p = job->argv + 1;
+	job->status = EXIT_SUCCESS;
+	do {
+		int fd = job->in;
+		char *name = *p;
+		if (name && strcmp(name, "-") != 0) {
+			fd = open(name, O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+				job->status = EXIT_FAILURE;
+				continue;
+			}
+		}
+		int err = cat_copy(fd, job->out) < 0 ? errno : 0;
+		if (fd != job->in) close(fd);
+		if (err == EPIPE) { // reader has gone away
+			job->status = EXIT_FAILURE;
+			break;
+		}
+		if (err) {
+			fprintf(stderr, "cat: %s: %s\n", name ? name : "-", strerror(err));
+			job->status = EXIT_FAILURE;
+		}
+	} while (*p && *++p);
+
+	close(job->in);
+	close(job->out); // end of file for the reader
+	job->end = clock_now();
+	getrusage(RUSAGE_THREAD, &job->ru);
+	job->done = 1;
+	write(sigchld_pipe[1], "", 1);
+	return NULL;
+}
+
+/*
+ * Start the in-shell cat on in / out, taking over both descriptors.
+ */
+struct cat_job *cat_start(char **argv, int in, int out) {
+	// argv is copied into a single block along with the job
+	size_t size = sizeof(struct cat_job);
+	int argc;
+	for (argc = 0; argv[argc]; ++argc) size += sizeof(char*) + strlen(argv[argc]) + 1;
+	size += sizeof(char*);
+	struct cat_job *job = calloc(1, size);
+	if (!job) sys_err(-1);
+	job->argv = (char **)(job + 1);
+	char *str = (char *)(job->argv + argc + 1);
+	int i;
+	for (i = 0; i < argc; ++i) {
+		job->argv[i] = strcpy(str, argv[i]);
+		str += strlen(str) + 1;
+	}
+	job->argv[argc] = NULL;
+
+	// own copies of the shell's stdin / stdout, which builtins may replace
+	if (in == STDIN_FILENO) sys_err(in = fcntl(in, F_DUPFD_CLOEXEC, 0));
+	if (out == STDOUT_FILENO) sys_err(out = fcntl(out, F_DUPFD_CLOEXEC, 0));
+	job->in = in;
+	job->out = out;
+
+	// signals (notably SIGPIPE, when the reader exits) are left to the
+	// shell's main thread; a blocked SIGPIPE just makes write fail with EPIPE
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&job->tid, NULL, cat_thread, job);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		errno = err;
+		sys_err(-1);
+	}
+	return job;
+}
+
+/*
+ * Wait for the in-shell cat of a piped part, and record its usage.
+ */
+void cat_join(struct stage *st) {
+	struct cat_job *job = st->cat;
+	pthread_join(job->tid, NULL);
+	job->joined = 1;
+	st->state = STAGE_DONE;
+	st->end = job->end;
+	st->ru = job->ru;
+	st->status = job->status;
+}
+
+/*
+ * Jobs.
+ * A job is a command together with the records of its piped parts.
+ * The foreground command uses fg_job, whose records are reused from command
+ * to command. A command run in the background with '&' (or stopped with ^Z)
+ * moves into a job of its own in the list 'jobs', ordered by job number.
+ * Children are reaped as they finish, while the shell waits for them or for
+ * input (see Event loop).
+ */
+enum {
+	JOB_RUNNING,
+	JOB_STOPPED,
+	JOB_DONE
+};
+
+char *job_state_strs[] = {
+	"Running",
+	"Stopped",
+	"Done"
+};
+
+struct job {
+	int id; // job number, as in %n (0 for the foreground command)
+	pid_t pgid; // process group under job control, else 0
+	char *cmd; // text of the command
+	struct stage *stages;
+	size_t size;
+	int nstages;
+	int last; // record of the last piped part, or -1
+	int state;
+	int notify; // state changed, and not yet reported
+	int seq; // when last put in the background or stopped, for %+
+	struct job *next;
+};
+
+struct job fg_job;
+struct job *jobs;
+int job_seq;
+
+#define BUFSIZE 16
+void job_init_stages(struct job *j) {
+	j->size = BUFSIZE;
+	j->stages = malloc(j->size * sizeof(struct stage));
+	if (!j->stages) sys_err(-1);
+	j->nstages = 0;
+}
+#undef BUFSIZE
+
+struct stage *stage_add(struct job *j, char *name) {
+	if (j->nstages >= j->size) {
+		j->size *= 2;
+		j->stages = realloc(j->stages, j->size * sizeof(struct stage));
+		if (!j->stages) sys_err(-1);
+	}
+	struct stage *st = &j->stages[j->nstages++];
+	memset(st, 0, sizeof(struct stage));
+	st->name = name;
+	st->pid = -1;
+	st->state = STAGE_DONE;
+	st->pidfd = -1;
+	return st;
+}
+
+/*
+ * Stop watching the child of a piped part (see Event loop).
+ */
+void stage_unwatch(struct stage *st) {
+	if (st->pidfd < 0) return;
+	close(st->pidfd);
+	st->pidfd = -1;
+}
+
+/*
+ * Release the in-shell cats of a job (after they have been joined).
+ */
+void job_free_cats(struct job *j) {
+	int i;
+	for (i = 0; i < j->nstages; ++i) {
+		free(j->stages[i].cat);
+		j->stages[i].cat = NULL;
+	}
+}
+
+void job_free(struct job *j) {
+	int i;
+	job_free_cats(j);
+	for (i = 0; i < j->nstages; ++i) free(j->stages[i].name);
+	free(j->stages);
+	free(j->cmd);
+	free(j);
+}
+
+/*
+ * Move the foreground command into a new job.
+ */
+struct job *job_detach() {
+	struct job *j = malloc(sizeof(struct job));
+	if (!j) sys_err(-1);
+	*j = fg_job;
+	if (!(j->cmd = strdup(fg_job.cmd))) sys_err(-1);
+	int i;
+	for (i = 0; i < j->nstages; ++i) {
+		if (!(j->stages[i].name = strdup(j->stages[i].name))) sys_err(-1);
+	}
+	j->seq = ++job_seq;
+
+	// lowest free job number, keeping the list ordered
+	struct job **jp = &jobs;
+	j->id = 1;
+	for ( ; *jp && (*jp)->id == j->id; jp = &(*jp)->next) ++j->id;
+	j->next = *jp;
+	*jp = j;
+
+	job_init_stages(&fg_job);
+	return j;
+}
+
+void job_remove(struct job *j) {
+	struct job **jp;
+	for (jp = &jobs; *jp; jp = &(*jp)->next) {
+		if (*jp == j) {
+			*jp = j->next;
+			job_free(j);
+			return;
+		}
+	}
+}
+
+/*
+ * Work out the state of a job from its records.
+ * In-shell cats cannot be stopped, so a job whose children are all stopped
+ * or done is stopped, even if a cat is still waiting for input.
+ */
+void job_check(struct job *j) {
+	int i, running = 0, cats = 0, stopped = 0;
+	for (i = 0; i < j->nstages; ++i) {
+		struct stage *st = &j->stages[i];
+		if (st->state == STAGE_RUNNING) {
+			if (st->cat) ++cats;
+			else ++running;
+		} else if (st->state == STAGE_STOPPED) {
+			++stopped;
+		}
+	}
+	int state = running ? JOB_RUNNING : stopped ? JOB_STOPPED : cats ? JOB_RUNNING : JOB_DONE;
+	if (state != j->state) {
+		j->state = state;
+		j->notify = 1;
+	}
+}
+
+/*
+ * Exit status of a job: that of its last piped part.
+ */
+int job_status(struct job *j) {
+	return j->last >= 0 ? j->stages[j->last].status : last_status;
+}
+
+/*
+ * Find the record of child pid, and the job it belongs to.
+ */
+struct stage *stage_find(pid_t pid, struct job **jp) {
+	struct job *j = &fg_job;
+	int i;
+	while (j) {
+		for (i = 0; i < j->nstages; ++i) {
+			struct stage *st = &j->stages[i];
+			// records of earlier foreground commands may hold reused pids
+			if (st->pid == pid && (j != &fg_job || st->state != STAGE_DONE)) {
+				*jp = j;
+				return st;
+			}
+		}
+		j = (j == &fg_job) ? jobs : j->next;
+	}
+	return NULL;
+}
+
+/*
+ * Record the end of child pid, as reported by wait4.
+ * A child signalled at its deadline gets status 124, or 137 if SIGKILL
+ * ended it, as with timeout(1).
+ */
+void job_update(pid_t pid, int status, struct rusage *ru) {
+	struct job *j;
+	struct stage *st = stage_find(pid, &j);
+	if (!st) return;
+	st->state = STAGE_DONE;
+	st->end = clock_now();
+	st->ru = *ru;
+	st->status = wait_status(status);
+	if (st->expired && st->status != 128 + SIGKILL) st->status = 124;
+	stage_unwatch(st);
+	job_check(j);
+}
+
+/*
+ * Record that child pid has stopped, or continued if not stopped.
+ */
+void job_stop(pid_t pid, int stopped) {
+	struct job *j;
+	struct stage *st = stage_find(pid, &j);
+	if (!st) return;
+	st->state = stopped ? STAGE_STOPPED : STAGE_RUNNING;
+	job_check(j);
+}
+
+/*
+ * Join the in-shell cats of a job which have finished (or all of them,
+ * if block is set).
+ */
+void job_join(struct job *j, int block) {
+	int i, any = 0;
+	for (i = 0; i < j->nstages; ++i) {
+		struct stage *st = &j->stages[i];
+		if (st->cat && !st->cat->joined && (block || st->cat->done)) {
+			cat_join(st);
+			any = 1;
+		}
+	}
+	if (any) job_check(j);
+}
+
+/*
+ * Event loop.
+ * The shell waits for its children, in-shell cats, input and deadlines on
+ * a single epoll instance:
+ * - every child started for a piped part is watched through a pidfd, which
+ *   becomes readable when it exits; it is then reaped with wait4 on its pid.
+ * - the SIGCHLD self-pipe reports children stopped or continued, which
+ *   pidfds do not, and in-shell cats which have finished.
+ * - a timerfd is armed for the nearest deadline of a piped part run under
+ *   'timeout', in the foreground or in a background job alike. At it the
+ *   child gets its signal, and SIGKILL if it outlives its grace period.
+ * - stdin, only while the shell waits for input.
+ * Children which could not get a pidfd (which needs Linux 5.3) are reaped
+ * from the self-pipe instead, as wait4(-1) reaps any child.
+ * The instance belongs to the process which made it: a forked copy of the
+ * shell makes its own, as changes to a shared one would reach the shell.
+ */
+enum {
+	EV_INPUT = 1, // stdin is readable
+	EV_JOBS = 2, // a child or in-shell cat has finished or changed state
+	EV_TIMER = 4 // a deadline has passed
+};
+
+// what an event is about, in the low bits of its data (a pid above them)
+enum {
+	EV_TAG_INPUT,
+	EV_TAG_CHLD,
+	EV_TAG_TIMER,
+	EV_TAG_PROC,
+	EV_TAG_BITS = 2
+};
+
+int ev_fd = -1;
+pid_t ev_pid; // owner of ev_fd
+int ev_timer = -1;
+double ev_when; // deadline ev_timer is armed for, or 0
+int ev_blind; // some child has no pidfd
+
+int ev_add(int fd, int tag, pid_t pid) {
+	struct epoll_event e;
+	e.events = EPOLLIN;
+	e.data.u64 = (uint64_t)pid << EV_TAG_BITS | tag;
+	return epoll_ctl(ev_fd, EPOLL_CTL_ADD, fd, &e);
+}
+
+/*
+ * Next job after j, starting from the foreground command.
+ */
+struct job *job_next(struct job *j) {
+	return j == &fg_job ? jobs : j->next;
+}
+
+/*
+ * Make the epoll instance of this process, if not done yet.
+ */
+void ev_init() {
+	pid_t pid = getpid();
+	if (ev_fd >= 0 && ev_pid == pid) return;
+	if (ev_fd >= 0) {
+		// a forked copy: the descriptors (closed by subshell_init, if it
+		// ran) and the children watched are the shell's
+		struct job *j;
+		int i;
+		for (j = &fg_job; j; j = job_next(j)) {
+			for (i = 0; i < j->nstages; ++i) {
+				j->stages[i].pidfd = -1;
+				j->stages[i].deadline = 0;
+			}
+		}
+	}
+	ev_pid = pid;
+	ev_when = 0;
+	sys_err(ev_fd = epoll_create1(EPOLL_CLOEXEC));
+	sys_err(ev_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+	sys_err(ev_add(sigchld_pipe[0], EV_TAG_CHLD, 0));
+	sys_err(ev_add(ev_timer, EV_TAG_TIMER, 0));
+}
+
+/*
+ * Watch the child of a piped part through a pidfd.
+ */
+void stage_watch(struct stage *st) {
+	ev_init();
+	int fd = syscall(SYS_pidfd_open, st->pid, 0);
+	if (fd < 0 || ev_add(fd, EV_TAG_PROC, st->pid) < 0) {
+		if (fd >= 0) close(fd);
+		ev_blind = 1;
+		return;
+	}
+	st->pidfd = fd;
+}
+
+/*
+ * Send sig to the child of a piped part: through its pidfd if it has one,
+ * which cannot reach another process.
+ */
+void stage_signal(struct stage *st, int sig) {
+	if (st->pidfd < 0 || syscall(SYS_pidfd_send_signal, st->pidfd, sig, NULL, 0) < 0) kill(st->pid, sig);
+}
+
+/*
+ * Arm the timer for the nearest deadline of a child, or disarm it.
+ */
+void ev_arm() {
+	double when = 0;
+	struct job *j;
+	int i;
+	for (j = &fg_job; j; j = job_next(j)) {
+		for (i = 0; i < j->nstages; ++i) {
+			struct stage *st = &j->stages[i];
+			if (st->deadline && st->state != STAGE_DONE && (!when || st->deadline < when)) when = st->deadline;
+		}
+	}
+	if (when == ev_when) return;
+	ev_when = when;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (when) {
+		its.it_value.tv_sec = (time_t)when;
+		its.it_value.tv_nsec = (when - (time_t)when) * 1e9;
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec) its.it_value.tv_nsec = 1;
+	}
+	sys_err(timerfd_settime(ev_timer, TFD_TIMER_ABSTIME, &its, NULL));
+}
+
+/*
+ * Signal the children whose deadline has passed: with their own signal
+ * (and SIGCONT, in case they are stopped), then with SIGKILL once their
+ * grace period is over too.
+ */
+void ev_expire() {
+	uint64_t n;
+	struct job *j;
+	int i;
+	read(ev_timer, &n, sizeof(n));
+	double now = clock_now();
+	for (j = &fg_job; j; j = job_next(j)) {
+		for (i = 0; i < j->nstages; ++i) {
+			struct stage *st = &j->stages[i];
+			if (!st->deadline || st->state == STAGE_DONE || st->deadline > now) continue;
+			if (!st->expired++) {
+				stage_signal(st, st->sig);
+				if (st->sig != SIGKILL && st->sig != SIGCONT) stage_signal(st, SIGCONT);
+				st->deadline = st->grace ? now + st->grace : 0;
+			} else {
+				stage_signal(st, SIGKILL);
+				st->deadline = 0;
+			}
+		}
+	}
+	ev_when = 0;
+	ev_arm();
+}
+
+/*
+ * Reap child pid, whose pidfd has become readable.
+ */
+void ev_reap(pid_t pid) {
+	int status;
+	struct rusage ru;
+	pid_t r = wait4(pid, &status, WNOHANG, &ru);
+	if (r > 0) {
+		job_update(pid, status, &ru);
+	} else if (r < 0) {
+		// reaped already: consider it done
+		struct job *j;
+		struct stage *st = stage_find(pid, &j);
+		if (!st) return;
+		st->state = STAGE_DONE;
+		stage_unwatch(st);
+		job_check(j);
+	}
+}
+
+/*
+ * Collect what the self-pipe announces: children stopped or continued,
+ * in-shell cats which have finished, and children without a pidfd which
+ * have exited.
+ */
+void ev_sigchld() {
+	siginfo_t si;
+	pid_t pid;
+	int status;
+	struct rusage ru;
+	struct job *j;
+	sigchld_drain();
+	while (1) {
+		si.si_pid = 0;
+		if (waitid(P_ALL, 0, &si, WSTOPPED | WCONTINUED | WNOHANG) < 0 || !si.si_pid) break;
+		job_stop(si.si_pid, si.si_code != CLD_CONTINUED);
+	}
+	if (ev_blind) {
+		while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) job_update(pid, status, &ru);
+	}
+	for (j = &fg_job; j; j = job_next(j)) job_join(j, 0);
+}
+
+/*
+ * Wait up to ms milliseconds (for ever if negative) for events, and handle
+ * them. stdin is watched too if input is set.
+ * Return the EV_* of the events, or 0 if there were none.
+ */
+#define MAX_EVENTS 16
+int ev_wait(int ms, int input) {
+	struct epoll_event evs[MAX_EVENTS];
+	int i, n, ev = 0;
+	ev_init();
+	if (input && ev_add(STDIN_FILENO, EV_TAG_INPUT, 0) < 0) {
+		// a regular file, which is always readable
+		if (errno != EPERM) sys_err(-1);
+		input = 0;
+		ev = EV_INPUT;
+		ms = 0;
+	}
+	while ((n = epoll_wait(ev_fd, evs, MAX_EVENTS, ms)) < 0) {
+		if (errno != EINTR) sys_err(-1);
+	}
+	if (input) sys_err(epoll_ctl(ev_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL));
+	for (i = 0; i < n; ++i) {
+		uint64_t data = evs[i].data.u64;
+		switch (data & ((1 << EV_TAG_BITS) - 1)) {
+		case EV_TAG_INPUT:
+			ev |= EV_INPUT;
+			break;
+		case EV_TAG_CHLD:
+			ev_sigchld();
+			ev |= EV_JOBS;
+			break;
+		case EV_TAG_TIMER:
+			ev_expire();
+			ev |= EV_TIMER;
+			break;
+		case EV_TAG_PROC:
+			ev_reap(data >> EV_TAG_BITS);
+			ev |= EV_JOBS;
+			break;
+		}
+	}
+	return ev;
+}
+#undef MAX_EVENTS
+
+/*
+ * Collect every child and in-shell cat which has finished, and signal the
+ * children past their deadline, without blocking.
+ */
+void jobs_reap() {
+	while (ev_wait(0, 0)) ;
+}
+
+/*
+ * Wait until job j is done or stopped.
+ */
+void job_wait(struct job *j) {
+	while (j->state == JOB_RUNNING) {
+		int i, procs = 0;
+		for (i = 0; i < j->nstages; ++i) {
+			if (j->stages[i].pid > 0 && j->stages[i].state == STAGE_RUNNING) ++procs;
+		}
+		if (!procs) {
+			// only in-shell parts are left
+			job_join(j, 1);
+			continue;
+		}
+		ev_wait(-1, 0);
+	}
+}
+
+/*
+ * Give the terminal to process group pgid (the shell's if 0).
+ */
+void job_tty(pid_t pgid) {
+	if (job_control) tcsetpgrp(tty_fd, pgid ? pgid : shell_pgid);
+}
+
+/*
+ * Resume job j if stopped.
+ */
+void job_continue(struct job *j) {
+	int i;
+	if (j->state != JOB_STOPPED) return;
+	for (i = 0; i < j->nstages; ++i) {
+		struct stage *st = &j->stages[i];
+		if (st->state == STAGE_STOPPED) {
+			st->state = STAGE_RUNNING;
+			if (!j->pgid) kill(st->pid, SIGCONT);
+		}
+	}
+	if (j->pgid) killpg(j->pgid, SIGCONT);
+	j->state = JOB_RUNNING;
+	j->notify = 0;
+}
+
+/*
+ * The current job (%+): the one most recently put in the background or
+ * stopped.
+ */
+struct job *job_current() {
+	struct job *j, *cur = NULL;
+	for (j = jobs; j; j = j->next) {
+		if (!cur || j->seq > cur->seq) cur = j;
+	}
+	return cur;
+}
+
+void job_print(struct job *j, FILE *f) {
+	fprintf(f, "[%d]%c  %-24s%s%s\n", j->id, j == job_current() ? '+' : ' ',
+			job_state_strs[j->state], j->cmd, j->state == JOB_RUNNING ? " &" : "");
+}
+
+/*
+ * Report jobs whose state has changed (on an interactive shell), and
+ * forget the ones which are done.
+ * Return 1 if anything was printed.
+ */
+int jobs_notify() {
+	struct job *j, *next;
+	int printed = 0;
+	for (j = jobs; j; j = next) {
+		next = j->next;
+		if (!j->notify) continue;
+		if (!interactive) {
+			// kept until 'wait' or 'jobs' reports them
+			continue;
+		}
+		j->notify = 0;
+		job_print(j, stdout);
+		printed = 1;
+		if (j->state == JOB_DONE) job_remove(j);
+	}
+	return printed;
+}
+
+/*
+ * Find a job from a job spec: %n, %+ / %% (or none) for the current job,
+ * or the process id of one of its children.
+ * Print an error and return NULL if there is no such job.
+ */
+struct job *job_find(const char *name, char *spec) {
+	struct job *j;
+	if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+		if ((j = job_current())) return j;
+		fprintf(stderr, PREF": %s: no current job\n", name);
+		return NULL;
+	}
+	if (spec[0] == '%') {
+		int id = atoi(spec + 1);
+		for (j = jobs; j; j = j->next) {
+			if (j->id == id) return j;
+		}
+	} else {
+		struct job *found;
+		if (stage_find(atoi(spec), &found) && found != &fg_job) return found;
+	}
+	fprintf(stderr, PREF": %s: %s: no such job\n", name, spec);
+	return NULL;
+}
+
+/*
+ * Put job j in the foreground, and wait for it.
+ * Return its exit status.
+ */
+int job_foreground(struct job *j) {
+	job_tty(j->pgid);
+	job_continue(j);
+	job_wait(j);
+	job_tty(0);
+	if (j->state == JOB_STOPPED) {
+		j->seq = ++job_seq;
+		j->notify = 0;
+		return 128 + SIGTSTP;
+	}
+	return job_status(j);
+}
+
+int builtin_jobs(char **argv) {
+	struct job *j, *next;
+	jobs_reap();
+	for (j = jobs; j; j = next) {
+		next = j->next;
+		job_print(j, stdout);
+		j->notify = 0;
+		if (j->state == JOB_DONE) job_remove(j);
+	}
+	return EXIT_SUCCESS;
+}
+
+int builtin_fg(char **argv) {
+	struct job *j = job_find("fg", argv[1]);
+	if (!j) return EXIT_FAILURE;
+	printf("%s\n", j->cmd);
+	fflush(stdout);
+	int status = job_foreground(j);
+	if (j->state == JOB_STOPPED) {
+		printf("\n");
+		job_print(j, stdout);
+	}
+	if (j->state == JOB_DONE) job_remove(j);
+	return status;
+}
+
+int builtin_bg(char **argv) {
+	struct job *j = job_find("bg", argv[1]);
+	if (!j) return EXIT_FAILURE;
+	job_continue(j);
+	j->seq = ++job_seq;
+	printf("[%d]+ %s &\n", j->id, j->cmd);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * wait: wait for all jobs.
+ * wait spec...: wait for the given jobs, returning the status of the last.
+ */
+int builtin_wait(char **argv) {
+	fflush(stdout);
+	struct job *j, *next;
+	int status = EXIT_SUCCESS;
+	if (!argv[1]) {
+		for (j = jobs; j; j = next) {
+			next = j->next;
+			job_wait(j);
+			if (j->state == JOB_DONE) job_remove(j);
+		}
+		return status;
+	}
+	char **p;
+	for (p = argv + 1; *p; ++p) {
+		if (!(j = job_find("wait", *p))) {
+			status = 127;
+			continue;
+		}
+		job_wait(j);
+		status = j->state == JOB_STOPPED ? 128 + SIGTSTP : job_status(j);
+		if (j->state == JOB_DONE) job_remove(j);
+	}
+	return status;
+}
+
+/*
+ * Time limit of the piped part set up by 'timeout' (see stage_limit).
+ */
+struct limit {
+	double secs; // 0 for none
+	double grace;
+	int sig;
+};
+
+struct limit part_limit;
+
+/*
+ * Parse a duration in seconds, with an optional s, m, h or d suffix.
+ * Return -1 if it is not one.
+ */
+double parse_secs(const char *s) {
+	char *end;
+	errno = 0;
+	double d = strtod(s, &end);
+	if (end == s || errno || d < 0 || d != d) return -1;
+	switch (*end) {
+	case '\0':
+	case 's':
+		break;
+	case 'm':
+		d *= 60;
+		break;
+	case 'h':
+		d *= 60 * 60;
+		break;
+	case 'd':
+		d *= 24 * 60 * 60;
+		break;
+	default:
+		return -1;
+	}
+	return *end && end[1] ? -1 : d;
+}
+
+/*
+ * Parse a signal: a number, or a name with or without SIG.
+ * Return -1 if it is not one.
+ */
+int parse_sig(const char *s) {
+	int sig;
+	if (isdigit((unsigned char)*s)) {
+		sig = atoi(s);
+		return sig > 0 && sig < NSIG ? sig : -1;
+	}
+	if (strncasecmp(s, "SIG", 3) == 0) s += 3;
+	for (sig = 1; sig < NSIG; ++sig) {
+		const char *name = sigabbrev_np(sig);
+		if (name && strcasecmp(name, s) == 0) return sig;
+	}
+	return -1;
+}
+
+/*
+ * timeout [-s signal] [-k grace] duration command [arg...]
+ * Run command as the piped part, and send it signal (TERM by default) if it
+ * is still running after duration, then SIGKILL if it is still running
+ * grace later (5s by default; 0 for never). Durations are in seconds, with
+ * an optional s, m, h or d suffix; a duration of 0 sets no limit.
+ * The deadline is kept by the shell's event loop, with no process of its
+ * own, also for a background job. The part's status is then 124, or 137
+ * after SIGKILL.
+ */
+#define GRACE 5
+int builtin_timeout(char **argv) {
+	struct limit l = { 0, GRACE, SIGTERM };
+	char **p;
+	for (p = argv + 1; *p && (*p)[0] == '-' && (*p)[1]; ++p) {
+		if (strcmp(*p, "--") == 0) {
+			++p;
+			break;
+		}
+		if (strcmp(*p, "-s") == 0 && p[1]) {
+			if ((l.sig = parse_sig(*++p)) < 0) {
+				fprintf(stderr, PREF": timeout: %s: invalid signal\n", *p);
+				return 0;
+			}
+		} else if (strcmp(*p, "-k") == 0 && p[1]) {
+			if ((l.grace = parse_secs(*++p)) < 0) {
+				fprintf(stderr, PREF": timeout: %s: invalid duration\n", *p);
+				return 0;
+			}
+		} else {
+			break;
+		}
+	}
+	if (!p[0] || !p[1]) {
+		fprintf(stderr, "usage: timeout [-s signal] [-k grace] duration command [arg...]\n");
+		return 0;
+	}
+	if ((l.secs = parse_secs(*p)) < 0) {
+		fprintf(stderr, PREF": timeout: %s: invalid duration\n", *p);
+		return 0;
+	}
+	part_limit = l;
+	return p + 1 - argv;
+}
+#undef GRACE
+
+/*
+ * Put the child of a piped part under limit l.
+ */
+void stage_limit(struct stage *st, const struct limit *l) {
+	if (!l->secs) return;
+	st->deadline = st->start + l->secs;
+	st->grace = l->grace;
+	st->sig = l->sig;
+	ev_arm();
+}
+
+/*
+ * Set up SIGCHLD handling, and job control on an interactive terminal.
+ */
+void jobs_init() {
+	job_init_stages(&fg_job);
+	fg_job.last = -1;
+
+	sys_err(pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK));
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sys_err(sigaction(SIGCHLD, &sa, NULL));
+
+	if (!interactive) return;
+	job_control = 1;
+	// wait until the shell is in the foreground
+	while (tcgetpgrp(tty_fd) != (shell_pgid = getpgrp())) kill(-shell_pgid, SIGTTIN);
+	int *sig;
+	for (sig = job_sigs; *sig; ++sig) signal(*sig, SIG_IGN);
+	// a process group of its own (fails harmlessly for a session leader)
+	setpgid(0, 0);
+	shell_pgid = getpgrp();
+	tcsetpgrp(tty_fd, shell_pgid);
+}
+
+/*
+ * Wait for input on stdin, reporting jobs as they change state.
+ */
+void wait_input() {
+	while (1) {
+		fflush(stdout);
+		int ev = ev_wait(-1, 1);
+		if (ev & EV_JOBS) {
+			struct job *j;
+			int any = 0;
+			for (j = jobs; j; j = j->next) any |= j->notify;
+			if (any) {
+				printf("\n");
+				jobs_notify();
+				print_prompt();
+			}
+		}
+		if (ev & EV_INPUT) return;
+	}
+}
+
+/*
+ * Completion.
+ * Command names come from a trie of the builtins and the executables on
+ * PATH. It is built at the first completion, and then kept up to date a
+ * directory at a time: each completion stats the directories on PATH, and
+ * rescans (see dir_scan) only those whose modification time has changed.
+ * A completion then costs a walk down the trie, whatever the number of
+ * executables.
+ * File names come from listings of directories, sorted, and cached (the
+ * CACHE_DIRS used last) until the directory changes.
+ */
+struct cmp_node {
+	uint32_t child; // first child, or 0
+	uint32_t next; // next sibling (in order of c), or 0
+	uint32_t count; // number of sources (builtins, directories) of the name ending here
+	uint32_t names; // number of names in the subtree
+	unsigned char c;
+};
+
+struct cmp_node *cmp_trie; // node 0 is the root
+size_t cmp_nodes;
+size_t cmp_cap;
+
+/*
+ * Directory on PATH, with the names it added to the trie.
+ */
+struct cmp_dir {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char *names; // '\0'-terminated names, one after the other
+	size_t len;
+	size_t cap; // of names
+};
+
+struct cmp_dir *cmp_dirs;
+size_t cmp_ndirs;
+char *cmp_pathenv; // value of PATH when the trie was built
+
+/*
+ * Listing of a directory, for file names.
+ * Directories are listed with a trailing '/'.
+ */
+struct cmp_cache {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char *blob; // the names
+	size_t cap; // of the blob
+	char **names; // sorted, those starting with '.' last
+	size_t n;
+	size_t plain; // number of names not starting with '.'
+	unsigned long used; // 0 for an empty slot
+};
+
+#define CACHE_DIRS 16
+struct cmp_cache cmp_caches[CACHE_DIRS];
+unsigned long cmp_clock;
+
+uint32_t cmp_new_node(unsigned char c) {
+	if (cmp_nodes == cmp_cap) {
+		cmp_cap = cmp_cap ? 2 * cmp_cap : 1024;
+		cmp_trie = realloc(cmp_trie, cmp_cap * sizeof(struct cmp_node));
+		if (!cmp_trie) sys_err(-1);
+	}
+	struct cmp_node *n = &cmp_trie[cmp_nodes];
+	memset(n, 0, sizeof(*n));
+	n->c = c;
+	return cmp_nodes++;
+}
+
+/*
+ * Child of node i for byte c, added if 'add'. Return 0 if there is none.
+ */
+uint32_t cmp_child(uint32_t i, unsigned char c, int add) {
+	uint32_t *link = &cmp_trie[i].child;
+	while (*link && cmp_trie[*link].c < c) link = &cmp_trie[*link].next;
+	if (*link && cmp_trie[*link].c == c) return *link;
+	if (!add) return 0;
+	uint32_t n = cmp_new_node(c); // may move the trie
+	link = &cmp_trie[i].child;
+	while (*link && cmp_trie[*link].c < c) link = &cmp_trie[*link].next;
+	cmp_trie[n].next = *link;
+	*link = n;
+	return n;
+}
+
+/*
+ * Add (delta 1) or remove (delta -1) a source of name.
+ * The nodes of removed names are left in place, with no names below them.
+ */
+void cmp_trie_add(const char *name, int delta) {
+	uint32_t path[NAME_MAX];
+	size_t depth = 0, i;
+	uint32_t n = 0;
+	for ( ; *name && depth < NAME_MAX; ++name) {
+		path[depth++] = n;
+		if (!(n = cmp_child(n, *name, delta > 0))) return;
+	}
+	uint32_t old = cmp_trie[n].count;
+	if (delta < 0 && !old) return;
+	cmp_trie[n].count += delta;
+	if ((old == 0) == (cmp_trie[n].count == 0)) return;
+	cmp_trie[n].names += delta;
+	for (i = 0; i < depth; ++i) cmp_trie[path[i]].names += delta;
+}
+
+struct cmp_dir *cmp_scanning;
+
+void cmp_add_exec(int dfd, const char *name, int type) {
+	struct stat st;
+	if (type == DT_DIR) return;
+	if (type != DT_REG && (fstatat(dfd, name, &st, 0) < 0 || !S_ISREG(st.st_mode))) return;
+	if (faccessat(dfd, name, X_OK, 0) < 0) return;
+	struct cmp_dir *d = cmp_scanning;
+	size_t len = strlen(name) + 1;
+	if (d->len + len > d->cap) {
+		while (d->len + len > d->cap) d->cap = d->cap ? 2 * d->cap : 4096;
+		if (!(d->names = realloc(d->names, d->cap))) sys_err(-1);
+	}
+	memcpy(d->names + d->len, name, len);
+	d->len += len;
+	cmp_trie_add(name, 1);
+}
+
+/*
+ * Rescan a directory on PATH if it has changed (or gone).
+ */
+void cmp_dir_check(struct cmp_dir *d) {
+	struct stat st;
+	int ok = stat(d->path, &st) == 0 && S_ISDIR(st.st_mode);
+	if (ok && st.st_dev == d->dev && st.st_ino == d->ino
+			&& st.st_mtim.tv_sec == d->mtime.tv_sec && st.st_mtim.tv_nsec == d->mtime.tv_nsec)
+		return;
+	size_t off;
+	for (off = 0; off < d->len; off += strlen(d->names + off) + 1) cmp_trie_add(d->names + off, -1);
+	d->len = 0;
+	d->dev = 0;
+	d->ino = 0;
+	if (!ok) return;
+	int dfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) return;
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
+	d->mtime = st.st_mtim;
+	cmp_scanning = d;
+	dir_scan(dfd, cmp_add_exec);
+	close(dfd);
+}
+
+/*
+ * Bring the trie up to date with PATH, building it afresh if PATH has
+ * changed.
+ */
+void cmp_path_check() {
+	char *pathenv = var_get("PATH");
+	if (!pathenv) pathenv = "";
+	if (!cmp_pathenv || strcmp(cmp_pathenv, pathenv) != 0) {
+		size_t i;
+		for (i = 0; i < cmp_ndirs; ++i) {
+			free(cmp_dirs[i].path);
+			free(cmp_dirs[i].names);
+		}
+		free(cmp_dirs);
+		free(cmp_pathenv);
+		if (!(cmp_pathenv = strdup(pathenv))) sys_err(-1);
+		cmp_nodes = 0;
+		cmp_new_node(0);
+		struct builtin *b;
+		for (b = builtins; b->name; ++b) cmp_trie_add(b->name, 1);
+
+		cmp_ndirs = 1;
+		char *p;
+		for (p = pathenv; *p; ++p) cmp_ndirs += *p == ':';
+		if (!(cmp_dirs = calloc(cmp_ndirs, sizeof(struct cmp_dir)))) sys_err(-1);
+		char *dir = pathenv;
+		for (i = 0; i < cmp_ndirs; ++i) {
+			char *end = strchrnul(dir, ':');
+			// an empty entry means the current directory
+			cmp_dirs[i].path = end == dir ? strdup(".") : strndup(dir, end - dir);
+			if (!cmp_dirs[i].path) sys_err(-1);
+			dir = end + 1;
+		}
+	}
+	size_t i;
+	for (i = 0; i < cmp_ndirs; ++i) cmp_dir_check(&cmp_dirs[i]);
+}
+
+/*
+ * Node of the trie for prefix, or 0 if there is none (the root has no
+ * parent, so 0 is never a child).
+ */
+uint32_t cmp_find(const char *prefix, size_t plen) {
+	uint32_t n = 0;
+	size_t i;
+	if (plen > NAME_MAX) return 0;
+	for (i = 0; i < plen; ++i) {
+		if (!(n = cmp_child(n, prefix[i], 0))) return 0;
+	}
+	return n;
+}
+
+/*
+ * Complete a command name.
+ * Set ext (of NAME_MAX + 1 bytes) to what all the names starting with
+ * prefix have in common after it, and return their number.
+ */
+size_t cmp_command(const char *prefix, size_t plen, char *ext, size_t *elenp) {
+	cmp_path_check();
+	*elenp = 0;
+	uint32_t n = cmp_find(prefix, plen);
+	if (plen && !n) return 0;
+	size_t count = cmp_trie[n].names;
+	if (!count) return 0;
+	while (!cmp_trie[n].count) {
+		// a single child with names below it is the only way on
+		uint32_t c, only = 0;
+		for (c = cmp_trie[n].child; c; c = cmp_trie[c].next) {
+			if (!cmp_trie[c].names) continue;
+			if (only) return count;
+			only = c;
+		}
+		n = only;
+		ext[(*elenp)++] = cmp_trie[n].c;
+	}
+	return count;
+}
+
+/*
+ * Names in the subtree of node n, whose common prefix of length len is in
+ * buf, appended to v in order.
+ */
+void cmp_collect(uint32_t n, char *buf, size_t len, char **v, size_t *np) {
+	if (cmp_trie[n].count) {
+		char *name = arena_alloc(len + 1);
+		memcpy(name, buf, len);
+		name[len] = '\0';
+		v[(*np)++] = name;
+	}
+	uint32_t c;
+	for (c = cmp_trie[n].child; c; c = cmp_trie[c].next) {
+		if (!cmp_trie[c].names) continue;
+		buf[len] = cmp_trie[c].c;
+		cmp_collect(c, buf, len + 1, v, np);
+	}
+}
+
+/*
+ * Command names starting with prefix, in order; their number is in *np.
+ */
+char **cmp_commands(const char *prefix, size_t plen, size_t *np) {
+	char buf[NAME_MAX + 1];
+	*np = 0;
+	uint32_t n = cmp_find(prefix, plen);
+	if (plen && !n) return NULL;
+	char **v = arena_alloc(cmp_trie[n].names * sizeof(char *));
+	memcpy(buf, prefix, plen);
+	cmp_collect(n, buf, plen, v, np);
+	return v;
+}
+
+struct cmp_cache *cmp_filling;
+size_t cmp_fill_len; // of the blob being filled
+
+void cmp_add_file(int dfd, const char *name, int type) {
+	struct stat st;
+	int dir = type == DT_DIR
+		|| ((type == DT_LNK || type == DT_UNKNOWN) && fstatat(dfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+	struct cmp_cache *c = cmp_filling;
+	size_t len = strlen(name);
+	if (c->n % 64 == 0 && !(c->names = realloc(c->names, (c->n + 64) * sizeof(char *)))) sys_err(-1);
+	if (cmp_fill_len + len + 2 > c->cap) {
+		while (cmp_fill_len + len + 2 > c->cap) c->cap = c->cap ? 2 * c->cap : 4096;
+		if (!(c->blob = realloc(c->blob, c->cap))) sys_err(-1);
+	}
+	char *p = c->blob + cmp_fill_len;
+	memcpy(p, name, len);
+	if (dir) p[len++] = '/';
+	p[len] = '\0';
+	// an offset until the blob stops moving
+	c->names[c->n++] = (char *)cmp_fill_len;
+	cmp_fill_len += len + 1;
+}
+
+/*
+ * Names starting with '.' go last, so that the others are together.
+ */
+int cmp_namecmp(const void *a, const void *b) {
+	const char *x = *(char **)a, *y = *(char **)b;
+	if ((x[0] == '.') != (y[0] == '.')) return x[0] == '.' ? 1 : -1;
+	return strcmp(x, y);
+}
+
+/*
+ * Listing of directory dir, from the cache if it has not changed since.
+ * Return NULL if it cannot be read.
+ */
+struct cmp_cache *cmp_listing(const char *dir) {
+	struct stat st;
+	if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+	struct cmp_cache *c, *lru = cmp_caches;
+	for (c = cmp_caches; c < cmp_caches + CACHE_DIRS; ++c) {
+		if (c->used && c->dev == st.st_dev && c->ino == st.st_ino) break;
+		if (c->used < lru->used) lru = c;
+	}
+	if (c == cmp_caches + CACHE_DIRS) {
+		c = lru;
+	} else if (st.st_mtim.tv_sec == c->mtime.tv_sec && st.st_mtim.tv_nsec == c->mtime.tv_nsec) {
+		c->used = ++cmp_clock;
+		return c;
+	}
+	c->used = 0;
+	int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) return NULL;
+	c->n = 0;
+	cmp_filling = c;
+	cmp_fill_len = 0;
+	dir_scan(dfd, cmp_add_file);
+	close(dfd);
+	size_t i;
+	for (i = 0; i < c->n; ++i) c->names[i] = c->blob + (size_t)c->names[i];
+	qsort(c->names, c->n, sizeof(char *), cmp_namecmp);
+	for (c->plain = 0; c->plain < c->n && c->names[c->plain][0] != '.'; ++c->plain);
+	c->dev = st.st_dev;
+	c->ino = st.st_ino;
+	c->mtime = st.st_mtim;
+	c->used = ++cmp_clock;
+	return c;
+}
+
+/*
+ * Complete a file name in directory dir.
+ * Set ext (of NAME_MAX + 2 bytes) to what all the names starting with
+ * prefix have in common after it, and *vp to the names; return their
+ * number.
+ * Names starting with '.' are only completed from a prefix starting with '.'.
+ */
+size_t cmp_file(const char *dir, const char *prefix, size_t plen, char *ext, size_t *elenp, char ***vp) {
+	*elenp = 0;
+	struct cmp_cache *c = cmp_listing(dir);
+	if (!c) return 0;
+	size_t lo = 0, hi = c->plain;
+	if (plen && prefix[0] == '.') {
+		lo = c->plain;
+		hi = c->n;
+	}
+	// first name not before prefix, then the first after those starting with it
+	size_t end = hi;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (strncmp(c->names[mid], prefix, plen) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	for (hi = lo; hi < end && strncmp(c->names[hi], prefix, plen) == 0; ++hi);
+	*vp = c->names + lo;
+	if (lo == hi) return 0;
+	// the names are sorted, so the first and last have the least in common
+	const char *first = c->names[lo] + plen, *last = c->names[hi - 1] + plen;
+	while (first[*elenp] && first[*elenp] == last[*elenp]) ++*elenp;
+	memcpy(ext, first, *elenp);
+	return hi - lo;
+}
+#undef CACHE_DIRS
+
+/*
+ * Line editor.
+ * On a terminal, lines are read with the terminal in raw mode and edited in
+ * place:
+ * - ^A / Home, ^E / End, ^B / Left, ^F / Right, M-b / M-f: move
+ * - ^H / Backspace, ^D / Delete: delete a character (^D on an empty line
+ *   ends the input)
+ * - ^K, ^U, ^W / M-Backspace, M-d: kill to the end, to the start, the word
+ *   before, the word after; ^Y: yank the text killed last
+ * - ^P / Up, ^N / Down: previous / next history entry
+ * - ^R: search the history backwards, incrementally (^G cancels)
+ * - Tab: complete a command or file name (see Completion)
+ * - ^C: discard the line; ^L: clear the screen
+ * The line is shown after the prompt as cells (a character, or ^X for a
+ * control character), wrapped at the terminal width. Each frame is diffed
+ * against the cells on the screen, and only the cells which changed are
+ * written, with the cursor movements, in a single write.
+ * Input is read a byte at a time, so that what is typed ahead of a command
+ * is left to it, but a frame is only drawn once no more input is waiting:
+ * a pasted line is drawn in a few frames, each writing only what was added.
+ */
+struct ed_str {
+	char *s;
+	size_t len;
+	size_t cap;
+};
+
+int ed_on; // the editor is used
+struct termios ed_cooked; // terminal mode outside the editor
+
+struct ed_str ed_line; // line being edited
+size_t ed_pos; // cursor, as a byte offset in the line
+size_t ed_dirty; // first byte changed since the last frame
+struct ed_str ed_yank; // text killed last
+struct ed_str ed_save; // line being edited, while in the history
+
+size_t ed_hend; // number of history entries when the line was started
+size_t ed_hpos; // history entry shown (ed_hend for the edited line)
+int ed_srch; // searching the history
+int ed_failed; // the search failed
+struct ed_str ed_query; // search string
+struct ed_str ed_orig; // line before the search
+
+const char *ed_ps; // prompt of the line being read
+const char *ed_prompt; // prompt shown (ed_ps, or that of a search)
+size_t ed_pw; // width of the prompt
+uint32_t *ed_img; // cells of the line (the UTF-8 bytes of a character)
+uint32_t *ed_scr; // cells on the screen
+size_t ed_imglen;
+size_t ed_scrlen;
+size_t *ed_cellof; // cell of each byte of the line (and its end)
+size_t ed_cellcap; // line length the cell arrays have room for
+size_t ed_at; // cell of the terminal cursor, counting the prompt's
+int ed_cols; // terminal width
+int ed_fresh; // the prompt has to be drawn, ED_INPLACE or ED_NEWLINE
+struct ed_str ed_out; // frame being built
+
+size_t ed_avail; // input bytes known to be waiting
+int ed_back = -1; // byte pushed back
+
+enum {
+	ED_INPLACE = 1, // over the line on the screen
+	ED_NEWLINE // on a line of its own, wherever the cursor is
+};
+
+/* keys other than bytes (CTRL(c) is from termios) */
+enum {
+	KEY_UP = 0x100,
+	KEY_DOWN,
+	KEY_LEFT,
+	KEY_RIGHT,
+	KEY_HOME,
+	KEY_END,
+	KEY_DEL,
+	KEY_WLEFT,
+	KEY_WRIGHT,
+	KEY_WKILL,
+	KEY_WRUBOUT,
+	KEY_NONE
+};
+
+#define ED_EOF (-2)
+#define ESC_MS 50 // wait for the rest of an escape sequence
+#define SRCH_PROMPT "(reverse-i-search)`"
+#define FAIL_PROMPT "(failed reverse-i-search)`"
+
+void ed_reserve(struct ed_str *d, size_t n) {
+	if (n <= d->cap) return;
+	if (!d->cap) d->cap = 64;
+	while (d->cap < n) d->cap *= 2;
+	if (!(d->s = realloc(d->s, d->cap))) sys_err(-1);
+}
+
+void ed_set(struct ed_str *d, const char *s, size_t n) {
+	ed_reserve(d, n + 1);
+	memmove(d->s, s, n);
+	d->len = n;
+}
+
+void ed_put(const char *s, size_t n) {
+	ed_reserve(&ed_out, ed_out.len + n);
+	memcpy(ed_out.s + ed_out.len, s, n);
+	ed_out.len += n;
+}
+
+#define BUFSIZE 32
+void ed_putf(const char *fmt, ...) {
+	char buf[BUFSIZE];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, BUFSIZE, fmt, ap);
+	va_end(ap);
+	ed_put(buf, n);
+}
+#undef BUFSIZE
+
+/*
+ * Write the frame built so far.
+ */
+void ed_flush() {
+	size_t off = 0;
+	while (off < ed_out.len) {
+		ssize_t n = write(STDOUT_FILENO, ed_out.s + off, ed_out.len - off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) break; // terminal gone; the read will notice
+		off += n;
+	}
+	ed_out.len = 0;
+}
+
+void ed_raw() {
+	struct termios t = ed_cooked;
+	t.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	t.c_oflag &= ~OPOST;
+	t.c_cflag |= CS8;
+	t.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &t);
+}
+
+void ed_cook() {
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &ed_cooked);
+}
+
+/*
+ * Use the editor if stdout is the terminal too, and it is not dumb.
+ */
+void ed_init() {
+	char *term = var_get("TERM");
+	ed_on = isatty(STDOUT_FILENO) && !(term && strcmp(term, "dumb") == 0)
+		&& tcgetattr(STDIN_FILENO, &ed_cooked) == 0;
+}
+
+/*
+ * Number of columns taken by s: escape sequences take none, and a UTF-8
+ * character one.
+ */
+size_t ed_width(const char *s) {
+	size_t w = 0;
+	for ( ; *s; ++s) {
+		if (*s == '\033') {
+			while (s[1] && !isalpha((unsigned char)s[1])) ++s;
+			if (s[1]) ++s;
+		} else if (((unsigned char)*s & 0xc0) != 0x80) {
+			++w;
+		}
+	}
+	return w;
+}
+
+/*
+ * Make room in the cell arrays for the line.
+ * A byte takes at most two cells.
+ */
+void ed_fit() {
+	if (ed_cellcap >= ed_line.cap) return;
+	ed_cellcap = ed_line.cap;
+	ed_cellof = realloc(ed_cellof, (ed_cellcap + 1) * sizeof(size_t));
+	ed_img = realloc(ed_img, 2 * ed_cellcap * sizeof(uint32_t));
+	ed_scr = realloc(ed_scr, 2 * ed_cellcap * sizeof(uint32_t));
+	if (!ed_cellof || !ed_img || !ed_scr) sys_err(-1);
+}
+
+/*
+ * Move the terminal cursor to cell 'to'.
+ */
+void ed_move(size_t to) {
+	long dr = (long)(to / ed_cols) - (long)(ed_at / ed_cols);
+	long dc = (long)(to % ed_cols) - (long)(ed_at % ed_cols);
+	if (dr < 0) ed_putf("\033[%ldA", -dr);
+	else if (dr > 0) ed_putf("\033[%ldB", dr);
+	if (dc < 0) ed_putf("\033[%ldD", -dc);
+	else if (dc > 0) ed_putf("\033[%ldC", dc);
+	ed_at = to;
+}
+
+/*
+ * The cursor has moved right by n cells.
+ * At the end of a row, go to the start of the next one explicitly, so that
+ * the cursor is never left pending a wrap.
+ */
+void ed_advance(size_t n) {
+	size_t row = ed_at / ed_cols;
+	ed_at += n;
+	if (ed_at / ed_cols != row && ed_at % ed_cols == 0) ed_put("\r\n", 2);
+}
+
+void ed_putcell(uint32_t cell) {
+	char b[4];
+	int n = 0;
+	do b[n++] = cell & 0xff; while ((cell >>= 8) && n < 4);
+	ed_put(b, n);
+	ed_advance(1);
+}
+
+/*
+ * Turn the line from byte ed_dirty on into cells.
+ * Return the first cell laid out.
+ */
+size_t ed_layout() {
+	size_t b = ed_dirty, len = ed_line.len;
+	unsigned char *s = (unsigned char *)ed_line.s;
+	while (b > 0 && b < len && (s[b] & 0xc0) == 0x80) --b;
+	size_t first = ed_cellof[b], c = first;
+	while (b < len) {
+		unsigned char ch = s[b];
+		ed_cellof[b] = c;
+		if (ch < 0x20 || ch == 0x7f) {
+			ed_img[c++] = '^';
+			ed_img[c++] = ch ^ 0x40;
+			++b;
+			continue;
+		}
+		size_t n = ch >= 0xf0 ? 4 : ch >= 0xe0 ? 3 : ch >= 0xc0 ? 2 : 1;
+		uint32_t cell = ch;
+		size_t k;
+		for (k = 1; k < n && b + k < len && (s[b+k] & 0xc0) == 0x80; ++k) {
+			cell |= (uint32_t)s[b+k] << (8 * k);
+			ed_cellof[b+k] = c;
+		}
+		ed_img[c++] = cell;
+		b += k;
+	}
+	ed_cellof[len] = c;
+	ed_imglen = c;
+	return first;
+}
+
+/*
+ * Draw a frame: write the cells which differ from the screen, then put the
+ * cursor in place.
+ * Runs of changed cells are joined across a few unchanged ones, which are
+ * cheaper to rewrite than to skip.
+ */
+#define GAP 8
+void ed_render() {
+	struct winsize ws;
+	int cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col ? ws.ws_col : 80;
+	if (cols != ed_cols) {
+		// the terminal has rewrapped the line: start over below it
+		if (ed_cols && !ed_fresh) ed_fresh = ED_NEWLINE;
+		ed_cols = cols;
+	}
+	if (ed_fresh) {
+		if (ed_fresh == ED_NEWLINE) {
+			// a partial line of output is marked and kept
+			ed_put("\033[7m%\033[0m", 9);
+			ed_reserve(&ed_out, ed_out.len + ed_cols);
+			memset(ed_out.s + ed_out.len, ' ', ed_cols - 1);
+			ed_out.len += ed_cols - 1;
+			ed_put("\r", 1);
+			ed_at = 0;
+		} else {
+			ed_move(0);
+		}
+		ed_put(ed_prompt, strlen(ed_prompt));
+		ed_put("\033[J", 3);
+		ed_advance(ed_pw);
+		ed_scrlen = 0;
+		ed_dirty = 0;
+		ed_fresh = 0;
+	}
+
+	size_t from = ed_layout(), i = from;
+	while (i < ed_imglen) {
+		if (i < ed_scrlen && ed_img[i] == ed_scr[i]) {
+			++i;
+			continue;
+		}
+		ed_move(ed_pw + i);
+		size_t j = i;
+		while (j < ed_imglen) {
+			if (j < ed_scrlen && ed_img[j] == ed_scr[j]) {
+				size_t k = j;
+				while (k < ed_imglen && k < ed_scrlen && ed_img[k] == ed_scr[k] && k - j < GAP) ++k;
+				if (k - j >= GAP || k == ed_imglen) break;
+				j = k;
+			}
+			ed_putcell(ed_img[j++]);
+		}
+		i = j;
+	}
+	if (ed_scrlen > ed_imglen) {
+		ed_move(ed_pw + ed_imglen);
+		ed_put("\033[J", 3);
+	}
+	if (ed_imglen > from) memcpy(ed_scr + from, ed_img + from, (ed_imglen - from) * sizeof(uint32_t));
+	ed_scrlen = ed_imglen;
+	ed_move(ed_pw + ed_cellof[ed_pos]);
+	ed_flush();
+	ed_dirty = ed_line.len;
+}
+#undef GAP
+
+/*
+ * Report jobs which changed state, below the line, then draw it again.
+ */
+void ed_jobs() {
+	jobs_reap();
+	struct job *j;
+	int any = 0;
+	for (j = jobs; j; j = j->next) any |= j->notify;
+	if (!any) return;
+	ed_move(ed_pw + ed_imglen);
+	ed_put("\r\n", 2);
+	ed_flush();
+	ed_cook();
+	jobs_notify();
+	fflush(stdout);
+	ed_raw();
+	ed_at = 0;
+	ed_fresh = ED_INPLACE;
+}
+
+/*
+ * Next byte of input.
+ * If none is waiting, draw a frame first (unless ms >= 0), then wait for
+ * one, at most ms milliseconds if ms >= 0, reporting jobs meanwhile.
+ * Return -1 on timeout, ED_EOF at end of input.
+ */
+int ed_getc(int ms) {
+	unsigned char c;
+	if (ed_back >= 0) {
+		c = ed_back;
+		ed_back = -1;
+		return c;
+	}
+	while (!ed_avail) {
+		int n;
+		if (ioctl(STDIN_FILENO, FIONREAD, &n) == 0 && n > 0) {
+			ed_avail = n;
+			break;
+		}
+		if (ms < 0) ed_render();
+		int ev = ev_wait(ms, 1);
+		if (!ev) return -1;
+		if (ev & EV_JOBS) ed_jobs();
+		if (ev & EV_INPUT) ed_avail = 1; // or end of input, as read will tell
+	}
+	ssize_t r;
+	while ((r = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR);
+	if (r <= 0) {
+		ed_avail = 0;
+		return ED_EOF;
+	}
+	--ed_avail;
+	return c;
+}
+
+/*
+ * Next key: a byte, or one of KEY_* for an escape sequence.
+ */
+#define BUFSIZE 16
+int ed_key() {
+	int c = ed_getc(-1);
+	if (c != '\033') return c;
+	if ((c = ed_getc(ESC_MS)) < 0) return KEY_NONE;
+	if (c == 'b') return KEY_WLEFT;
+	if (c == 'f') return KEY_WRIGHT;
+	if (c == 'd') return KEY_WKILL;
+	if (c == 0x7f || c == CTRL('H')) return KEY_WRUBOUT;
+	if (c != '[' && c != 'O') return KEY_NONE;
+
+	// parameter bytes, then the final byte
+	char par[BUFSIZE];
+	size_t n = 0;
+	while ((c = ed_getc(ESC_MS)) >= 0x20 && c < 0x40) {
+		if (n < BUFSIZE - 1) par[n++] = c;
+	}
+	par[n] = '\0';
+	if (c < 0) return KEY_NONE;
+	int ctl = strcmp(par, "1;5") == 0; // with Ctrl
+	switch (c) {
+	case 'A': return KEY_UP;
+	case 'B': return KEY_DOWN;
+	case 'C': return ctl ? KEY_WRIGHT : KEY_RIGHT;
+	case 'D': return ctl ? KEY_WLEFT : KEY_LEFT;
+	case 'H': return KEY_HOME;
+	case 'F': return KEY_END;
+	case '~':
+		switch (atoi(par)) {
+		case 1: case 7: return KEY_HOME;
+		case 4: case 8: return KEY_END;
+		case 3: return KEY_DEL;
+		}
+	}
+	return KEY_NONE;
+}
+#undef BUFSIZE
+
+/*
+ * Replace bytes [from, to) of the line with s[0..n).
+ */
+void ed_replace(size_t from, size_t to, const char *s, size_t n) {
+	ed_reserve(&ed_line, ed_line.len - (to - from) + n + 1);
+	ed_fit();
+	memmove(ed_line.s + from + n, ed_line.s + to, ed_line.len - to);
+	memcpy(ed_line.s + from, s, n);
+	ed_line.len = ed_line.len - (to - from) + n;
+	if (from < ed_dirty) ed_dirty = from;
+}
+
+void ed_insert(const char *s, size_t n) {
+	ed_replace(ed_pos, ed_pos, s, n);
+	ed_pos += n;
+}
+
+void ed_kill(size_t from, size_t to) {
+	if (from >= to) return;
+	ed_set(&ed_yank, ed_line.s + from, to - from);
+	ed_replace(from, to, "", 0);
+	ed_pos = from;
+}
+
+/*
+ * Show s instead of the line, with the cursor at byte pos.
+ * Only what follows the common prefix is replaced.
+ */
+void ed_load(const char *s, size_t n, size_t pos) {
+	size_t p = 0;
+	while (p < n && p < ed_line.len && s[p] == ed_line.s[p]) ++p;
+	ed_replace(p, ed_line.len, s + p, n - p);
+	ed_pos = pos;
+}
+
+void ed_load_hist(size_t i, size_t pos) {
+	size_t len;
+	const char *line = hist_get(i, &len);
+	if (!line) return;
+	ed_load(line, len, pos <= len ? pos : len);
+}
+
+size_t ed_prev(size_t i) {
+	if (i) --i;
+	while (i && (ed_line.s[i] & 0xc0) == 0x80) --i;
+	return i;
+}
+
+size_t ed_next(size_t i) {
+	if (i < ed_line.len) ++i;
+	while (i < ed_line.len && (ed_line.s[i] & 0xc0) == 0x80) ++i;
+	return i;
+}
+
+int ed_isword(unsigned char c) {
+	return isalnum(c) || c >= 0x80;
+}
+
+/*
+ * Start of the word before byte i (words of letters and digits for M-b,
+ * of non-blanks for ^W).
+ */
+size_t ed_wstart(size_t i, int blank) {
+	char *s = ed_line.s;
+	while (i && (blank ? isblank((unsigned char)s[i-1]) : !ed_isword(s[i-1]))) --i;
+	while (i && (blank ? !isblank((unsigned char)s[i-1]) : ed_isword(s[i-1]))) --i;
+	return i;
+}
+
+size_t ed_wend(size_t i) {
+	char *s = ed_line.s;
+	while (i < ed_line.len && !ed_isword(s[i])) ++i;
+	while (i < ed_line.len && ed_isword(s[i])) ++i;
+	return i;
+}
+
+/*
+ * Show history entry i, or the edited line if i is ed_hend.
+ */
+void ed_history(size_t i) {
+	if (ed_hpos == ed_hend) ed_set(&ed_save, ed_line.s, ed_line.len);
+	ed_hpos = i;
+	if (i == ed_hend) ed_load(ed_save.s, ed_save.len, ed_save.len);
+	else ed_load_hist(i, SIZE_MAX);
+}
+
+/*
+ * Prompt of the history search.
+ */
+void ed_search_prompt() {
+	static struct ed_str prompt;
+	const char *head = ed_failed ? FAIL_PROMPT : SRCH_PROMPT;
+	size_t hlen = strlen(head);
+	ed_reserve(&prompt, hlen + ed_query.len + 4);
+	memcpy(prompt.s, head, hlen);
+	memcpy(prompt.s + hlen, ed_query.s, ed_query.len);
+	strcpy(prompt.s + hlen + ed_query.len, "': ");
+	ed_prompt = prompt.s;
+	ed_pw = ed_width(ed_prompt);
+	ed_fresh = ED_INPLACE;
+}
+
+/*
+ * Search for the query in the entries before 'from', and show the newest
+ * match.
+ */
+void ed_search(size_t from) {
+	ed_query.s[ed_query.len] = '\0';
+	long i = ed_query.len ? hist_find_sub(ed_query.s, ed_query.len, from) : -1;
+	ed_failed = ed_query.len && i < 0;
+	if (i >= 0) {
+		size_t len;
+		const char *line = hist_get(i, &len);
+		ed_hpos = i;
+		ed_load_hist(i, (char *)memmem(line, len, ed_query.s, ed_query.len) - line);
+	}
+	ed_search_prompt();
+}
+
+void ed_search_end() {
+	ed_srch = 0;
+	ed_prompt = ed_ps;
+	ed_pw = ed_width(ed_prompt);
+	ed_fresh = ED_INPLACE;
+}
+
+/*
+ * Handle a key while searching.
+ * Return 0 if the search is over and the key is still to be handled.
+ */
+int ed_search_key(int c) {
+	if (c == CTRL('R')) {
+		ed_search(ed_hpos);
+	} else if (c == CTRL('G')) {
+		ed_hpos = ed_hend;
+		ed_load(ed_orig.s, ed_orig.len, ed_orig.len);
+		ed_search_end();
+	} else if (c == 0x7f || c == CTRL('H')) {
+		if (ed_query.len) --ed_query.len;
+		ed_search(ed_hend);
+	} else if (c >= 0x20 && c < 0x100) {
+		ed_reserve(&ed_query, ed_query.len + 2);
+		ed_query.s[ed_query.len++] = c;
+		// the shown entry may still match
+		ed_search(ed_hpos < ed_hend ? ed_hpos + 1 : ed_hend);
+	} else {
+		ed_search_end();
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * List the candidates of a completion below the line, in columns.
+ */
+#define ASK 100 // ask first if there are more candidates
+#define BUFSIZE 64
+void ed_list(char **v, size_t n) {
+	char buf[BUFSIZE];
+	ed_move(ed_pw + ed_imglen);
+	ed_put("\r\n", 2);
+	ed_at = 0;
+	ed_fresh = ED_INPLACE;
+	if (n > ASK) {
+		ed_put(buf, snprintf(buf, BUFSIZE, "Display all %zu possibilities? (y or n)", n));
+		ed_flush();
+		int c;
+		while ((c = ed_getc(1000)) == -1);
+		ed_put("\r\n", 2);
+		if (c != 'y' && c != 'Y') return;
+	}
+	size_t i, width = 0;
+	for (i = 0; i < n; ++i) {
+		size_t len = strlen(v[i]);
+		if (len > width) width = len;
+	}
+	width += 2;
+	size_t ncols = ed_cols / width ? ed_cols / width : 1;
+	size_t rows = (n + ncols - 1) / ncols, r, c;
+	for (r = 0; r < rows; ++r) {
+		for (c = 0; c < ncols && c * rows + r < n; ++c) {
+			const char *name = v[c * rows + r];
+			size_t len = strlen(name);
+			ed_put(name, len);
+			if (c + 1 < ncols && (c + 1) * rows + r < n) {
+				while (len++ < width) ed_put(" ", 1);
+			}
+		}
+		ed_put("\r\n", 2);
+	}
+}
+#undef ASK
+#undef BUFSIZE
+
+/*
+ * Byte i of the line ends a word (unless escaped).
+ */
+int ed_isbreak(size_t i) {
+	char c = ed_line.s[i];
+	if (c != ' ' && c != '\t' && c != '|' && c != '<' && c != '>' && c != '&') return 0;
+	return !(i > 0 && ed_line.s[i-1] == '\\');
+}
+
+/*
+ * Complete the word before the cursor: a command name if it is the first
+ * word of a command and has no '/', else a file name.
+ * What the candidates have in common is inserted (escaped), and a single
+ * candidate is followed by a ' ' unless it is a directory. With nothing to
+ * insert, a second Tab in a row lists the candidates.
+ */
+void ed_complete(int again) {
+	size_t start = ed_pos, i;
+	while (start > 0 && !ed_isbreak(start - 1)) --start;
+	char *word = arena_alloc(ed_pos - start + 1);
+	size_t wlen = 0;
+	for (i = start; i < ed_pos; ++i) {
+		char c = ed_line.s[i];
+		if (c == '\'' || c == '"') continue;
+		if (c == '\\' && i + 1 < ed_pos) c = ed_line.s[++i];
+		word[wlen++] = c;
+	}
+	word[wlen] = '\0';
+	size_t b = start;
+	while (b > 0 && isblank((unsigned char)ed_line.s[b-1])) --b;
+	int cmd = (b == 0 || ed_line.s[b-1] == '|') && !memchr(word, '/', wlen);
+
+	char ext[NAME_MAX + 2];
+	size_t elen, n;
+	char **v = NULL;
+	if (cmd) {
+		n = cmp_command(word, wlen, ext, &elen);
+	} else {
+		char *base = word, *dir = ".", *slash = strrchr(word, '/');
+		if (slash) {
+			*slash = '\0';
+			dir = *word ? word : "/";
+			base = slash + 1;
+		}
+		n = cmp_file(dir, base, word + wlen - base, ext, &elen, &v);
+	}
+	if (!n) {
+		ed_put("\a", 1);
+		return;
+	}
+
+	char esc[2 * sizeof(ext)];
+	size_t elen2 = 0;
+	for (i = 0; i < elen; ++i) {
+		if (strchr(" \t'\"\\|<>&", ext[i])) esc[elen2++] = '\\';
+		esc[elen2++] = ext[i];
+	}
+	if (n == 1) {
+		const char *name = cmd ? "" : v[0];
+		if (!*name || name[strlen(name) - 1] != '/') esc[elen2++] = ' ';
+	}
+	if (elen2) {
+		ed_insert(esc, elen2);
+	} else if (!again) {
+		ed_put("\a", 1);
+	} else {
+		if (cmd) v = cmp_commands(word, wlen, &n);
+		ed_list(v, n);
+	}
+}
+
+/*
+ * Read a line with the editor, after prompt.
+ * The line is valid until the next call.
+ * Return NULL at end of input.
+ */
+#define BUFSIZE 256
+char *ed_read(const char *prompt) {
+	fflush(stdout);
+	if (tcgetattr(STDIN_FILENO, &ed_cooked) < 0) sys_err(-1);
+	ed_raw();
+	hist_sync();
+	ed_hend = ed_hpos = idx_cnt;
+	ed_line.len = ed_pos = ed_dirty = 0;
+	ed_reserve(&ed_line, 1);
+	ed_fit();
+	ed_cellof[0] = 0;
+	ed_prompt = ed_ps = prompt;
+	ed_pw = ed_width(ed_prompt);
+	ed_fresh = ED_NEWLINE;
+
+	int done = 0, eof = 0, c = 0, last;
+	while (!done) {
+		last = c;
+		c = ed_key();
+		if (ed_srch && ed_search_key(c)) continue;
+		switch (c) {
+		case ED_EOF:
+			done = eof = 1;
+			break;
+		case '\r':
+		case '\n':
+			done = 1;
+			break;
+		case CTRL('A'):
+		case KEY_HOME:
+			ed_pos = 0;
+			break;
+		case CTRL('E'):
+		case KEY_END:
+			ed_pos = ed_line.len;
+			break;
+		case CTRL('B'):
+		case KEY_LEFT:
+			ed_pos = ed_prev(ed_pos);
+			break;
+		case CTRL('F'):
+		case KEY_RIGHT:
+			ed_pos = ed_next(ed_pos);
+			break;
+		case KEY_WLEFT:
+			ed_pos = ed_wstart(ed_pos, 0);
+			break;
+		case KEY_WRIGHT:
+			ed_pos = ed_wend(ed_pos);
+			break;
+		case 0x7f:
+		case CTRL('H'):
+			if (ed_pos) {
+				size_t p = ed_prev(ed_pos);
+				ed_replace(p, ed_pos, "", 0);
+				ed_pos = p;
+			}
+			break;
+		case CTRL('D'):
+			if (!ed_line.len) {
+				done = eof = 1;
+				break;
+			}
+			// fall through
+		case KEY_DEL:
+			ed_replace(ed_pos, ed_next(ed_pos), "", 0);
+			break;
+		case CTRL('K'):
+			ed_kill(ed_pos, ed_line.len);
+			break;
+		case CTRL('U'):
+			ed_kill(0, ed_pos);
+			break;
+		case CTRL('W'):
+			ed_kill(ed_wstart(ed_pos, 1), ed_pos);
+			break;
+		case KEY_WRUBOUT:
+			ed_kill(ed_wstart(ed_pos, 0), ed_pos);
+			break;
+		case KEY_WKILL:
+			ed_kill(ed_pos, ed_wend(ed_pos));
+			break;
+		case CTRL('I'):
+			// with more input waiting, it is pasted: insert it as it is
+			if (ed_avail) ed_insert("\t", 1);
+			else ed_complete(last == CTRL('I'));
+			break;
+		case CTRL('Y'):
+			ed_insert(ed_yank.s, ed_yank.len);
+			break;
+		case CTRL('P'):
+		case KEY_UP:
+			if (ed_hpos > 0) ed_history(ed_hpos - 1);
+			break;
+		case CTRL('N'):
+		case KEY_DOWN:
+			if (ed_hpos < ed_hend) ed_history(ed_hpos + 1);
+			break;
+		case CTRL('R'):
+			ed_set(&ed_orig, ed_line.s, ed_line.len);
+			ed_query.len = 0;
+			ed_reserve(&ed_query, 1);
+			ed_srch = 1;
+			ed_failed = 0;
+			ed_search_prompt();
+			break;
+		case CTRL('C'):
+			ed_move(ed_pw + ed_imglen);
+			ed_put("^C\r\n", 4);
+			ed_at = 0;
+			ed_fresh = ED_INPLACE;
+			ed_line.len = ed_pos = 0;
+			ed_hpos = ed_hend;
+			break;
+		case CTRL('L'):
+			ed_put("\033[H\033[2J", 7);
+			ed_at = 0;
+			ed_fresh = ED_INPLACE;
+			break;
+		default:
+			if (c < 0x20 || c == 0x7f || c >= 0x100) break;
+			// insert the run of ordinary bytes already waiting in one go
+			{
+				char buf[BUFSIZE];
+				size_t n = 0;
+				buf[n++] = c;
+				while (n < BUFSIZE && ed_avail) {
+					int b = ed_getc(0);
+					if (b < 0x20 || b == 0x7f) {
+						ed_back = b;
+						break;
+					}
+					buf[n++] = b;
+				}
+				ed_insert(buf, n);
+			}
+		}
+	}
+	if (ed_srch) ed_search_end();
+	if (!eof || ed_line.len) ed_pos = ed_line.len;
+	ed_render();
+	ed_put("\r\n", 2);
+	ed_flush();
+	ed_cook();
+	if (eof && !ed_line.len) return NULL;
+	ed_line.s[ed_line.len] = '\0';
+	return ed_line.s;
+}
+
+/*
+ * Next line of a here-document from the editor (see doc_line), edited in a
+ * buffer of its own, as the command line is still in use.
+ */
+const char *ed_doc_line(size_t *lenp) {
+	static struct ed_str doc;
+	struct ed_str cmd = ed_line;
+	ed_line = doc;
+	char *line = ed_read(PROMPT2);
+	doc = ed_line;
+	ed_line = cmd;
+	if (line) *lenp = strlen(line);
+	return line;
+}
+#undef BUFSIZE
+#undef ED_EOF
+#undef ESC_MS
+#undef SRCH_PROMPT
+#undef FAIL_PROMPT
+
+/*
+ * parallel [-j workers] [-k] [-x] command [arg...] [::: input...]
+ * Run command once per input (the words after ':::', or else the lines of
+ * stdin), with at most 'workers' running at a time (default: one per CPU).
+ * "{}" in the command is replaced by the input; if there is no "{}", the
+ * input is appended as the last argument.
+ * -k: keep the output in the order of the inputs. Each worker writes to a
+ *     memfd, copied out (see cat_copy) once the workers before it are done.
+ *     Otherwise workers write straight to stdout.
+ * -x: stop at the first failure, terminating the running workers.
+ * Workers are spawned like any external program (see spawn_prog), and each
+ * gets a record in the foreground command, so 'time parallel ...' shows them.
+ * The exit status is the number of failed workers (at most 101).
+ */
+struct worker {
+	int stage; // index of its record in fg_job
+	int input; // index of the input it runs
+};
+
+/*
+ * Read all of stdin into the arena, and split it into lines.
+ * Return the number of lines, with the lines in *linesp.
+ */
+#define BLKSIZE (64 * 1024)
+int par_read_lines(char ***linesp) {
+	size_t cap = BLKSIZE, len = 0;
+	char *buf = arena_alloc(cap);
+	ssize_t n;
+	while ((n = read(STDIN_FILENO, buf + len, cap - len)) > 0) {
+		len += n;
+		if (len == cap) {
+			buf = arena_grow(buf, cap, 2 * cap);
+			cap *= 2;
+		}
+	}
+	if (n < 0) perror(PREF);
+
+	int nlines = 0, size = BLKSIZE / sizeof(char*);
+	char **lines = arena_alloc(size * sizeof(char*));
+	char *p = buf, *end = buf + len;
+	while (p < end) {
+		char *nl = memchr(p, '\n', end - p);
+		if (!nl) nl = end;
+		*nl = '\0';
+		if (nl > p) {
+			if (nlines == size) {
+				lines = arena_grow(lines, size * sizeof(char*), 2 * size * sizeof(char*));
+				size *= 2;
+			}
+			lines[nlines++] = p;
+		}
+		p = nl + 1;
+	}
+	*linesp = lines;
+	return nlines;
+}
+#undef BLKSIZE
+
+/*
+ * Replace every "{}" in word by input, allocating from the arena.
+ * Return NULL if word has no "{}".
+ */
+#define ARG_MARK "{}"
+char *par_subst(const char *word, const char *input) {
+	const char *p = strstr(word, ARG_MARK);
+	if (!p) return NULL;
+	size_t ilen = strlen(input), mlen = strlen(ARG_MARK);
+	size_t n = 0;
+	for ( ; p; p = strstr(p + mlen, ARG_MARK)) ++n;
+	char *res = arena_alloc(strlen(word) + n * ilen + 1);
+	char *r = res;
+	while ((p = strstr(word, ARG_MARK))) {
+		memcpy(r, word, p - word);
+		r += p - word;
+		memcpy(r, input, ilen);
+		r += ilen;
+		word = p + mlen;
+	}
+	strcpy(r, word);
+	return res;
+}
+
+/*
+ * Build the argv of the worker for input.
+ */
+char **par_argv(char **tmpl, int ntmpl, const char *input) {
+	char **argv = arena_alloc((ntmpl + 2) * sizeof(char*));
+	int i, marked = 0;
+	for (i = 0; i < ntmpl; ++i) {
+		char *word = par_subst(tmpl[i], input);
+		if (word) marked = 1;
+		argv[i] = word ? word : tmpl[i];
+	}
+	if (!marked) argv[i++] = (char *)input;
+	argv[i] = NULL;
+	return argv;
+}
+
+/*
+ * Copy out the outputs of finished workers which are next in order.
+ */
+void par_flush(int *memfds, int *done, int ninputs, int *next) {
+	while (*next < ninputs && done[*next]) {
+		int fd = memfds[*next];
+		if (fd >= 0) {
+			if (lseek(fd, 0, SEEK_SET) < 0 || cat_copy(fd, STDOUT_FILENO) < 0) perror(PREF);
+			close(fd);
+			memfds[*next] = -1;
+		}
+		++*next;
+	}
+}
+
+int builtin_parallel(char **argv) {
+	int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	int keep = 0, halt = 0;
+	char **p = argv + 1;
+	for ( ; *p && (*p)[0] == '-'; ++p) {
+		if (strcmp(*p, "-k") == 0) keep = 1;
+		else if (strcmp(*p, "-x") == 0) halt = 1;
+		else if (strcmp(*p, "-j") == 0 && p[1]) nworkers = atoi(*++p);
+		else break;
+	}
+	if (nworkers < 1) nworkers = 1;
+
+	char **tmpl = p;
+	int ntmpl = 0;
+	while (tmpl[ntmpl] && strcmp(tmpl[ntmpl], ":::") != 0) ++ntmpl;
+	if (!ntmpl) {
+		printf("usage: parallel [-j workers] [-k] [-x] command [arg...] [::: input...]\n");
+		return EXIT_FAILURE;
+	}
+
+	// inputs
+	char **inputs;
+	int ninputs;
+	int in = STDIN_FILENO;
+	if (tmpl[ntmpl]) {
+		inputs = tmpl + ntmpl + 1;
+		for (ninputs = 0; inputs[ninputs]; ++ninputs) ;
+	} else {
+		ninputs = par_read_lines(&inputs);
+		// stdin has been used up by the inputs
+		sys_err(in = open("/dev/null", O_RDONLY | O_CLOEXEC));
+	}
+
+	fflush(stdout);
+	struct worker *workers = arena_alloc(nworkers * sizeof(struct worker));
+	int *memfds = arena_alloc(ninputs * sizeof(int));
+	int *done = arena_alloc(ninputs * sizeof(int));
+	memset(done, 0, ninputs * sizeof(int));
+	int next_input = 0, next_out = 0, running = 0, failed = 0, stop = 0;
+	int i;
+
+	while (running || (next_input < ninputs && !stop)) {
+		// start workers while there are free slots
+		while (running < nworkers && next_input < ninputs && !stop) {
+			int k = next_input++;
+			int out = STDOUT_FILENO;
+			memfds[k] = -1;
+			if (keep) {
+				sys_err(out = memfd_create("parallel", MFD_CLOEXEC));
+				memfds[k] = out;
+			}
+			char **wargv = par_argv(tmpl, ntmpl, inputs[k]);
+			struct stage *st = stage_add(&fg_job, wargv[0]);
+			st->start = clock_now();
+			struct fd_op ops[] = { { STDIN_FILENO, in, 0 }, { STDOUT_FILENO, out, 0 } };
+			pid_t pid = spawn_prog(wargv, ops, 2, -1, 0);
+			if (pid < 0) {
+				st->status = spawn_status(errno);
+				st->end = st->start;
+				done[k] = 1;
+				++failed;
+				if (halt) stop = 1;
+				continue;
+			}
+			st->pid = pid;
+			st->state = STAGE_RUNNING;
+			stage_watch(st);
+			workers[running].stage = fg_job.nstages - 1;
+			workers[running].input = k;
+			++running;
+		}
+		if (keep) par_flush(memfds, done, ninputs, &next_out);
+		if (!running) continue;
+
+		// wait for workers to finish
+		ev_wait(-1, 0);
+		for (i = 0; i < running; ) {
+			struct stage *st = &fg_job.stages[workers[i].stage];
+			if (st->state != STAGE_DONE) {
+				++i;
+				continue;
+			}
+			done[workers[i].input] = 1;
+			workers[i] = workers[--running];
+			if (st->status != 0) {
+				++failed;
+				if (halt && !stop) {
+					stop = 1;
+					int w;
+					for (w = 0; w < running; ++w) stage_signal(&fg_job.stages[workers[w].stage], SIGTERM);
+				}
+			}
+		}
+	}
+	if (keep) {
+		// after a stop, inputs never started have nothing to copy out
+		for (i = next_input; i < ninputs; ++i) {
+			memfds[i] = -1;
+			done[i] = 1;
+		}
+		par_flush(memfds, done, ninputs, &next_out);
+	}
+	if (in != STDIN_FILENO) close(in);
+	return failed > 101 ? 101 : failed;
+}
+
+/*
+ * Pipe capacity.
+ * The pipes between piped parts are resized with F_SETPIPE_SZ:
+ * - default: left to the kernel (64 KiB).
+ * - n[k|m]: n bytes, at most /proc/sys/fs/pipe-max-size.
+ * - auto: the largest size allowed for pipes out of parts reading a file
+ *   (a '<' redirection, or cat with file arguments); default for the rest.
+ * Picked at startup from the environment variable SHELL_PIPESIZE, and can be
+ * changed at runtime with the builtin 'pipesize'.
+ */
+#define PIPESIZE_ENV "SHELL_PIPESIZE"
+#define PIPE_MAX_FILE "/proc/sys/fs/pipe-max-size"
+#define PIPESIZE_AUTO -1
+long pipe_size; // 0 for default
+long pipe_max = 1024 * 1024;
+
+/*
+ * Parse a pipe size.
+ * Return the size, PIPESIZE_AUTO, 0 for default, or -2 if invalid.
+ */
+long pipesize_parse(const char *str) {
+	if (strcmp(str, "auto") == 0) return PIPESIZE_AUTO;
+	if (strcmp(str, "default") == 0) return 0;
+	char *end;
+	long n = strtol(str, &end, 10);
+	if (end == str || n <= 0) return -2;
+	if (*end == 'k' || *end == 'K') n *= 1024, ++end;
+	else if (*end == 'm' || *end == 'M') n *= 1024 * 1024, ++end;
+	if (*end) return -2;
+	return n > pipe_max ? pipe_max : n;
+}
+
+void pipesize_init() {
+	FILE *f = fopen(PIPE_MAX_FILE, "re");
+	if (f) {
+		long n;
+		if (fscanf(f, "%ld", &n) == 1 && n > 0) pipe_max = n;
+		fclose(f);
+	}
+	char *str = var_get(PIPESIZE_ENV);
+	if (str && *str) {
+		long n = pipesize_parse(str);
+		if (n < -1) fprintf(stderr, PREF": "PIPESIZE_ENV": bad size %s\n", str);
+		else pipe_size = n;
+	}
+}
+
+/*
+ * Resize the pipe written to by a piped part ('file_fed' if it reads a file).
+ */
+void pipe_resize(int fd, int file_fed) {
+	long size = pipe_size;
+	if (size == PIPESIZE_AUTO) size = file_fed ? pipe_max : 0;
+	// may fail beyond the per-user limit on pipe buffers: keep the default
+	if (size > 0) fcntl(fd, F_SETPIPE_SZ, (int)size);
+}
+
+int builtin_pipesize(char **argv) {
+	if (argv[1]) {
+		long n = pipesize_parse(argv[1]);
+		if (n < -1) {
+			out_str("usage: pipesize [default | auto | bytes[k|m]]\n");
+			return EXIT_FAILURE;
+		}
+		pipe_size = n;
+	} else if (pipe_size == PIPESIZE_AUTO) {
+		out_str("auto\n");
+	} else if (pipe_size == 0) {
+		out_str("default\n");
+	} else {
+		out_printf("%ld\n", pipe_size);
+	}
+	return EXIT_SUCCESS;
+}
+#undef PIPESIZE_AUTO
+
+/*
+ * Compound commands.
+ * A command is parsed whole before it runs, reading more lines as long as
+ * it goes on (see parse_fill), into a tree: lists of pipelines joined by
+ * ; & && ||, and the compound commands if, while, until, for, case,
+ * { list; }, ( list ), ((expression)) and for ((init; condition; step))
+ * (see parse_unit). The tree is compiled into code
+ * for a small machine (see vm_run), so that the body of a loop is parsed
+ * once however many times it runs.
+ * A pipeline is kept as a template of tokens, of which only the words with
+ * expansions are lexed again when it runs (see tmpl_expand). A compound
+ * command piped into another part, run in the background or in ( ) runs
+ * in a forked copy of the shell (see vm_block); else it runs in the shell,
+ * with its redirections applied around it (see plan_push).
+ * The here-documents of a command which spans several lines or has
+ * compound commands are read as it is parsed, and kept until it runs.
+ * 'break [n]' and 'continue [n]' are compiled into jumps.
+ */
+void exec_toks(char *text, struct lex_tok *t, int bg);
+
+enum {
+	N_SIMPLE,
+	N_PIPE,
+	N_AND,
+	N_OR,
+	N_IF,
+	N_WHILE,
+	N_UNTIL,
+	N_FOR,
+	N_CASE,
+	N_ITEM,
+	N_GROUP,
+	N_SUBSHELL,
+	N_ARITH, // ((expression))
+	N_ARFOR // for ((init; condition; step))
+};
+
+#define N_BANG 1 // pipeline: '!' negates its status
+#define N_BG 2 // pipeline: runs in the background
+
+/*
+ * Node of the tree of a command. Tokens are indices in lex_toks, which
+ * moves as lines are added.
+ */
+struct node {
+	int type;
+	int flags;
+	struct node *a, *b, *c; // children: condition (or left), body (or right), else
+	struct node *next; // next command of a list, part of a pipeline, or item of a case
+	size_t tok, end; // its tokens
+	size_t rtok; // compound command: start of its redirections, up to end
+	size_t w, wend; // words of a for loop, word of a case (w), patterns of an item of a case
+	char *name; // variable of a for loop
+};
+
+size_t parse_i; // current token
+size_t parse_line; // first token of the last line read
+int parse_depth; // compound commands open, within which a line may end
+int parse_lines; // lines read after the first
+int parse_err; // an error was reported
+int parse_eof; // the input ended within the command
+
+struct node *node_new(int type, size_t tok) {
+	struct node *n = arena_alloc(sizeof(struct node));
+	memset(n, 0, sizeof(struct node));
+	n->type = type;
+	n->tok = n->end = n->rtok = tok;
+	return n;
+}
+
+/*
+ * Report the unexpected token t (unless an error was reported already), and
+ * return NULL.
+ */
+struct node *parse_error(struct lex_tok *t) {
+	if (!parse_err) {
+		if (t->type == TOK_END && parse_eof) fprintf(stderr, PREF": syntax error: unexpected end of file\n");
+		else lex_error(t);
+	}
+	parse_err = 1;
+	return NULL;
+}
+
+/*
+ * Read the bodies of the here-documents among the tokens of the line
+ * starting at token i, as typed, into the str of their operator token (see
+ * vm_doc_line).
+ */
+void parse_docs(size_t i) {
+	for (; lex_toks[i].type != TOK_END; ++i) {
+		struct lex_tok *t = &lex_toks[i];
+		if (t->type != TOK_DOC && t->type != TOK_DOCTAB) continue;
+		size_t dlen = strlen(t[1].str), len, n = 0, cap = 0;
+		const char *line;
+		char *body = "";
+		while (doc_line && (line = doc_line(&len))) {
+			if (n + len + 2 > cap) {
+				body = arena_grow(cap ? body : NULL, cap, 2 * (n + len + 2));
+				cap = 2 * (n + len + 2);
+			}
+			memcpy(body + n, line, len);
+			n += len;
+			body[n++] = '\n';
+			body[n] = '\0';
+			if (t->type == TOK_DOCTAB) {
+				while (len && *line == '\t') {
+					++line;
+					--len;
+				}
+			}
+			if (len == dlen && memcmp(line, t[1].str, len) == 0) break;
+		}
+		t->str = body;
+	}
+}
+
+/*
+ * Read the next line of a command which goes on (after the here-documents
+ * of the line before), and lex it after the tokens so far: the end of the
+ * line before becomes a TOK_NL.
+ * Return 0 if there is none (see parse_eof), or it is malformed.
+ */
+int parse_fill() {
+	size_t len, nl = lex_cnt - 1;
+	const char *line;
+	parse_docs(parse_line);
+	if (!doc_line || !(line = doc_line(&len))) {
+		parse_eof = 1;
+		return 0;
+	}
+	char *src = arena_alloc(2 * (len + 1)), *copy = src + len + 1;
+	memcpy(src, line, len);
+	src[len] = '\0';
+	memcpy(copy, src, len + 1);
+	lex_toks[nl].type = TOK_NL;
+	lex_toks[nl].str = src;
+	lex_src = src;
+	parse_line = lex_cnt;
+	++parse_lines;
+	if (!lex_more(copy)) {
+		parse_err = 1;
+		lex_cnt = parse_line = nl + 1;
+		lex_toks[nl].type = TOK_END;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Current token, after reading the next line if it is the end of one within
+ * a compound command.
+ */
+struct lex_tok *parse_peek() {
+	if (lex_toks[parse_i].type == TOK_END && parse_depth && !parse_err) parse_fill();
+	return &lex_toks[parse_i];
+}
+
+/*
+ * Skip newlines, and return the token after them. If more is set, the
+ * command goes on after the end of the line even outside compound commands
+ * (after | && ||).
+ */
+struct lex_tok *parse_skip(int more) {
+	while (1) {
+		struct lex_tok *t = &lex_toks[parse_i];
+		if (t->type == TOK_NL) ++parse_i;
+		else if (t->type != TOK_END || !(parse_depth || more) || parse_err || !parse_fill()) return t;
+	}
+}
+
+/*
+ * Whether t is the reserved word w (which is never quoted).
+ */
+int parse_is(struct lex_tok *t, const char *w) {
+	return t->type == TOK_WORD && !t->quoted && strcmp(t->str, w) == 0;
+}
+
+/*
+ * Whether t may not start a command: it ends a list.
+ */
+int parse_stop(struct lex_tok *t) {
+	static const char *words[] = { "then", "elif", "else", "fi", "do", "done", "esac", "}", NULL };
+	const char **w;
+	if (t->type == TOK_RPAREN || t->type == TOK_DSEMI) return 1;
+	for (w = words; *w; ++w) {
+		if (parse_is(t, *w)) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Skip the reserved word w, after newlines. Return 0, after reporting an
+ * error, if it is not there.
+ */
+int parse_expect(const char *w) {
+	struct lex_tok *t = parse_skip(0);
+	if (!parse_is(t, w)) {
+		parse_error(t);
+		return 0;
+	}
+	++parse_i;
+	return 1;
+}
+
+struct node *parse_and_or();
+
+/*
+ * Parse a list of commands, up to a token which ends it (see parse_stop),
+ * or the end of the line outside compound commands.
+ * Return its first node, or NULL if it is empty or on error (see
+ * parse_err).
+ */
+struct node *parse_list() {
+	struct node *head = NULL, **tail = &head;
+	while (1) {
+		struct lex_tok *t = parse_skip(0);
+		if (t->type == TOK_END || parse_stop(t)) return head;
+		struct node *n = parse_and_or();
+		if (!n) return NULL;
+		t = parse_peek();
+		if (t->type == TOK_BG) {
+			if (n->type != N_PIPE) {
+				// pipelines joined by && or || go to the background together
+				struct node *g = node_new(N_GROUP, n->tok);
+				g->a = n;
+				g->end = g->rtok = n->end;
+				n = node_new(N_PIPE, g->tok);
+				n->a = g;
+				n->end = g->end;
+			}
+			n->flags |= N_BG;
+		}
+		*tail = n;
+		tail = &n->next;
+		if (t->type == TOK_SEMI || t->type == TOK_BG) ++parse_i;
+		else if (t->type != TOK_NL && t->type != TOK_END && !parse_stop(t)) return parse_error(t);
+	}
+}
+
+/*
+ * Parse a list which may not be empty.
+ */
+struct node *parse_body() {
+	struct node *n = parse_list();
+	if (!n && !parse_err) parse_error(parse_skip(0));
+	return n;
+}
+
+struct node *parse_pipeline();
+
+struct node *parse_and_or() {
+	struct node *n = parse_pipeline();
+	struct lex_tok *t;
+	while (n && ((t = parse_peek())->type == TOK_AND || t->type == TOK_OR)) {
+		struct node *r = node_new(t->type == TOK_AND ? N_AND : N_OR, n->tok);
+		++parse_i;
+		parse_skip(1);
+		r->a = n;
+		if (!(r->b = parse_pipeline())) return NULL;
+		r->end = r->b->end;
+		n = r;
+	}
+	return n;
+}
+
+struct node *parse_command();
+
+struct node *parse_pipeline() {
+	struct node *p = node_new(N_PIPE, parse_i), **tail = &p->a;
+	if (parse_is(&lex_toks[parse_i], "!")) {
+		p->flags |= N_BANG;
+		++parse_i;
+	}
+	while (1) {
+		struct node *s = parse_command();
+		if (!s) return NULL;
+		*tail = s;
+		tail = &s->next;
+		if (lex_toks[parse_i].type != TOK_PIPE) break;
+		++parse_i;
+		parse_skip(1);
+	}
+	p->end = parse_i;
+	return p;
+}
+
+/*
+ * do list done: the body of loop n.
+ */
+struct node *parse_do(struct node *n) {
+	if (!parse_expect("do") || !(n->b = parse_body()) || !parse_expect("done")) return NULL;
+	return n;
+}
+
+/*
+ * if list then list [elif list then list]... [else list] fi
+ */
+struct node *parse_if() {
+	struct node *n = node_new(N_IF, parse_i++);
+	if (!(n->a = parse_body()) || !parse_expect("then") || !(n->b = parse_body())) return NULL;
+	struct lex_tok *t = parse_skip(0);
+	if (parse_is(t, "elif")) return (n->c = parse_if()) ? n : NULL;
+	if (parse_is(t, "else")) {
+		++parse_i;
+		if (!(n->c = parse_body())) return NULL;
+	}
+	return parse_expect("fi") ? n : NULL;
+}
+
+/*
+ * for name [in word...]; do list done
+ * for ((init; condition; step)) do list done
+ */
+struct node *parse_for() {
+	struct node *n = node_new(N_FOR, parse_i++);
+	struct lex_tok *t = parse_peek();
+	if (t->type == TOK_ARITH) {
+		char *semi = strchr(t->str, ';');
+		if (!semi || !(semi = strchr(semi + 1, ';')) || strchr(semi + 1, ';')) return parse_error(t);
+		n->type = N_ARFOR;
+		n->w = parse_i++;
+		t = parse_skip(0);
+		if (t->type == TOK_SEMI) ++parse_i;
+		return parse_do(n);
+	}
+	if (t->type != TOK_WORD || t->quoted || var_name_len(t->str) != strlen(t->str)) return parse_error(t);
+	n->name = t->str;
+	++parse_i;
+	t = parse_skip(0);
+	if (parse_is(t, "in")) {
+		n->w = ++parse_i;
+		while (lex_toks[parse_i].type == TOK_WORD) ++parse_i;
+		n->wend = parse_i;
+		t = parse_peek();
+		if (t->type != TOK_SEMI && t->type != TOK_NL) return parse_error(t);
+		++parse_i;
+	} else if (t->type == TOK_SEMI) {
+		++parse_i;
+	}
+	return parse_do(n);
+}
+
+/*
+ * case word in [(]pattern[|pattern]...) list ;; ... esac
+ */
+struct node *parse_case() {
+	struct node *n = node_new(N_CASE, parse_i++), **tail = &n->a;
+	struct lex_tok *t = parse_peek();
+	if (t->type != TOK_WORD) return parse_error(t);
+	n->w = parse_i++;
+	if (!parse_expect("in")) return NULL;
+	while (!parse_is(t = parse_skip(0), "esac")) {
+		struct node *item = node_new(N_ITEM, parse_i);
+		if (t->type == TOK_LPAREN) ++parse_i;
+		item->w = parse_i;
+		while (1) {
+			if (lex_toks[parse_i].type != TOK_WORD) return parse_error(&lex_toks[parse_i]);
+			if (lex_toks[++parse_i].type != TOK_PIPE) break;
+			++parse_i;
+		}
+		item->wend = parse_i;
+		if (lex_toks[parse_i].type != TOK_RPAREN) return parse_error(&lex_toks[parse_i]);
+		++parse_i;
+		item->a = parse_list();
+		if (parse_err) return NULL;
+		t = parse_skip(0);
+		if (t->type == TOK_DSEMI) ++parse_i;
+		else if (!parse_is(t, "esac")) return parse_error(t);
+		*tail = item;
+		tail = &item->next;
+	}
+	++parse_i;
+	return n;
+}
+
+/*
+ * Parse a compound command, or return NULL (without error) if the current
+ * token does not start one.
+ */
+struct node *parse_compound() {
+	struct lex_tok *t = &lex_toks[parse_i];
+	struct node *n;
+	int type;
+	if (t->type == TOK_LPAREN) type = N_SUBSHELL;
+	else if (t->type == TOK_ARITH) type = N_ARITH;
+	else if (parse_is(t, "{")) type = N_GROUP;
+	else if (parse_is(t, "if")) type = N_IF;
+	else if (parse_is(t, "while")) type = N_WHILE;
+	else if (parse_is(t, "until")) type = N_UNTIL;
+	else if (parse_is(t, "for")) type = N_FOR;
+	else if (parse_is(t, "case")) type = N_CASE;
+	else return NULL;
+	++parse_depth;
+	switch (type) {
+	case N_SUBSHELL:
+	case N_GROUP:
+		n = node_new(type, parse_i++);
+		if ((n->a = parse_body())) {
+			t = parse_skip(0);
+			if (type == N_SUBSHELL ? t->type == TOK_RPAREN : parse_is(t, "}")) ++parse_i;
+			else n = parse_error(t);
+		}
+		if (!n->a) n = NULL;
+		break;
+	case N_IF:
+		n = parse_if();
+		break;
+	case N_ARITH:
+		n = node_new(type, parse_i++);
+		break;
+	case N_WHILE:
+	case N_UNTIL:
+		n = node_new(type, parse_i++);
+		n = (n->a = parse_body()) ? parse_do(n) : NULL;
+		break;
+	case N_FOR:
+		n = parse_for();
+		break;
+	default:
+		n = parse_case();
+	}
+	--parse_depth;
+	return n;
+}
+
+/*
+ * Parse a simple command (words and redirections), or a compound command
+ * followed by redirections.
+ */
+struct node *parse_command() {
+	struct node *n = parse_compound();
+	struct lex_tok *t;
+	if (n || parse_err) {
+		if (!n) return NULL;
+		n->rtok = parse_i;
+		while (lex_isredir(lex_toks[parse_i].type)) parse_i += 2;
+		n->end = parse_i;
+		return n;
+	}
+	n = node_new(N_SIMPLE, parse_i);
+	for (; t = &lex_toks[parse_i], t->type == TOK_WORD || lex_isredir(t->type); ++parse_i) {
+		if (t->type != TOK_WORD) ++parse_i; // its file name
+	}
+	if (parse_i == n->tok || parse_stop(&lex_toks[n->tok])) return parse_error(&lex_toks[n->tok]);
+	n->end = parse_i;
+	return n;
+}
+
+/*
+ * Code of a command, run by vm_run. arg is a jump target (an index in
+ * ops) or a status, p a template (see struct tmpl) or a name.
+ */
+enum {
+	OP_RUN, // run the pipeline p (see vm_cmd)
+	OP_NOT, // negate the status
+	OP_JMP, // go to arg
+	OP_JZ, // go to arg if the status is 0
+	OP_JNZ, // go to arg if the status is not 0
+	OP_STATUS, // set the status to arg
+	OP_PUSHST, // enter a loop, whose status is 0 until its body has run
+	OP_SAVEST, // the status of the loop is the status
+	OP_POPST, // leave a loop: the status is that of the loop
+	OP_FOR, // enter a for loop over the words p
+	OP_NEXT, // assign the next word of the for loop to the variable p, or leave the loop and go to arg
+	OP_FORPOP, // leave the for loop (on break)
+	OP_CASE, // the word p is the subject of the patterns which follow
+	OP_PAT, // if the pattern p matches the subject, go to arg
+	OP_ESAC, // no pattern matched
+	OP_REDIR, // apply the redirections p to the shell, or go to arg if they fail
+	OP_UNREDIR, // undo the last OP_REDIR
+	OP_ARITH, // evaluate the expression p (see vm_arith)
+	OP_RET // end of the code (or of a block, see vm_block)
+};
+
+struct op {
+	int code;
+	int arg;
+	void *p;
+};
+
+struct prog {
+	struct op *ops;
+	int n, cap;
+	int depth; // most loops and redirections open at once
+};
+
+/*
+ * Template of a pipeline (or of the words of a for loop, the word or a
+ * pattern of a case, or redirections): its tokens, ending with TOK_END.
+ */
+struct tmpl {
+	struct lex_tok *toks;
+	size_t n; // tokens, with the end
+	unsigned int *globs; // offsets of pattern characters (see lex_globs)
+	char *text; // as typed, for job listings
+	char *docs; // lines of its here-documents, or NULL to read them as it runs
+	int dyn; // words lexed again when it runs
+	int bg; // runs in the background
+};
+
+/*
+ * Loop or redirection open where code is compiled, for break and continue.
+ */
+struct comp_ctx {
+	int loop; // type of the loop, or 0 for redirections
+	int top; // where continue goes
+	int breaks; // jumps to the end of the loop, chained through their arg
+	struct comp_ctx *prev;
+};
+
+#define CODE_INIT 32
+struct prog *comp_prog; // code being compiled
+struct comp_ctx *comp_ctx;
+int comp_depth;
+char *comp_src; // first line of the command, as typed
+int comp_live; // here-documents are read as the command runs
+
+int comp_emit(int code, int arg, void *p) {
+	struct prog *g = comp_prog;
+	if (g->n >= g->cap) {
+		int cap = g->cap ? 2 * g->cap : CODE_INIT;
+		g->ops = arena_grow(g->ops, g->cap * sizeof(struct op), cap * sizeof(struct op));
+		g->cap = cap;
+	}
+	g->ops[g->n].code = code;
+	g->ops[g->n].arg = arg;
+	g->ops[g->n].p = p;
+	return g->n++;
+}
+
+/*
+ * Make the jumps chained from i (through their arg, ending with -1) go to
+ * the next instruction.
+ */
+void comp_patch(int i) {
+	while (i >= 0) {
+		int next = comp_prog->ops[i].arg;
+		comp_prog->ops[i].arg = comp_prog->n;
+		i = next;
+	}
+}
+
+void comp_enter(struct comp_ctx *c) {
+	c->prev = comp_ctx;
+	c->breaks = -1;
+	comp_ctx = c;
+	if (++comp_depth > comp_prog->depth) comp_prog->depth = comp_depth;
+}
+
+void comp_leave(struct comp_ctx *c) {
+	comp_ctx = c->prev;
+	--comp_depth;
+}
+
+/*
+ * Text of the tokens from..to (up to the start of token to), as typed, the
+ * lines it spans joined by blanks. The offset in it of token i goes to
+ * pos[i - from].
+ */
+char *comp_text(size_t from, size_t to, unsigned int *pos) {
+	const char *line = comp_src;
+	size_t i, start = lex_toks[from].pos, len = 0, cap = 0;
+	char *text = NULL;
+	for (i = from; i > 0; --i) {
+		if (lex_toks[i - 1].type == TOK_NL) {
+			line = lex_toks[i - 1].str;
+			break;
+		}
+	}
+	for (i = from; ; ++i) {
+		struct lex_tok *t = &lex_toks[i];
+		if (i < to && t->type != TOK_NL) {
+			pos[i - from] = len + t->pos - start;
+			continue;
+		}
+		size_t n = (i < to ? strlen(line) : t->pos) - start;
+		if (len + n + 2 > cap) {
+			text = arena_grow(text, cap, 2 * (len + n + 2));
+			cap = 2 * (len + n + 2);
+		}
+		memcpy(text + len, line + start, n);
+		len += n;
+		if (i == to) break;
+		text[len++] = ' ';
+		line = t->str;
+		start = 0;
+	}
+	while (len && (text[len - 1] == ' ' || text[len - 1] == '\t')) --len;
+	text[len] = '\0';
+	return text;
+}
+
+struct tmpl *tmpl_new(size_t n) {
+	struct tmpl *c = arena_alloc(sizeof(struct tmpl));
+	memset(c, 0, sizeof(struct tmpl));
+	c->toks = arena_alloc(n * sizeof(struct lex_tok));
+	c->globs = lex_globs;
+	return c;
+}
+
+/*
+ * Add the tokens from..to to the template c, at their offset in pos (if
+ * not NULL) less base.
+ */
+void tmpl_copy(struct tmpl *c, size_t from, size_t to, unsigned int *pos, size_t base) {
+	for (; from < to; ++from) {
+		struct lex_tok *t = &c->toks[c->n++];
+		*t = lex_toks[from];
+		if (pos) t->pos = pos[from - base];
+		if (t->dyn) ++c->dyn;
+		if ((t->type == TOK_DOC || t->type == TOK_DOCTAB) && !comp_live) {
+			// the lines read by parse_docs
+			size_t old = c->docs ? strlen(c->docs) : 0, n = strlen(t->str);
+			char *docs = arena_alloc(old + n + 1);
+			memcpy(docs, c->docs, old);
+			memcpy(docs + old, t->str, n + 1);
+			c->docs = docs;
+		}
+	}
+}
+
+void tmpl_end(struct tmpl *c, size_t pos) {
+	struct lex_tok *t = &c->toks[c->n++];
+	memset(t, 0, sizeof(struct lex_tok));
+	t->type = TOK_END;
+	t->pos = pos;
+	t->fd = t->io = -1;
+}
+
+/*
+ * Template of the tokens from..to.
+ */
+struct tmpl *comp_range(size_t from, size_t to) {
+	struct tmpl *c = tmpl_new(to - from + 1);
+	tmpl_copy(c, from, to, NULL, 0);
+	tmpl_end(c, lex_toks[to].pos);
+	return c;
+}
+
+void comp_list(struct node *n);
+void comp_compound(struct node *s);
+
+/*
+ * Compile the compound command s into a block of its own, which is jumped
+ * over, and return its start.
+ */
+int comp_block(struct node *s) {
+	int j = comp_emit(OP_JMP, -1, NULL), pc = comp_prog->n;
+	struct comp_ctx *ctx = comp_ctx;
+	comp_ctx = NULL; // break and continue do not leave it
+	comp_compound(s);
+	comp_emit(OP_RET, 0, NULL);
+	comp_ctx = ctx;
+	comp_patch(j);
+	return pc;
+}
+
+/*
+ * Template of the pipeline p, with a TOK_BLOCK for each compound command.
+ */
+struct tmpl *comp_pipe_tmpl(struct node *p) {
+	struct node *s;
+	size_t n = 1, from = p->a->tok;
+	for (s = p->a; s; s = s->next) n += 1 + (s->type == N_SIMPLE ? s->end - s->tok : 1 + s->end - s->rtok);
+	unsigned int *pos = arena_alloc((p->end - from + 1) * sizeof(unsigned int));
+	char *text = comp_text(from, p->end, pos);
+	struct tmpl *c = tmpl_new(n);
+	c->text = text;
+	c->bg = (p->flags & N_BG) != 0;
+	for (s = p->a; s; s = s->next) {
+		if (s != p->a) {
+			// the '|' before it
+			size_t i = s->tok;
+			while (lex_toks[i - 1].type == TOK_NL) --i;
+			tmpl_copy(c, i - 1, i, pos, from);
+		}
+		if (s->type == N_SIMPLE) {
+			tmpl_copy(c, s->tok, s->end, pos, from);
+			continue;
+		}
+		int pc = comp_block(s);
+		struct lex_tok *t = &c->toks[c->n];
+		tmpl_copy(c, s->tok, s->tok + 1, pos, from);
+		t->type = TOK_BLOCK;
+		t->str = s->type == N_SUBSHELL ? "(" : s->type == N_ARITH ? "((" : lex_toks[s->tok].str;
+		t->dyn = 0;
+		t->glob = 0;
+		t->pc = pc;
+		c->dyn -= lex_toks[s->tok].dyn;
+		tmpl_copy(c, s->rtok, s->end, pos, from);
+	}
+	tmpl_end(c, strlen(text));
+	return c;
+}
+
+/*
+ * If the pipeline p is 'break [n]' or 'continue [n]' within a loop,
+ * compile its jump and return 1.
+ */
+int comp_jump(struct node *p) {
+	struct node *s = p->a;
+	struct lex_tok *t = &lex_toks[s->tok];
+	int brk = parse_is(t, "break");
+	long n = 1;
+	char *end;
+	if (s->next || s->type != N_SIMPLE || p->flags || s->end - s->tok > 2 || (!brk && !parse_is(t, "continue"))) return 0;
+	if (s->end - s->tok == 2) {
+		if (t[1].type != TOK_WORD || t[1].dyn) return 0;
+		n = strtol(t[1].str, &end, 10);
+		if (*end || n < 1) return 0;
+	}
+	struct comp_ctx *c, *loop = NULL;
+	for (c = comp_ctx; c; c = c->prev) {
+		if (c->loop && (loop = c, !--n)) break;
+	}
+	if (!loop) {
+		comp_emit(OP_STATUS, EXIT_SUCCESS, NULL);
+		return 1;
+	}
+	// leave what is open within the loop
+	for (c = comp_ctx; c != loop; c = c->prev) {
+		if (!c->loop) {
+			comp_emit(OP_UNREDIR, 0, NULL);
+			continue;
+		}
+		if (c->loop == N_FOR) comp_emit(OP_FORPOP, 0, NULL);
+		comp_emit(OP_POPST, 0, NULL);
+	}
+	comp_emit(OP_STATUS, EXIT_SUCCESS, NULL);
+	comp_emit(OP_SAVEST, 0, NULL);
+	if (!brk) {
+		comp_emit(OP_JMP, loop->top, NULL);
+		return 1;
+	}
+	if (loop->loop == N_FOR) comp_emit(OP_FORPOP, 0, NULL);
+	loop->breaks = comp_emit(OP_JMP, loop->breaks, NULL);
+	return 1;
+}
+
+void comp_pipe(struct node *p) {
+	struct node *s = p->a;
+	if (!s->next && !(p->flags & N_BG) && s->type != N_SIMPLE && s->type != N_SUBSHELL) {
+		// runs in the shell
+		if (s->rtok < s->end) {
+			struct comp_ctx ctx = { 0, 0, -1, NULL };
+			int j = comp_emit(OP_REDIR, -1, comp_range(s->rtok, s->end));
+			comp_enter(&ctx);
+			comp_compound(s);
+			comp_leave(&ctx);
+			comp_emit(OP_UNREDIR, 0, NULL);
+			comp_patch(j);
+		} else {
+			comp_compound(s);
+		}
+	} else if (!comp_jump(p)) {
+		comp_emit(OP_RUN, 0, comp_pipe_tmpl(p));
+	}
+	if (p->flags & N_BANG) comp_emit(OP_NOT, 0, NULL);
+}
+
+void comp_loop(struct node *s) {
+	struct comp_ctx ctx = { s->type, 0, -1, NULL };
+	int j;
+	comp_enter(&ctx);
+	comp_emit(OP_PUSHST, 0, NULL);
+	if (s->type == N_ARFOR) {
+		// init; goto test; top: step; test: condition
+		char *init = arena_strdup(lex_toks[s->w].str), *cond = strchr(init, ';') + 1, *step = strchr(cond, ';') + 1;
+		cond[-1] = step[-1] = '\0';
+		if (strspn(init, " \t") < strlen(init)) comp_emit(OP_ARITH, 0, init);
+		int test = comp_emit(OP_JMP, -1, NULL);
+		ctx.top = comp_prog->n;
+		if (strspn(step, " \t") < strlen(step)) comp_emit(OP_ARITH, 0, step);
+		comp_patch(test);
+		j = -1; // no condition: until break
+		if (strspn(cond, " \t") < strlen(cond)) {
+			comp_emit(OP_ARITH, 0, cond);
+			j = comp_emit(OP_JNZ, -1, NULL);
+		}
+	} else if (s->type == N_FOR) {
+		comp_emit(OP_FOR, 0, comp_range(s->w, s->wend));
+		ctx.top = j = comp_emit(OP_NEXT, -1, s->name);
+	} else {
+		ctx.top = comp_prog->n;
+		comp_list(s->a);
+		j = comp_emit(s->type == N_WHILE ? OP_JNZ : OP_JZ, -1, NULL);
+	}
+	comp_list(s->b);
+	comp_emit(OP_SAVEST, 0, NULL);
+	comp_emit(OP_JMP, ctx.top, NULL);
+	comp_patch(j);
+	comp_patch(ctx.breaks);
+	comp_emit(OP_POPST, 0, NULL);
+	comp_leave(&ctx);
+}
+
+void comp_case(struct node *s) {
+	struct node *item;
+	size_t i;
+	int pat, ends = -1;
+	comp_emit(OP_CASE, 0, comp_range(s->w, s->w + 1));
+	pat = comp_prog->n;
+	for (item = s->a; item; item = item->next) {
+		for (i = item->w; i < item->wend; i += 2) comp_emit(OP_PAT, -1, comp_range(i, i + 1));
+	}
+	comp_emit(OP_ESAC, 0, NULL);
+	ends = comp_emit(OP_JMP, ends, NULL);
+	for (item = s->a; item; item = item->next) {
+		for (i = item->w; i < item->wend; i += 2) comp_prog->ops[pat++].arg = comp_prog->n;
+		comp_list(item->a);
+		ends = comp_emit(OP_JMP, ends, NULL);
+	}
+	comp_patch(ends);
+}
+
+void comp_compound(struct node *s) {
+	int j, k;
+	switch (s->type) {
+	case N_GROUP:
+	case N_SUBSHELL:
+		comp_list(s->a);
+		break;
+	case N_IF:
+		comp_list(s->a);
+		j = comp_emit(OP_JNZ, -1, NULL);
+		comp_list(s->b);
+		k = comp_emit(OP_JMP, -1, NULL);
+		comp_patch(j);
+		if (s->c && s->c->type == N_IF) comp_compound(s->c); // elif
+		else if (s->c) comp_list(s->c);
+		else comp_emit(OP_STATUS, EXIT_SUCCESS, NULL);
+		comp_patch(k);
+		break;
+	case N_CASE:
+		comp_case(s);
+		break;
+	case N_ARITH:
+		comp_emit(OP_ARITH, 0, lex_toks[s->tok].str);
+		break;
+	default:
+		comp_loop(s);
+	}
+}
+
+void comp_node(struct node *n) {
+	int j;
+	switch (n->type) {
+	case N_AND:
+	case N_OR:
+		comp_node(n->a);
+		j = comp_emit(n->type == N_AND ? OP_JNZ : OP_JZ, -1, NULL);
+		comp_node(n->b);
+		comp_patch(j);
+		break;
+	default:
+		comp_pipe(n);
+	}
+}
+
+void comp_list(struct node *n) {
+	for (; n; n = n->next) comp_node(n);
+}
+#undef CODE_INIT
+
+/*
+ * Parse the command starting on line (modified as by lex), reading the
+ * lines it goes on to through doc_line, and compile it.
+ * Return NULL, after printing an error, if it is malformed.
+ */
+struct prog *parse_unit(char *line) {
+	int defer = lex_defer;
+	char *src = arena_strdup(line);
+	struct node *n = NULL;
+	lex_defer = 1;
+	lex_src = src;
+	lex_start();
+	parse_i = parse_line = 0;
+	parse_depth = parse_lines = parse_err = parse_eof = 0;
+	if (lex_more(line)) {
+		n = parse_list();
+		if (!parse_err && lex_toks[parse_i].type != TOK_END) parse_error(&lex_toks[parse_i]);
+	} else {
+		parse_err = 1;
+	}
+	lex_defer = defer;
+	if (parse_err) return NULL;
+
+	// here-documents are read as the command runs, if it is a single line
+	// with a single pipeline of simple commands
+	struct node *s = n ? n->a : NULL;
+	comp_live = !parse_lines && (!n || (!n->next && n->type == N_PIPE));
+	for (; s && comp_live; s = s->next) comp_live = s->type == N_SIMPLE;
+	if (!comp_live) parse_docs(parse_line);
+
+	struct prog *g = arena_alloc(sizeof(struct prog));
+	memset(g, 0, sizeof(struct prog));
+	comp_prog = g;
+	comp_src = src;
+	comp_ctx = NULL;
+	comp_depth = 0;
+	comp_list(n);
+	comp_emit(OP_RET, 0, NULL);
+	return g;
+}
+
+/*
+ * The template of the code p if it is a single pipeline, else NULL.
+ */
+struct tmpl *prog_cmd(struct prog *p) {
+	return p->n == 2 && p->ops[0].code == OP_RUN ? p->ops[0].p : NULL;
+}
+
+/*
+ * Tokens of the template c, in lex_toks: its dyn words are lexed again
+ * (expanded), the others are copied.
+ * Return NULL, after printing an error, if an expansion is malformed.
+ */
+struct lex_tok *tmpl_expand(struct tmpl *c) {
+	size_t i, g;
+	if (!c->dyn) {
+		// used as they are
+		glob_reset();
+		lex_toks = c->toks;
+		lex_cnt = lex_cap = c->n;
+		lex_globs = c->globs;
+		lex_gcnt = lex_gcap = 0;
+		return lex_toks;
+	}
+	lex_start();
+	for (i = 0; c->toks[i].type != TOK_END; ++i) {
+		struct lex_tok *s = &c->toks[i];
+		if (s->dyn) {
+			size_t first = lex_cnt;
+			if (!lex_more(arena_strdup(s->str))) return NULL;
+			--lex_cnt; // its end
+			for (; first < lex_cnt; ++first) lex_toks[first].pos = s->pos;
+			continue;
+		}
+		struct lex_tok *t = lex_add(s->type, s->pos);
+		unsigned int gidx = t->gidx;
+		*t = *s;
+		t->gidx = gidx;
+		t->glob = 0;
+		for (g = 0; g < s->glob; ++g) lex_glob(t, c->globs[s->gidx + g]);
+	}
+	lex_add(TOK_END, c->toks[i].pos);
+	return lex_toks;
+}
+
+/*
+ * The word of template c, expanded as a single string (never split, and
+ * with no pathname expansion), or NULL after printing an error.
+ */
+char *tmpl_string(struct tmpl *c) {
+	if (!c->toks->dyn) return c->toks->str;
+	char *w = arena_strdup(c->toks->str);
+	return lex_string(w, w + strlen(w), 0);
+}
+
+/*
+ * The words of template c, expanded, in an array (of *np), or NULL after
+ * printing an error.
+ */
+char **tmpl_words(struct tmpl *c, size_t *np) {
+	struct lex_tok *t = tmpl_expand(c);
+	size_t n = 0, cap = 0, k;
+	char **v = NULL;
+	*np = 0;
+	if (!t) return NULL;
+	for (; t->type != TOK_END; ++t) {
+		char **m = t->glob ? glob_word(t, &k) : NULL;
+		if (!m) {
+			m = &t->str;
+			k = 1;
+		}
+		if (n + k > cap) {
+			v = arena_grow(v, cap * sizeof(char *), 2 * (n + k) * sizeof(char *));
+			cap = 2 * (n + k);
+		}
+		memcpy(v + n, m, k * sizeof(char *));
+		n += k;
+	}
+	*np = n;
+	return v ? v : arena_alloc(0);
+}
+
+const char *vm_docs; // lines of the here-documents being read
+
+/*
+ * Next line of the here-documents of a command, as read while it was
+ * parsed (see doc_line).
+ */
+const char *vm_doc_line(size_t *lenp) {
+	if (!*vm_docs) return NULL;
+	const char *line = vm_docs, *nl = strchr(line, '\n');
+	*lenp = nl - line;
+	vm_docs = nl + 1;
+	return line;
+}
+
+/*
+ * Read the here-documents among the tokens t of the template c (see
+ * doc_read).
+ */
+int tmpl_docs(struct tmpl *c, struct lex_tok *t) {
+	if (!c->docs) return doc_read(t);
+	const char *(*old_line)(size_t *lenp) = doc_line;
+	const char *old_docs = vm_docs;
+	doc_line = vm_doc_line;
+	vm_docs = c->docs;
+	int ok = doc_read(t);
+	doc_line = old_line;
+	vm_docs = old_docs;
+	return ok;
+}
+
+/*
+ * Run the pipeline of the template c.
+ */
+void vm_cmd(struct tmpl *c) {
+	if (jobs) jobs_reap();
+	struct lex_tok *t = tmpl_expand(c);
+	if (!t || !tmpl_docs(c, t)) {
+		if (t) doc_close(t);
+		last_status = 2;
+		return;
+	}
+	exec_toks(arena_strdup(c->text), t, c->bg);
+}
+
+/*
+ * Evaluate the expression of ((expression)), as typed: the status is 0 if
+ * its value is not 0.
+ */
+int vm_arith(char *expr) {
+	struct arena_mark m = arena_tell();
+	long long n;
+	int ok = arith_expand(expr, expr + strlen(expr), &n);
+	arena_rewind(m);
+	return ok && n ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Whether the pattern of template c matches s, as in case.
+ */
+int vm_match(struct tmpl *c, const char *s) {
+	struct lex_tok *t = tmpl_expand(c);
+	if (!t) return 0;
+	if (t->type != TOK_WORD || t[1].type != TOK_END) {
+		// not a single word: its value, literally
+		char *w = tmpl_string(c);
+		return w && strcmp(w, s) == 0;
+	}
+	size_t len = strlen(t->str), i;
+	char *act = arena_alloc(len + 1);
+	memset(act, 0, len);
+	for (i = 0; i < t->glob; ++i) act[lex_globs[t->gidx + i]] = 1;
+	struct glob_pat pat;
+	if (!glob_compile(t->str, act, len, &pat)) return strcmp(t->str, s) == 0;
+	pat.dot = 1; // a leading '.' is not special
+	return glob_match(&pat, s, strlen(s));
+}
+
+/*
+ * Apply the redirections of template c to the shell (see plan_push).
+ * Return 0, after printing an error, on failure.
+ */
+int vm_redir(struct tmpl *c, struct plan *p) {
+	char **assigns;
+	struct lex_tok **redirs;
+	struct lex_tok *t = tmpl_expand(c), *start = t;
+	if (!t || !tmpl_docs(c, t)) {
+		if (t) doc_close(t);
+		return 0;
+	}
+	parse_cmd(&t, &assigns, &redirs);
+	int ok = plan_build(p, redirs, STDIN_FILENO, STDOUT_FILENO, 0) && plan_push(p);
+	if (!ok) plan_close(p);
+	doc_close(start);
+	return ok;
+}
+
+/*
+ * Loop or redirection open in vm_run.
+ */
+struct vm_frame {
+	char **words; // for loop: its words
+	size_t n, i;
+	struct plan plan; // redirections
+	struct arena_mark m; // released when it is left
+};
+
+struct prog *vm_prog; // code being run
+
+/*
+ * Run the code p from pc up to OP_RET.
+ * Each pipeline runs in its own region of the arena, released once it has
+ * run, so that a long loop runs in constant space.
+ */
+void vm_run(struct prog *p, int pc) {
+	struct prog *old = vm_prog;
+	int *st = arena_alloc(p->depth * sizeof(int)); // loop statuses
+	struct vm_frame *fors = arena_alloc(p->depth * sizeof(struct vm_frame));
+	struct vm_frame *redirs = arena_alloc(p->depth * sizeof(struct vm_frame));
+	int nst = 0, nfors = 0, nredirs = 0;
+	char *subject = NULL;
+	struct arena_mark m, case_m;
+	struct vm_frame *f;
+	vm_prog = p;
+	while (1) {
+		struct op *o = &p->ops[pc++];
+		switch (o->code) {
+		case OP_RUN:
+			m = arena_tell();
+			vm_cmd(o->p);
+			arena_rewind(m);
+			if (interactive && (last_status == 128 + SIGINT || last_status == 128 + SIGTSTP)) {
+				// interrupted or stopped: the rest is not run
+				while (nredirs) {
+					f = &redirs[--nredirs];
+					plan_pop(&f->plan);
+					plan_close(&f->plan);
+				}
+				vm_prog = old;
+				return;
+			}
+			break;
+		case OP_NOT:
+			last_status = last_status ? EXIT_SUCCESS : EXIT_FAILURE;
+			break;
+		case OP_JMP:
+			pc = o->arg;
+			break;
+		case OP_JZ:
+			if (!last_status) pc = o->arg;
+			break;
+		case OP_JNZ:
+			if (last_status) pc = o->arg;
+			break;
+		case OP_STATUS:
+			last_status = o->arg;
+			break;
+		case OP_PUSHST:
+			st[nst++] = EXIT_SUCCESS;
+			break;
+		case OP_SAVEST:
+			st[nst - 1] = last_status;
+			break;
+		case OP_POPST:
+			last_status = st[--nst];
+			break;
+		case OP_FOR:
+			f = &fors[nfors++];
+			f->m = arena_tell();
+			f->words = tmpl_words(o->p, &f->n);
+			f->i = 0;
+			if (!f->words) st[nst - 1] = 2;
+			break;
+		case OP_NEXT:
+			f = &fors[nfors - 1];
+			if (f->i < f->n) {
+				size_t len = strlen(o->p);
+				var_put(o->p, len, f->words[f->i++], var_flags(o->p, len) & ~VAR_NOVAL);
+				break;
+			}
+			pc = o->arg;
+			// fall through
+		case OP_FORPOP:
+			arena_rewind(fors[--nfors].m);
+			break;
+		case OP_CASE:
+			case_m = arena_tell();
+			subject = tmpl_string(o->p);
+			break;
+		case OP_PAT:
+			if (subject && vm_match(o->p, subject)) {
+				arena_rewind(case_m);
+				last_status = EXIT_SUCCESS;
+				pc = o->arg;
+			}
+			break;
+		case OP_ESAC:
+			arena_rewind(case_m);
+			last_status = subject ? EXIT_SUCCESS : 2;
+			break;
+		case OP_REDIR:
+			f = &redirs[nredirs];
+			f->m = arena_tell();
+			if (vm_redir(o->p, &f->plan)) {
+				++nredirs;
+			} else {
+				arena_rewind(f->m);
+				last_status = EXIT_FAILURE;
+				pc = o->arg;
+			}
+			break;
+		case OP_UNREDIR:
+			f = &redirs[--nredirs];
+			plan_pop(&f->plan);
+			plan_close(&f->plan);
+			arena_rewind(f->m);
+			break;
+		case OP_ARITH:
+			last_status = vm_arith(o->p);
+			break;
+		case OP_RET:
+			vm_prog = old;
+			return;
+		}
+	}
+}
+
+/*
+ * Close a descriptor of the shell's own (close-on-exec), named name in
+ * /proc/self/fd (see subshell_init).
+ */
+void subshell_close(int dfd, const char *name, int type) {
+	int fd = atoi(name), flags;
+	if (fd > STDERR_FILENO && fd != dfd && (flags = fcntl(fd, F_GETFD)) >= 0 && (flags & FD_CLOEXEC)) close(fd);
+}
+
+/*
+ * Set up a forked copy of the shell which runs commands of its own: the
+ * shell's own descriptors are closed, as no exec closes them (a pipe end
+ * held for another part would keep its reader or writer from seeing the
+ * end), and it has wake-ups, here-documents and jobs of its own.
+ */
+void subshell_init() {
+	int dfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd >= 0) {
+		dir_scan(dfd, subshell_close);
+		close(dfd);
+	}
+	sys_err(pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK));
+	doc_memfd = -1;
+	doc_len = 0;
+	jobs = NULL;
+	if (job_control) {
+		struct sigaction sa;
+		int *sig;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		for (sig = job_sigs; *sig; ++sig) sigaction(*sig, &sa, NULL);
+		job_control = 0;
+	}
+	interactive = 0;
+}
+
+/*
+ * Run the compound command at pc of the code being run in a forked copy of
+ * the shell, set up like a spawned program (see spawn_builtin).
+ * On failure, print an error and return -1.
+ */
+pid_t vm_block(int pc, const struct fd_op *ops, size_t nops, pid_t pgid, int fg) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (pgid >= 0) {
+			setpgid(0, pgid);
+			if (fg) tcsetpgrp(tty_fd, getpgrp());
+		}
+		if ((errno = plan_apply(ops, nops))) {
+			perror(PREF);
+			_exit(EXIT_FAILURE);
+		}
+		subshell_init();
+		vm_run(vm_prog, pc);
+		fflush(stdout);
+		_exit(last_status);
+	}
+	if (pid < 0) {
+		perror(PREF);
+		return -1;
+	}
+	if (pgid >= 0) setpgid(pid, pgid ? pgid : pid);
+	return pid;
+}
+
+/*
+ * Command substitution.
+ * $(command) and `command` are replaced by the output of the command, less
+ * its trailing newlines. The output is captured in out_cap, which is kept
+ * from one substitution to the next, and the lexer copies it straight into
+ * the word, so it is not copied on the way.
+ * Two forms run without a fork: $(<file) reads the file, and a single
+ * builtin marked BI_OUT runs in the shell, writing into out_cap through the
+ * out_* functions. Anything else runs in a forked copy of the shell, with
+ * its output read from a pipe.
+ */
+
+void exec_script(const char *buf, size_t len);
+
+/*
+ * State of the lexer, saved while a command substitution is lexed.
+ */
+struct lex_save {
+	struct lex_tok *toks;
+	size_t cap, cnt;
+	unsigned int *globs;
+	size_t gcap, gcnt;
+	struct glob_dir **dirs;
+	size_t dcap, dcnt;
+	const char *(*doc_line)(size_t *lenp);
+};
+
+void lex_push(struct lex_save *s) {
+	s->toks = lex_toks;
+	s->cap = lex_cap;
+	s->cnt = lex_cnt;
+	s->globs = lex_globs;
+	s->gcap = lex_gcap;
+	s->gcnt = lex_gcnt;
+	s->dirs = glob_dirs;
+	s->dcap = glob_dcap;
+	s->dcnt = glob_dcnt;
+	s->doc_line = doc_line;
+	doc_line = NULL; // its here-documents cannot take the lines after this one
+}
+
+void lex_pop(struct lex_save *s) {
+	lex_toks = s->toks;
+	lex_cap = s->cap;
+	lex_cnt = s->cnt;
+	lex_globs = s->globs;
+	lex_gcap = s->gcap;
+	lex_gcnt = s->gcnt;
+	glob_dirs = s->dirs;
+	glob_dcap = s->dcap;
+	glob_dcnt = s->dcnt;
+	doc_line = s->doc_line;
+}
+
+/*
+ * Append what can be read from fd to out_cap, until the end.
+ * The buffer grows only once full, so that a file read into a buffer of
+ * its size is not moved again.
+ */
+#define CHUNK (64 * 1024)
+void subst_read(int fd) {
+	while (1) {
+		if (out_caplen + 1 >= out_capsize) out_reserve(CHUNK);
+		ssize_t n = read(fd, out_cap + out_caplen, out_capsize - out_caplen - 1);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (n < 0) perror(PREF);
+			return;
+		}
+		out_caplen += n;
+	}
+}
+#undef CHUNK
+
+/*
+ * Output of command (a copy, as lexing modifies it), stripped of trailing
+ * newlines. Sets last_status.
+ * The result is valid until the next substitution.
+ */
+char *subst_run(char *command) {
+	struct lex_save save;
+	lex_push(&save);
+	int lines = strchr(command, '\n') != NULL; // run as a script
+	struct prog *p = NULL;
+	struct tmpl *c = NULL;
+	struct lex_tok *t = NULL;
+	int ok = lines || ((p = parse_unit(command)) && (!(c = prog_cmd(p)) || (t = tmpl_expand(c))));
+	out_caplen = 0; // after the substitutions within it
+	if (!ok) {
+		last_status = 2;
+	} else if ((p && p->ops[0].code == OP_RET) || (t && t->type == TOK_END)) {
+		last_status = EXIT_SUCCESS;
+	} else if (t && t[0].type == TOK_IN && t[0].io <= STDIN_FILENO && t[2].type == TOK_END) {
+		// $(<file)
+		int fd = open(t[1].str, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			prog_warn(errno, t[1].str);
+			last_status = EXIT_FAILURE;
+		} else {
+			struct stat st;
+			if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) out_reserve(st.st_size);
+			subst_read(fd);
+			sys_err(close(fd));
+			last_status = EXIT_SUCCESS;
+		}
+	} else {
+		struct builtin *b = NULL;
+		struct lex_tok *e;
+		for (e = t; e && e->type == TOK_WORD && !e->assign; ++e) ;
+		if (e > t && e->type == TOK_END && !c->bg) b = find_builtin(t->str);
+		if (b && (b->flags & BI_OUT)) {
+			char **assigns;
+			struct lex_tok **redirs;
+			char **argv = parse_cmd(&t, &assigns, &redirs);
+			out_flush();
+			out_capturing = 1;
+			last_status = builtin_run(b, argv);
+			out_capturing = 0;
+		} else {
+			int pfd[2];
+			sys_err(pipe2(pfd, O_CLOEXEC));
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid == 0) {
+				sys_err(dup2(pfd[1], STDOUT_FILENO));
+				subshell_init();
+				if (lines) {
+					exec_script(command, strlen(command));
+				} else if (!t) {
+					vm_run(p, 0);
+				} else if (tmpl_docs(c, t)) {
+					exec_toks(arena_strdup(c->text), t, c->bg);
+				} else {
+					last_status = 2;
+				}
+				fflush(stdout);
+				_exit(last_status);
+			}
+			sys_err(close(pfd[1]));
+			if (pid < 0) {
+				perror(PREF);
+				last_status = EXIT_FAILURE;
+			} else {
+				int status;
+				subst_read(pfd[0]);
+				while (waitpid(pid, &status, 0) < 0) {
+					if (errno != EINTR) sys_err(-1);
+				}
+				last_status = wait_status(status);
+			}
+			sys_err(close(pfd[0]));
+		}
+	}
+	lex_pop(&save);
+	while (out_caplen && out_cap[out_caplen - 1] == '\n') --out_caplen;
+	out_reserve(0);
+	out_cap[out_caplen] = '\0';
+	return out_cap;
+}
+
+/*
+ * Execute an entire command.
+ * Includes piping, redirection, handling builtin commands, and spawning.
+ *
+ * Notes / Salient features:
+ * - presence or absence of spaces, tabs, etc. around |, <, > are supported.
+ * - words may be quoted with '...', "..." or backslashes (see lex).
+ * - words are expanded as in sh: parameters (see lex), then patterns (see
+ *   glob_expand).
+ * - input may be a here-document (<<, <<-) or here-string (<<<), read
+ *   before the command runs (see doc_read).
+ * - $(command), `command` and $(<file) are replaced by their output (see
+ *   subst_run).
+ * - any number of pipes are supported.
+ * - any combination of piping and redirection is supported.
+ * - piped parts are executed concurrently as in bash.
+ * - proper release of resources has been ensured.
+ * - redirections (<, >, >>, <>, n<&m, n>&m, n<&-) apply to any descriptor
+ *   0-9, and are made in the child only (see struct plan), so the shell's
+ *   own descriptors are touched only for some builtins; a failed one is
+ *   reported for its part alone, which gets status 1.
+ * - the exit status of the last piped part is stored in last_status.
+ * - the resource usage of every piped part is recorded (see struct stage),
+ *   and printed if the command is prefixed with 'time'.
+ * - builtins run in the shell, except some piped into another part (see
+ *   struct builtin).
+ * - 'cat' runs in a thread of the shell (see cat_fast).
+ * - a trailing '&' runs the command in the background, as a job.
+ * - a piped part may be given a time limit with 'timeout', kept by the
+ *   shell itself (see builtin_timeout).
+ * - commands may be joined by ;, &, && and ||, and grouped into compound
+ *   commands (if, while, until, for, case, { }, ( )), which may span lines
+ *   (see parse_unit); a compound command within a pipeline runs in a forked
+ *   copy of the shell (see vm_block).
+ * - $((...)), let and ((...)) evaluate 64-bit integer arithmetic in the
+ *   shell (see Arithmetic); variables assigned there keep their value as an
+ *   integer.
+ * - pipes are sized as set by 'pipesize'.
+ * - a malformed line is reported and not run, with status 2.
+ */
+void exec_cmd(char *cmd) {
+	if (jobs) jobs_reap();
+
+	struct prog *p = parse_unit(cmd);
+	if (!p) {
+		last_status = 2;
+		return;
+	}
+	vm_run(p, 0);
+}
+
+/*
+ * Execute the tokens t of the command text, with their here-documents read.
+ */
+#define TIME_PREF "time"
+void exec_toks(char *text, struct lex_tok *t, int bg) {
+	struct lex_tok *toks = t;
+	int pfd[2]; // pipe file descriptors
+	pfd[0] = STDIN_FILENO;
+	pid_t last_pid = -1; // last child started, if any
+
+	// 'time' prefix
+	int timed = 0;
+	if (t->type == TOK_WORD && !t->quoted && strcmp(t->str, TIME_PREF) == 0) {
+		timed = 1;
+		++t;
+	}
+
+	struct lex_tok *end = t;
+	while (end->type != TOK_END) ++end;
+	char *tend = text + end->pos;
+	while (tend > text && (tend[-1] == ' ' || tend[-1] == '\t')) --tend;
+	*tend = '\0';
+
+	struct job *fj = &fg_job;
+	fj->cmd = text + t->pos;
+	fj->pgid = 0;
+	fj->nstages = 0;
+	fj->last = -1;
+	fj->state = JOB_RUNNING;
+	fj->notify = 0;
+	double start = clock_now();
+
+	// loop through every piped part
+	int first = 1;
+	while (1) {
+		char **assigns;
+		struct lex_tok **redirs;
+		struct lex_tok *block = NULL; // compound command (see vm_block)
+		if (t->type == TOK_BLOCK) block = t++;
+		char **argv = parse_cmd(&t, &assigns, &redirs);
+		int more = t->type == TOK_PIPE;
+
+		// piping
+		int in = pfd[0];
+		int out = STDOUT_FILENO;
+		if (more) {
+			// close-on-exec, so that no child holds a stray pipe end
+			sys_err(pipe2(pfd, O_CLOEXEC));
+			out = pfd[1];
+		}
+
+		// redirection, done in the child (background jobs do not read the
+		// shell's input)
+		struct plan plan;
+		int ok = plan_build(&plan, redirs, in, out, bg && !job_control);
+
+		// execution
+		if (more) pipe_resize(pfd[1], plan.file_in || (argv[0] && cat_fast(argv) && argv[1]));
+		if (!argv[0] && !block && first && !more && !bg) {
+			// assignments alone set shell variables
+			for (; *assigns; ++assigns) var_assign(*assigns, 0);
+		}
+		if (!argv[0] && !block && !ok && !more) last_status = EXIT_FAILURE;
+		if (argv[0] || block) {
+			// if program is not empty, execute it, with its assignments
+			// exported for its duration
+			struct var_save *saved = *assigns ? var_push(assigns) : NULL;
+			struct builtin *b = block ? NULL : find_builtin(argv[0]);
+			int status;
+			struct stage *st = stage_add(fj, block ? block->str : argv[0]);
+			int si = fj->nstages - 1;
+			st->start = clock_now();
+			pid_t pgid = job_control ? fj->pgid : -1;
+			int prefixed = ok && b && (b->flags & BI_PREFIX);
+			if (prefixed) {
+				// the rest of the words run as a program, set up by b
+				int k = (*b->fn)(argv);
+				if (k) argv += k;
+				else ok = 0;
+				b = NULL;
+			}
+			if (!ok) {
+				status = prefixed ? 125 : EXIT_FAILURE;
+				st->end = st->start;
+			} else if (block) {
+				st->pid = vm_block(block->pc, plan.ops, plan.n, pgid, job_control && !bg);
+				if (st->pid < 0) {
+					status = EXIT_FAILURE;
+					st->end = st->start;
+				} else {
+					status = 0;
+					st->state = STAGE_RUNNING;
+					last_pid = st->pid;
+					if (job_control && !fj->pgid) fj->pgid = last_pid;
+				}
+			} else if (b && more && !(b->flags & (BI_PARENT | BI_PIPE))) {
+				st->pid = spawn_builtin(b, argv, plan.ops, plan.n, pgid, job_control && !bg);
+				if (st->pid < 0) {
+					status = 127;
+					st->end = st->start;
+				} else {
+					status = 0;
+					st->state = STAGE_RUNNING;
+					last_pid = st->pid;
+					if (job_control && !fj->pgid) fj->pgid = last_pid;
+				}
+			} else if (b) {
+				// builtins run in the shell itself
+				struct rusage before;
+				sys_err(getrusage(RUSAGE_THREAD, &before));
+				if ((b->flags & BI_OUT) && plan_std(&plan, &in, &out)) {
+					// its output goes straight to the planned stdout
+					out_fd = out;
+					status = builtin_run(b, argv);
+					out_fd = STDOUT_FILENO;
+				} else if (plan_push(&plan)) {
+					status = builtin_run(b, argv);
+					plan_pop(&plan);
+				} else {
+					status = EXIT_FAILURE;
+				}
+				st = &fj->stages[si]; // a builtin may add records (parallel)
+				sys_err(getrusage(RUSAGE_THREAD, &st->ru));
+				ru_sub(&st->ru, &before);
+				st->end = clock_now();
+			} else if (!prefixed && cat_fast(argv) && plan_std(&plan, &in, &out) && in != out) {
+				st->cat = cat_start(argv, in, out);
+				st->state = STAGE_RUNNING;
+				status = 0;
+				// now owned by the thread
+				plan_take(&plan, in);
+				plan_take(&plan, out);
+			} else {
+				st->pid = spawn_prog(argv, plan.ops, plan.n, pgid, job_control && !bg);
+				if (st->pid < 0) {
+					status = spawn_status(errno);
+					st->end = st->start;
+				} else {
+					status = 0;
+					st->state = STAGE_RUNNING;
+					last_pid = st->pid;
+					if (job_control && !fj->pgid) fj->pgid = last_pid;
+				}
+			}
+			if (st->pid > 0) {
+				stage_watch(st);
+				if (prefixed) stage_limit(st, &part_limit);
+			}
+			if (saved) var_restore(saved);
+			st->status = status;
+			if (!more) fj->last = si;
+		}
+
+		plan_close(&plan);
+		if (!more) break;
+		++t;
+		first = 0;
+	}
+	doc_close(toks);
+	job_check(fj);
+
+	if (bg && fj->state != JOB_DONE) { // something was started
+		struct job *j = job_detach();
+		j->notify = 0;
+		bg_pid = last_pid;
+		if (interactive) printf("[%d] %d\n", j->id, last_pid);
+		last_status = EXIT_SUCCESS;
+		return;
+	}
+
+	last_status = job_foreground(fj);
+	if (fj->state == JOB_STOPPED) {
+		struct job *j = job_detach();
+		printf("\n");
+		job_print(j, stdout);
+		return;
+	}
+	if (timed) stages_print(fj->stages, fj->nstages, start, clock_now());
+	job_free_cats(fj);
+}
+#undef TIME_PREF
+
+/*
+ * Next line of a here-document from stdin (see doc_line), read into a
+ * buffer of its own, as the command line is still in use.
+ */
+const char *read_doc_line(size_t *lenp) {
+	static char *line = NULL;
+	static size_t linecap = 0;
+	if (interactive) {
+		sys_err(printf("%s", PROMPT2));
+		fflush(stdout);
+	}
+	errno = 0;
+	ssize_t len = getline(&line, &linecap, stdin);
+	if (len < 0) {
+		if (errno) sys_err(-1);
+		return NULL;
+	}
+	if (len > 0 && line[len-1] == '\n') --len;
+	*lenp = len;
+	return line;
+}
+
+const char *script_next; // next line of the script being run
+const char *script_end;
+
+/*
+ * Next line of the script being run, for a here-document (see doc_line).
+ */
+const char *script_line(size_t *lenp) {
+	if (script_next >= script_end) return NULL;
+	const char *line = script_next;
+	const char *nl = memchr(line, '\n', script_end - line);
+	*lenp = (nl ? nl : script_end) - line;
+	script_next = nl ? nl + 1 : script_end;
+	return line;
+}
+
+/*
+ * Execute every line of a script held in memory.
+ * Each line is copied to the arena (as parsing modifies it), so the buffer
+ * itself is left untouched.
+ * Lines starting with '#' (such as "#!/path/to/shell") are skipped.
+ * Lines read as here-documents are consumed through script_line.
+ */
+void exec_script(const char *buf, size_t len) {
+	const char *(*old_line)(size_t *) = doc_line;
+	const char *old_next = script_next, *old_end = script_end;
+	doc_line = script_line;
+	script_next = buf;
+	script_end = buf + len;
+	size_t n;
+	while ((buf = script_line(&n))) {
+		size_t skip = 0;
+		while (skip < n && (buf[skip] == ' ' || buf[skip] == '\t')) ++skip;
+		if (skip < n && buf[skip] != '#') {
+			char *line = arena_alloc(n - skip + 1);
+			memcpy(line, buf + skip, n - skip);
+			line[n - skip] = '\0';
+			exec_cmd(line);
+		}
+		arena_reset();
+	}
+	doc_line = old_line;
+	script_next = old_next;
+	script_end = old_end;
+}
+
+/*
+ * Execute a script file.
+ * Regular files are mapped read-only (so that the pages stay shared with the
+ * page cache); others are read in large blocks.
+ */
+#define BLKSIZE (64 * 1024)
+void exec_file(char *name) {
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	prog_err(fd, name);
+	struct stat st;
+	sys_err(fstat(fd, &st));
+
+	size_t len = st.st_size;
+	if (S_ISREG(st.st_mode) && len > 0) {
+		char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) sys_err(-1);
+		sys_err(close(fd));
+		madvise(buf, len, MADV_SEQUENTIAL);
+		exec_script(buf, len);
+		sys_err(munmap(buf, len));
+		return;
+	}
+
+	size_t cap = BLKSIZE;
+	char *buf = NULL;
+	ssize_t n;
+	len = 0;
+	do {
+		if (cap - len < BLKSIZE) cap *= 2;
+		buf = realloc(buf, cap);
+		if (!buf) sys_err(-1);
+		n = read(fd, buf + len, cap - len);
+		sys_err(n);
+		len += n;
+	} while (n > 0);
+	sys_err(close(fd));
+	exec_script(buf, len);
+	free(buf);
+}
+#undef BLKSIZE
+
+/*
+ * Server mode (shell -s socket).
+ * One warm shell accepts requests on a Unix domain socket, so that callers
+ * (see shell_client.c) do not pay for starting a shell each time.
+ * A request is a 4 byte length followed by the text of a script, with the
+ * caller's stdin, stdout and stderr passed along with the length
+ * (SCM_RIGHTS). The script runs as with -c, with those descriptors as the
+ * shell's own, and its exit status is sent back as 4 bytes.
+ * Requests are served one at a time, and the state of the shell (current
+ * directory, remembered paths, jobs...) carries over from one to the next.
+ * 'exit' stops the server, after replying with its status.
+ * A request longer than SRV_MAXLEN, or which cannot be stored, drops its
+ * connection and leaves the server running.
+ */
+#define SRV_BACKLOG 16
+#define SRV_NFDS 3
+#define SRV_MAXLEN (64 * 1024 * 1024)
+int srv_fds[SRV_NFDS]; // the server's own stdin, stdout and stderr
+int srv_conn = -1; // connection of the request being served
+char *srv_path;
+pid_t srv_pid; // the server itself, rather than a forked copy
+
+/*
+ * Make fds the shell's stdin, stdout and stderr.
+ */
+void srv_io(int *fds) {
+	int i;
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < SRV_NFDS; ++i) sys_err(dup2(fds[i], i));
+}
+
+/*
+ * Send a status back to the caller.
+ */
+void srv_reply(int conn, int status) {
+	int32_t st = status;
+	// the caller may be gone: no SIGPIPE
+	if (send(conn, &st, sizeof(st), MSG_NOSIGNAL) < 0) perror(PREF);
+}
+
+/*
+ * On exit (by 'exit' in a request): reply, and remove the socket.
+ */
+void srv_exit(int status, void *arg) {
+	// forked copies (subshells, substitutions) inherit the handler
+	if (getpid() != srv_pid) return;
+	if (srv_conn >= 0) srv_reply(srv_conn, status);
+	unlink(srv_path);
+}
+
+/*
+ * Read exactly n bytes. Return 0 at end of file before any byte.
+ */
+int srv_read(int fd, void *buf, size_t n) {
+	size_t got = 0;
+	while (got < n) {
+		ssize_t r = read(fd, (char *)buf + got, n - got);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0) return -1;
+		if (r == 0) {
+			if (got) errno = EPROTO;
+			return got ? -1 : 0;
+		}
+		got += r;
+	}
+	return 1;
+}
+
+/*
+ * Receive the header of a request: the length of the script, and the
+ * caller's descriptors.
+ * Return 1 on success, 0 at end of connection, -1 on error.
+ */
+int srv_recv(int conn, uint32_t *lenp, int *fds) {
+	union {
+		char buf[CMSG_SPACE(SRV_NFDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct iovec iov = { lenp, sizeof(*lenp) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	ssize_t n;
+	while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) ;
+	if (n <= 0) return n;
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	int nfds = 0;
+	if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+		nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+	}
+	if (nfds != SRV_NFDS || (size_t)n < sizeof(*lenp)
+			|| srv_read(conn, (char *)lenp + n, sizeof(*lenp) - n) < 0) {
+		while (nfds) close(fds[--nfds]);
+		errno = EPROTO;
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Serve the requests of a connection.
+ */
+void srv_serve(int conn) {
+	static char *buf = NULL; // script text, reused across requests
+	static size_t cap = 0;
+	uint32_t len;
+	int fds[SRV_NFDS];
+	int r;
+	int i;
+	while ((r = srv_recv(conn, &len, fds)) > 0) {
+		if (len > SRV_MAXLEN) {
+			errno = EPROTO;
+			r = -1;
+		} else if ((size_t)len + 1 > cap) {
+			char *p = realloc(buf, (size_t)len + 1);
+			if (p) {
+				buf = p;
+				cap = (size_t)len + 1;
+			} else {
+				r = -1;
+			}
+		}
+		if (r < 0 || srv_read(conn, buf, len) <= 0) {
+			for (i = 0; i < SRV_NFDS; ++i) close(fds[i]);
+			r = -1;
+			break;
+		}
+		srv_io(fds);
+		for (i = 0; i < SRV_NFDS; ++i) close(fds[i]);
+		srv_conn = conn;
+		exec_script(buf, len);
+		srv_conn = -1;
+		srv_io(srv_fds);
+		srv_reply(conn, last_status);
+	}
+	if (r < 0) perror(PREF);
+	close(conn);
+}
+#undef SRV_MAXLEN
+
+void srv_run(char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	// bound under a temporary name, renamed once listening, so that a caller
+	// which finds the socket can connect to it
+	int len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d", path, (int)getpid());
+	if (len < 0 || (size_t)len >= sizeof(addr.sun_path)) self_err("-s: socket path too long");
+
+	int i;
+	for (i = 0; i < SRV_NFDS; ++i) sys_err(srv_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 0));
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sys_err(sock);
+	// a socket left by an earlier server is replaced, not another file
+	struct stat st;
+	if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+		errno = EADDRINUSE;
+		prog_err(-1, path);
+	}
+	unlink(addr.sun_path);
+	prog_err(bind(sock, (struct sockaddr *)&addr, sizeof(addr)), addr.sun_path);
+	sys_err(listen(sock, SRV_BACKLOG));
+	prog_err(rename(addr.sun_path, path), path);
+	srv_path = path;
+	srv_pid = getpid();
+	on_exit(srv_exit, NULL);
+
+	while (1) {
+		int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			sys_err(-1);
+		}
+		srv_serve(conn);
+	}
+}
+#undef SRV_BACKLOG
+
+/*
+ * Usage:
+ * shell: read commands from stdin (with a prompt if it is a terminal).
+ * shell -c command: execute command.
+ * shell file: execute the script in file.
+ * shell -s socket: serve requests on a Unix domain socket (see srv_run).
+ * The exit status is that of the last command executed.
+ */
+int main(int argc, char **argv) {
+	var_init();
+	builtin_init();
+	hash_init();
+	spawn_init();
+	pipesize_init();
+
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		if (argc < 3) self_err("-c: option requires an argument");
+		jobs_init();
+		exec_script(argv[2], strlen(argv[2]));
+		exit(last_status);
+	}
+	if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+		if (argc < 3) self_err("-s: option requires an argument");
+		jobs_init();
+		srv_run(argv[2]);
+	}
+	if (argc > 1) {
+		jobs_init();
+		exec_file(argv[1]);
+		exit(last_status);
+	}
+
+	interactive = isatty(STDIN_FILENO);
+	jobs_init();
+	if (interactive) {
+		hist_init();
+		ed_init();
+	}
+	doc_line = ed_on ? ed_doc_line : read_doc_line;
+	char *line;
+	// shell loop
+	while (1) {
+		if (interactive) {
+			jobs_reap();
+			jobs_notify();
+			if (!ed_on) {
+				print_prompt();
+				wait_input();
+			}
+		}
+		if (!(line = ed_on ? ed_read(PROMPT) : read_cmd())) break;
+		if (line[strspn(line, " \t")]) hist_add(line); // before parsing changes it
+		exec_cmd(line);
+		arena_reset();
 	}
+	exit(last_status);
 }